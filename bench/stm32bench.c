@@ -0,0 +1,386 @@
+#define _GNU_SOURCE	/* posix_openpt() */
+
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+/*
+   Protocol throughput and latency against the bootloader simulator.
+   Results are written as JSON, one record per measurement.
+
+   usage: stm32bench [-s size_kb] [-n rtt_samples] [-o file]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "serial.h"
+#include "stm32.h"
+#include "sim.h"
+
+static const uint32_t bench_rates[] = { 115200, 921600, 0 };	/* 0 leaves the wire unpaced */
+static const uint16_t bench_blocks[] = { 64, 256 };
+
+typedef struct bench {
+	sim_t sim;
+	stm32_ctx_t ctx;
+	int fd;
+	uint32_t rate;
+	FILE *out;
+	uint32_t records;
+} bench_t ;
+
+static double bench_now(void){
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void bench_record(bench_t *bench, const char *name, uint16_t block, uint64_t bytes, double seconds){
+
+	fprintf(bench->out, "%s\n\t\t{\"bench\": \"%s\", \"rate\": %u, \"block\": %u, \"bytes\": %llu, \"seconds\": %.6f, \"bytes_per_sec\": %.1f}",
+		bench->records++ ? "," : "", name, bench->rate, block, (unsigned long long)bytes, seconds, seconds > 0 ? bytes / seconds : 0);
+}
+
+static int bench_open(bench_t *bench, uint32_t rate){
+
+	sim_config_t config;
+
+	memset(&config, 0, sizeof(config));
+	config.rate = rate;
+
+	if (sim_open(&bench->sim, &config) != 0)
+		return -1;
+
+	bench->rate = rate;
+	bench->fd = serial_open(bench->sim.device);
+
+	if (
+		bench->fd < 0 ||
+		serial_setup(bench->fd, SERIAL_BAUD_115200, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOP_BITS_1) != SERIAL_ERR_OK
+	){
+		sim_close(&bench->sim);
+		return -1;
+	}
+
+	stm32_ctx_init(&bench->ctx, bench->fd);
+	stm32_ctx_rate(&bench->ctx, rate);
+
+	if (stm32_init(&bench->ctx) != STM32_ERR_OK){
+		serial_close(bench->fd);
+		sim_close(&bench->sim);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void bench_close(bench_t *bench){
+	serial_close(bench->fd);
+	sim_close(&bench->sim);
+}
+
+static int bench_write(bench_t *bench, const uint8_t *image, uint32_t size, uint16_t block){
+
+	uint32_t base = bench->sim.flash_base;
+	uint32_t offset = 0;
+	double start = bench_now();
+
+	for(offset = 0; offset < size; offset += block)
+		if (stm32_write(&bench->ctx, base + offset, image + offset, block) != STM32_ERR_OK)
+			return -1;
+
+	bench_record(bench, "write", block, size, bench_now() - start);
+
+	return 0;
+}
+
+static int bench_read(bench_t *bench, uint32_t size, uint16_t block){
+
+	uint32_t base = bench->sim.flash_base;
+	uint32_t offset = 0;
+	double start = bench_now();
+
+	for(offset = 0; offset < size; offset += block){
+
+		uint8_t *data;
+
+		if (stm32_read(&bench->ctx, base + offset, &data, block) != STM32_ERR_OK)
+			return -1;
+	}
+
+	bench_record(bench, "read", block, size, bench_now() - start);
+
+	return 0;
+}
+
+static int bench_verify(bench_t *bench, const uint8_t *image, uint32_t size, uint16_t block){
+
+	uint32_t base = bench->sim.flash_base;
+	uint32_t offset = 0;
+	double start = bench_now();
+
+	for(offset = 0; offset < size; offset += block){
+
+		uint8_t *data;
+
+		if (stm32_read(&bench->ctx, base + offset, &data, block) != STM32_ERR_OK)
+			return -1;
+
+		if (memcmp(data, image + offset, block) != 0)
+			return -1;
+	}
+
+	bench_record(bench, "verify", block, size, bench_now() - start);
+
+	return 0;
+}
+
+/* protocol cost only, the simulator erases instantly */
+static int bench_erase(bench_t *bench){
+
+	const geometry_t *geometry = bench->sim.config.geometry;
+	uint16_t pages[4] = { 0, 1, 2, 3 };
+	uint32_t bytes = 0;
+	uint32_t i = 0;
+
+	for(i = 0; i < 4; i++){
+
+		uint32_t address;
+		uint32_t size;
+
+		geometry_page(geometry, pages[i], &address, &size);
+		bytes += size;
+	}
+
+	double start = bench_now();
+
+	for(i = 0; i < 4; i++)
+		if (stm32_extended_erase(&bench->ctx, &pages[i], 1) != STM32_ERR_OK)
+			return -1;
+
+	bench_record(bench, "erase", 0, bytes, bench_now() - start);
+
+	return 0;
+}
+
+static int compare_double(const void *a, const void *b){
+
+	double da = *(const double*)a;
+	double db = *(const double*)b;
+
+	return da < db ? -1 : da > db;
+}
+
+/* 'get id' round trips */
+static int bench_rtt(bench_t *bench, uint32_t samples){
+
+	double *rtt = malloc(samples * sizeof(double));
+	uint32_t i = 0;
+
+	if (rtt == NULL)
+		return -1;
+
+	for(i = 0; i < samples; i++){
+
+		uint8_t *id;
+		uint8_t id_size;
+		double start = bench_now();
+
+		if (stm32_get_id(&bench->ctx, &id, &id_size) != STM32_ERR_OK){
+			free(rtt);
+			return -1;
+		}
+
+		rtt[i] = (bench_now() - start) * 1e6;
+	}
+
+	qsort(rtt, samples, sizeof(double), compare_double);
+
+	fprintf(bench->out, "%s\n\t\t{\"bench\": \"rtt\", \"command\": \"get_id\", \"rate\": %u, \"samples\": %u, \"min_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}",
+		bench->records++ ? "," : "", bench->rate, samples,
+		rtt[0], rtt[samples / 2], rtt[(uint64_t)samples * 99 / 100], rtt[samples - 1]);
+
+	free(rtt);
+
+	return 0;
+}
+
+/* raw serial_write()/serial_read() cost, the far end of the pty is driven inline */
+static int bench_serial(bench_t *bench, int master, int slave, uint16_t block, uint32_t rounds){
+
+	uint8_t buffer[0x100];
+	double write_s = 0;
+	double read_s = 0;
+	uint32_t i = 0;
+
+	memset(buffer, 0x55, sizeof(buffer));
+
+	for(i = 0; i < rounds; i++){
+
+		double start = bench_now();
+
+		if (serial_write(slave, buffer, block) != SERIAL_ERR_OK)
+			return -1;
+
+		write_s += bench_now() - start;
+
+		if (read(master, buffer, block) != block || write(master, buffer, block) != block)
+			return -1;
+
+		start = bench_now();
+
+		if (serial_read(slave, buffer, block) != SERIAL_ERR_OK)
+			return -1;
+
+		read_s += bench_now() - start;
+	}
+
+	bench->rate = 0;
+	bench_record(bench, "serial_write", block, (uint64_t)block * rounds, write_s);
+	bench_record(bench, "serial_read", block, (uint64_t)block * rounds, read_s);
+
+	return 0;
+}
+
+static int bench_serial_run(bench_t *bench){
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	int slave = -1;
+	int result = -1;
+	uint32_t i = 0;
+
+	if (master < 0)
+		return -1;
+
+	if (grantpt(master) == 0 && unlockpt(master) == 0)
+		slave = serial_open(ptsname(master));
+
+	if (
+		slave >= 0 &&
+		serial_setup(slave, SERIAL_BAUD_115200, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOP_BITS_1) == SERIAL_ERR_OK
+	)
+		result = 0;
+
+	for(i = 0; i < sizeof(bench_blocks) / sizeof(bench_blocks[0]) && result == 0; i++)
+		result = bench_serial(bench, master, slave, bench_blocks[i], 2000);
+
+	if (slave >= 0)
+		serial_close(slave);
+
+	close(master);
+
+	return result;
+}
+
+int main(int argc, char *argv[]){
+
+	bench_t bench;
+	uint32_t size = 16 * 1024;
+	uint32_t samples = 200;
+	const char *path = NULL;
+	int option;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.out = stdout;
+
+	while((option = getopt(argc, argv, "s:n:o:")) != -1){
+		switch(option){
+			case 's': size = strtoul(optarg, NULL, 0) * 1024; break;
+			case 'n': samples = strtoul(optarg, NULL, 0); break;
+			case 'o': path = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-s size_kb] [-n rtt_samples] [-o file]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (size == 0 || samples == 0)
+		return 2;
+
+	uint8_t *image = malloc(size);
+
+	if (image == NULL)
+		return 1;
+
+	uint32_t i = 0;
+	uint32_t seed = 1;
+
+	for(i = 0; i < size; i++){
+		seed = seed * 1103515245 + 12345;
+		image[i] = seed >> 16;
+	}
+
+	if (path != NULL && (bench.out = fopen(path, "w")) == NULL){
+		perror(path);
+		return 1;
+	}
+
+	fprintf(bench.out, "{\n\t\"size\": %u,\n\t\"results\": [", size);
+
+	int result = 0;
+	uint32_t r = 0;
+	uint32_t b = 0;
+
+	for(r = 0; r < sizeof(bench_rates) / sizeof(bench_rates[0]) && result == 0; r++){
+
+		if (bench_open(&bench, bench_rates[r]) != 0){
+			result = -1;
+			break;
+		}
+
+		/* the simulator starts blank, every block size rewrites the same area after an erase */
+		for(b = 0; b < sizeof(bench_blocks) / sizeof(bench_blocks[0]) && result == 0; b++){
+			result = stm32_extended_erase_special(&bench.ctx, STM32_ERASE_MASS) != STM32_ERR_OK ||
+				bench_write(&bench, image, size, bench_blocks[b]) != 0 ||
+				bench_read(&bench, size, bench_blocks[b]) != 0 ||
+				bench_verify(&bench, image, size, bench_blocks[b]) != 0;
+		}
+
+		if (result == 0)
+			result = bench_erase(&bench) != 0 || bench_rtt(&bench, samples) != 0;
+
+		bench_close(&bench);
+	}
+
+	if (result == 0)
+		result = bench_serial_run(&bench);
+
+	fprintf(bench.out, "\n\t]\n}\n");
+
+	if (bench.out != stdout)
+		fclose(bench.out);
+
+	free(image);
+
+	if (result != 0){
+		fprintf(stderr, "%s: benchmark failed at rate %u\n", argv[0], bench.rate);
+		return 1;
+	}
+
+	return 0;
+}
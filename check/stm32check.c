@@ -0,0 +1,1664 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+/*
+   Flashing, verification, dumps and image loading against the bootloader simulator.
+   Prints one line per case and exits non-zero when any of them fails.
+
+   usage: stm32check
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include "serial.h"
+#include "stm32.h"
+#include "stm32_flash.h"
+#include "stm32_verify.h"
+#include "stm32_dump.h"
+#include "stm32_cache.h"
+#include "stm32_journal.h"
+#include "stm32_baud.h"
+#include "capture.h"
+#include "farm.h"
+#include "stm32_async.h"
+#include "metrics.h"
+#include "timeline.h"
+#include "crc32.h"
+#include "sha256.h"
+#include "image_load.h"
+#include "sim.h"
+
+/* two segments, the first one starts mid page and spans three 16 KiB sectors */
+#define CHECK_LOW_OFFSET	0x100
+#define CHECK_LOW_SIZE		40000
+#define CHECK_HIGH_OFFSET	0x20000
+#define CHECK_HIGH_SIZE		5000
+
+#define CHECK_DUMP_SIZE		0x30000	/* both segments and a blank tail */
+
+#define CHECK_PATH_MAX		256
+
+typedef struct check {
+	sim_t sim;
+	stm32_ctx_t ctx;
+	int fd;
+	uint32_t passed;
+	uint32_t failed;
+	char dir[CHECK_PATH_MAX];
+} check_t ;
+
+static uint8_t check_low[CHECK_LOW_SIZE];
+static uint8_t check_high[CHECK_HIGH_SIZE];
+static uint8_t check_helper[0x400];
+static uint8_t check_stall[0x40000];
+
+static int check_result(check_t *check, const char *name, int ok){
+
+	printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+
+	if (ok)
+		check->passed++;
+	else
+		check->failed++;
+
+	return ok;
+}
+
+static int check_open_sim(check_t *check, const sim_config_t *config){
+
+	if (sim_open(&check->sim, config) != 0)
+		return -1;
+
+	check->fd = serial_open(check->sim.device);
+
+	if (
+		check->fd < 0 ||
+		serial_setup(check->fd, SERIAL_BAUD_115200, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOP_BITS_1) != SERIAL_ERR_OK
+	){
+		sim_close(&check->sim);
+		return -1;
+	}
+
+	stm32_ctx_init(&check->ctx, check->fd);
+
+	if (stm32_init(&check->ctx) != STM32_ERR_OK){
+		serial_close(check->fd);
+		sim_close(&check->sim);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_open(check_t *check, uint8_t checksum){
+
+	sim_config_t config;
+
+	memset(&config, 0, sizeof(config));
+	config.checksum = checksum;
+
+	return check_open_sim(check, &config);
+}
+
+static void check_close(check_t *check){
+	serial_close(check->fd);
+	sim_close(&check->sim);
+}
+
+static void check_image(check_t *check, image_t *image){
+
+	image_init(image);
+	image_add(image, check->sim.flash_base + CHECK_LOW_OFFSET, check_low, sizeof(check_low));
+	image_add(image, check->sim.flash_base + CHECK_HIGH_OFFSET, check_high, sizeof(check_high));
+}
+
+/* the simulated flash holds the image */
+static int check_programmed(check_t *check){
+
+	return memcmp(check->sim.flash + CHECK_LOW_OFFSET, check_low, sizeof(check_low)) == 0 &&
+		memcmp(check->sim.flash + CHECK_HIGH_OFFSET, check_high, sizeof(check_high)) == 0;
+}
+
+/* an image without data has no pages to compare, which is not an error */
+static void check_flash_empty(check_t *check){
+
+	stm32_flash_t flash;
+	image_t image;
+
+	if (check_open(check, 0) != 0){
+		check_result(check, "flash delta of an empty image", 0);
+		return;
+	}
+
+	image_init(&image);
+
+	memset(&flash, 0, sizeof(flash));
+	flash.image = &image;
+	flash.geometry = check->sim.config.geometry;
+	flash.mode = STM32_FLASH_DELTA;
+
+	check_result(check, "flash delta of an empty image",
+		stm32_flash(&check->ctx, &flash) == STM32_ERR_OK && flash.pages_total == 0 && flash.pages_changed == 0
+	);
+
+	image_free(&image);
+	check_close(check);
+}
+
+static void check_flash_mode(check_t *check, const char *name, stm32_flash_mode_t mode, int helper, int packed){
+
+	stm32_flash_t flash;
+	stm32_pack_t pack;
+	image_t image;
+
+	if (check_open(check, 0) != 0){
+		check_result(check, name, 0);
+		return;
+	}
+
+	/* page based modes have to erase what is there, delta finds one changed sector */
+	if (mode == STM32_FLASH_DELTA){
+		memcpy(check->sim.flash + CHECK_LOW_OFFSET, check_low, sizeof(check_low));
+		memcpy(check->sim.flash + CHECK_HIGH_OFFSET, check_high, sizeof(check_high));
+		check->sim.flash[0x5000] ^= 0xFF;
+	} else if (mode != STM32_FLASH_WRITE)
+		memset(check->sim.flash, 0, CHECK_HIGH_OFFSET + CHECK_HIGH_SIZE);
+
+	check_image(check, &image);
+
+	memset(&flash, 0, sizeof(flash));
+	flash.image = &image;
+	flash.geometry = check->sim.config.geometry;
+	flash.mode = mode;
+
+	if (helper){
+		flash.helper = check_helper;
+		flash.helper_size = sizeof(check_helper);
+		flash.helper_address = SIM_RAM_BASE + 0x4000;
+	}
+
+	/* the blocks go out LZ4 compressed for the simulated helper to expand */
+	int ok = !packed || stm32_pack_init(&pack, &image, flash.geometry, 0) == 0;
+
+	if (packed)
+		flash.pack = &pack;
+
+	stm32_errors_t result = ok ? stm32_flash(&check->ctx, &flash) : STM32_ERR_SYSTEM;
+
+	check_result(check, name,
+		result == STM32_ERR_OK && check_programmed(check) &&
+		(mode != STM32_FLASH_DELTA || flash.pages_changed == 1) &&
+		(!helper || check->sim.stats.helper_blocks > 0) &&
+		(!packed || (flash.blocks_packed > 0 && flash.bytes_packed < image_size(&image) && check->sim.stats.helper_errors == 0))
+	);
+
+	if (packed && ok)
+		stm32_pack_free(&pack);
+
+	image_free(&image);
+	check_close(check);
+}
+
+static stm32_errors_t check_flash_cached(check_t *check, stm32_flash_t *flash, image_t *image, stm32_cache_t *cache){
+
+	memset(flash, 0, sizeof(stm32_flash_t));
+	flash->image = image;
+	flash->geometry = check->sim.config.geometry;
+	flash->mode = STM32_FLASH_DELTA;
+	flash->cache = cache;
+	flash->cache_samples = 4;
+
+	return stm32_flash(&check->ctx, flash);
+}
+
+/* a reopened cache answers for every page until the flash changes behind it */
+static void check_cache(check_t *check){
+
+	stm32_flash_t flash;
+	stm32_cache_t cache;
+	image_t image;
+
+	if (check_open(check, 0) != 0){
+		check_result(check, "flash delta with a stale cache", 0);
+		return;
+	}
+
+	check_image(check, &image);
+
+	const geometry_t *geometry = check->sim.config.geometry;
+	int ok = stm32_cache_open(&check->ctx, &cache, check->dir, geometry, 0) == STM32_ERR_OK;
+
+	ok = ok && check_flash_cached(check, &flash, &image, &cache) == STM32_ERR_OK &&
+		check_programmed(check) && flash.pages_read == flash.pages_total && !flash.cache_stale;
+
+	stm32_cache_close(&cache);
+
+	ok = ok && stm32_cache_open(&check->ctx, &cache, check->dir, geometry, 0) == STM32_ERR_OK &&
+		check_flash_cached(check, &flash, &image, &cache) == STM32_ERR_OK &&
+		flash.pages_read == 0 && flash.frames_written == 0 && !flash.cache_stale;
+
+	/* another tool cleared the footprint pages, any sample finds it */
+	uint16_t *pages = NULL;
+	uint32_t pages_size = 0;
+	uint32_t i = 0;
+
+	ok = ok && stm32_erase_plan(&image, geometry, &pages, &pages_size) == STM32_ERR_OK;
+
+	for(i = 0; i < pages_size; i++){
+
+		uint32_t address, size;
+
+		geometry_page(geometry, pages[i], &address, &size);
+		memset(check->sim.flash + (address - check->sim.flash_base), 0x00, size);
+	}
+
+	free(pages);
+
+	ok = ok && check_flash_cached(check, &flash, &image, &cache) == STM32_ERR_OK &&
+		flash.cache_stale && flash.pages_changed == flash.pages_total && check_programmed(check);
+
+	check_result(check, "flash delta with a stale cache", ok);
+
+	if (cache.path[0] != '\0')
+		unlink(cache.path);
+
+	stm32_cache_close(&cache);
+	image_free(&image);
+	check_close(check);
+}
+
+/* the target goes silent after 100 commands, the rerun picks up with the same journal */
+static void check_resume(check_t *check, const char *name, int tamper){
+
+	stm32_flash_t flash;
+	stm32_journal_t journal;
+	image_t image;
+	char path[PATH_MAX];
+	uint32_t address, size;
+	uint16_t page;
+
+	if (check_open(check, 0) != 0){
+		check_result(check, name, 0);
+		return;
+	}
+
+	memset(check->sim.flash, 0, CHECK_HIGH_OFFSET + CHECK_HIGH_SIZE);
+	check_image(check, &image);
+
+	memset(&flash, 0, sizeof(flash));
+	flash.image = &image;
+	flash.geometry = check->sim.config.geometry;
+	flash.mode = STM32_FLASH_PAGES;
+	flash.journal = &journal;
+
+	int ok = stm32_journal_open(&check->ctx, &journal, check->dir, &image, flash.geometry, 0) == STM32_ERR_OK;
+
+	path[0] = '\0';
+
+	if (ok)
+		memcpy(path, journal.path, sizeof(path));
+
+	/* the erase and 99 frames, well into the second sector */
+	check->sim.config.drop_after = check->sim.stats.commands + 100;
+
+	ok = ok && stm32_flash(&check->ctx, &flash) == STM32_ERR_TIMEOUT && !check_programmed(check) && access(path, F_OK) == 0;
+
+	stm32_journal_close(&journal);
+
+	/* a frame below the resume point no longer matches */
+	if (tamper)
+		memset(check->sim.flash + CHECK_LOW_OFFSET, 0x00, sizeof(check_low));
+
+	check->sim.config.drop_after = 0;
+	sim_reset(&check->sim);
+	serial_io_discard(&check->ctx.io);
+
+	ok = ok && stm32_init(&check->ctx) == STM32_ERR_OK &&
+		stm32_journal_open(&check->ctx, &journal, check->dir, &image, flash.geometry, 0) == STM32_ERR_OK &&
+		journal.records > 0 && stm32_flash(&check->ctx, &flash) == STM32_ERR_OK;
+
+	/* a finished journal takes no more records */
+	ok = ok && journal.fd < 0 && stm32_journal_erased_all(&journal) == STM32_ERR_INVALID_ARGUMENT;
+
+	stm32_journal_close(&journal);
+
+	/* the rollback page holding the last frame is redone from its base */
+	if (tamper)
+		ok = ok && flash.frames_resumed == 0 && flash.resume_address == 0;
+	else
+		ok = ok && flash.frames_resumed > 0 && flash.resume_address > check->sim.flash_base + CHECK_LOW_OFFSET &&
+			geometry_find(flash.geometry, flash.resume_address, &page) == 0 &&
+			geometry_page(flash.geometry, page, &address, &size) == 0 && address == flash.resume_address;
+
+	check_result(check, name, ok && check_programmed(check) && access(path, F_OK) != 0);
+
+	if (path[0] != '\0')
+		unlink(path);
+
+	image_free(&image);
+	check_close(check);
+}
+
+/* overlapping or backwards segments are refused before anything is sent */
+static void check_unordered(check_t *check){
+
+	stm32_flash_t flash;
+	image_t image;
+	uint16_t *pages = NULL;
+	uint32_t pages_size = 0;
+
+	if (check_open(check, 0) != 0){
+		check_result(check, "flash unordered image", 0);
+		return;
+	}
+
+	image_init(&image);
+	image_add(&image, check->sim.flash_base + CHECK_HIGH_OFFSET, check_high, sizeof(check_high));
+	image_add(&image, check->sim.flash_base + CHECK_LOW_OFFSET, check_low, sizeof(check_low));
+
+	memset(&flash, 0, sizeof(flash));
+	flash.image = &image;
+	flash.geometry = check->sim.config.geometry;
+	flash.mode = STM32_FLASH_WRITE;
+
+	uint32_t commands = check->sim.stats.commands;
+
+	check_result(check, "flash unordered image",
+		stm32_flash(&check->ctx, &flash) == STM32_ERR_INVALID_ARGUMENT &&
+		stm32_write_image(&check->ctx, &image, NULL, NULL) == STM32_ERR_INVALID_ARGUMENT &&
+		stm32_erase_plan(&image, flash.geometry, &pages, &pages_size) == STM32_ERR_INVALID_ARGUMENT &&
+		check->sim.stats.commands == commands
+	);
+
+	free(pages);
+	image_free(&image);
+	check_close(check);
+}
+
+#define CHECK_FARM_SIMS		3
+
+/* two good targets, one with write protected flash and one missing port */
+static void check_farm(check_t *check){
+
+	sim_t sims[CHECK_FARM_SIMS];
+	farm_port_t ports[CHECK_FARM_SIMS + 1];
+	farm_t farm;
+	image_t image;
+	uint32_t opened = 0;
+	uint32_t i = 0;
+
+	memset(ports, 0, sizeof(ports));
+
+	for(opened = 0; opened < CHECK_FARM_SIMS; opened++){
+
+		if (sim_open(&sims[opened], NULL) != 0)
+			break;
+
+		ports[opened].device = sims[opened].device;
+	}
+
+	ports[CHECK_FARM_SIMS].device = "/dev/stm32check-missing";
+
+	int ok = opened == CHECK_FARM_SIMS;
+
+	if (ok)
+		sims[1].wrp[0] = 0x01;
+
+	/* the simulators default to this layout */
+	const geometry_t *geometry = &geometry_stm32f4_1m;
+
+	image_init(&image);
+	image_add(&image, geometry->base + CHECK_LOW_OFFSET, check_low, sizeof(check_low));
+	image_add(&image, geometry->base + CHECK_HIGH_OFFSET, check_high, sizeof(check_high));
+
+	memset(&farm, 0, sizeof(farm));
+	farm.ports = ports;
+	farm.workers = 2;
+	farm.job.image = &image;
+	farm.job.geometry = geometry;
+	farm.job.mode = STM32_FLASH_PAGES;
+
+	/* an empty list is refused before any thread starts */
+	farm.ports_count = 0;
+	ok = ok && farm_run(&farm) == -1;
+
+	farm.ports_count = CHECK_FARM_SIMS + 1;
+	ok = ok && farm_run(&farm) == 1 && farm.ports_ok == 2 &&
+		ports[0].stage == FARM_STAGE_DONE && ports[2].stage == FARM_STAGE_DONE &&
+		ports[1].stage == FARM_STAGE_FLASH && ports[1].result == STM32_ERR_PROTOCOL &&
+		ports[3].stage == FARM_STAGE_OPEN && ports[3].result == STM32_ERR_SERIAL;
+
+	for(i = 0; i < opened; i++){
+
+		ok = ok && (i == 1 || (
+			memcmp(sims[i].flash + CHECK_LOW_OFFSET, check_low, sizeof(check_low)) == 0 &&
+			memcmp(sims[i].flash + CHECK_HIGH_OFFSET, check_high, sizeof(check_high)) == 0
+		));
+
+		sim_close(&sims[i]);
+	}
+
+	check_result(check, "farm with a failing port", ok);
+
+	image_free(&image);
+}
+
+#define CHECK_ASYNC_PORTS	3
+
+typedef struct check_async {
+	sim_t sim;
+	stm32_ctx_t ctx;
+	stm32_async_t op;
+	int fd;
+	uint32_t reads;
+} check_async_t ;
+
+/* 'init' is followed by a read of the first block from the done callback */
+static int check_async_done(stm32_async_t *op, void *arg){
+
+	check_async_t *port = arg;
+
+	if (op->state != STM32_ASYNC_DONE)
+		return 0;
+
+	if (op->command == STM32_INIT)
+		return stm32_async_read(op, op->ctx, port->sim.flash_base + CHECK_LOW_OFFSET, 0x100) == STM32_ERR_OK;
+
+	port->reads += op->command == STM32_READ && op->rx_size == 0x100 && memcmp(op->rx, check_low, 0x100) == 0;
+
+	return 0;
+}
+
+/* three ports from one thread, the last one answers too late and times out alone */
+static void check_async(check_t *check){
+
+	static check_async_t ports[CHECK_ASYNC_PORTS];
+	stm32_async_t *ops[CHECK_ASYNC_PORTS];
+	uint32_t opened = 0;
+	uint32_t i = 0;
+
+	for(opened = 0; opened < CHECK_ASYNC_PORTS; opened++){
+
+		check_async_t *port = &ports[opened];
+		sim_config_t config;
+
+		memset(&config, 0, sizeof(config));
+		config.latency_us = opened == CHECK_ASYNC_PORTS - 1 ? 3 * STM32_TIMEOUT_ACK * 1000 : 0;
+
+		if (sim_open(&port->sim, &config) != 0)
+			break;
+
+		port->fd = serial_open(port->sim.device);
+
+		if (
+			port->fd < 0 ||
+			serial_setup(port->fd, SERIAL_BAUD_115200, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOP_BITS_1) != SERIAL_ERR_OK ||
+			serial_nonblock(port->fd, 1) != SERIAL_ERR_OK
+		){
+			serial_close(port->fd);
+			sim_close(&port->sim);
+			break;
+		}
+
+		memcpy(port->sim.flash + CHECK_LOW_OFFSET, check_low, sizeof(check_low));
+
+		stm32_ctx_init(&port->ctx, port->fd);
+		stm32_ctx_rate(&port->ctx, 115200);
+
+		port->reads = 0;
+		port->op.done = check_async_done;
+		port->op.done_arg = port;
+		ops[opened] = &port->op;
+	}
+
+	int poll_fd = serial_poll_open();
+	int ok = opened == CHECK_ASYNC_PORTS && poll_fd >= 0;
+
+	/* bytes left in the buffered port would be lost to the ops */
+	if (ok){
+		ports[0].ctx.io.tail = 1;
+		ok = stm32_async_init(&ports[0].op, &ports[0].ctx) == STM32_ERR_INVALID_ARGUMENT;
+		ports[0].ctx.io.tail = 0;
+	}
+
+	for(i = 0; i < opened && ok; i++)
+		ok = stm32_async_init(&ports[i].op, &ports[i].ctx) == STM32_ERR_OK;
+
+	ok = ok && stm32_async_run(poll_fd, ops, CHECK_ASYNC_PORTS) == 1;
+
+	for(i = 0; i < opened && ok; i++){
+
+		check_async_t *port = &ports[i];
+
+		if (i == CHECK_ASYNC_PORTS - 1)
+			ok = port->op.state == STM32_ASYNC_FAILED && port->op.result == STM32_ERR_TIMEOUT &&
+				port->op.command == STM32_INIT && port->reads == 0;
+		else
+			ok = port->op.state == STM32_ASYNC_DONE && port->op.result == STM32_ERR_OK && port->reads == 1;
+	}
+
+	check_result(check, "async ports with one timing out", ok);
+
+	if (poll_fd >= 0)
+		close(poll_fd);
+
+	for(i = 0; i < opened; i++){
+		serial_close(ports[i].fd);
+		sim_close(&ports[i].sim);
+	}
+}
+
+/* strict enough JSON syntax check, returns the end of the value or NULL */
+static const char *check_json_value(const char *text, int depth);
+
+static const char *check_json_space(const char *text){
+
+	while(*text == ' ' || *text == '\n' || *text == '\r' || *text == '\t')
+		text++;
+
+	return text;
+}
+
+static const char *check_json_string(const char *text){
+
+	if (*text++ != '"')
+		return NULL;
+
+	for(; *text != '"'; text++){
+
+		if ((unsigned char)*text < 0x20)
+			return NULL;
+
+		if (*text == '\\' && strchr("\"\\/bfnrtu", *++text) == NULL)
+			return NULL;
+	}
+
+	return text + 1;
+}
+
+static const char *check_json_list(const char *text, int depth, char close, int members){
+
+	text = check_json_space(text + 1);
+
+	if (*text == close)
+		return text + 1;
+
+	while(text != NULL){
+
+		if (members){
+			text = check_json_string(check_json_space(text));
+			text = text != NULL ? check_json_space(text) : NULL;
+
+			if (text == NULL || *text++ != ':')
+				return NULL;
+		}
+
+		text = check_json_value(text, depth + 1);
+
+		if (text == NULL)
+			return NULL;
+
+		text = check_json_space(text);
+
+		if (*text == close)
+			return text + 1;
+
+		if (*text++ != ',')
+			return NULL;
+	}
+
+	return NULL;
+}
+
+static const char *check_json_value(const char *text, int depth){
+
+	char *end;
+
+	text = check_json_space(text);
+
+	if (depth > 32)
+		return NULL;
+
+	switch(*text){
+		case '{': return check_json_list(text, depth, '}', 1);
+		case '[': return check_json_list(text, depth, ']', 0);
+		case '"': return check_json_string(text);
+		case 't': return strncmp(text, "true", 4) == 0 ? text + 4 : NULL;
+		case 'f': return strncmp(text, "false", 5) == 0 ? text + 5 : NULL;
+		case 'n': return strncmp(text, "null", 4) == 0 ? text + 4 : NULL;
+	}
+
+	if (*text != '-' && !isdigit((unsigned char)*text))
+		return NULL;
+
+	strtod(text, &end);
+
+	return end != text ? end : NULL;
+}
+
+static int check_json(const char *text){
+
+	text = text != NULL ? check_json_value(text, 0) : NULL;
+
+	return text != NULL && *check_json_space(text) == '\0';
+}
+
+/* every histogram counts up to +Inf and its _count, nothing else but comments in between */
+static int check_prometheus(const char *text){
+
+	char series[256] = "";
+	unsigned long long last = 0;
+	unsigned long long inf = 0;
+	int histograms = 0;
+
+	while(*text != '\0'){
+
+		const char *eol = strchr(text, '\n');
+		char line[512];
+		char labels[256];
+		unsigned long long value;
+
+		if (eol == NULL || eol - text >= (int)sizeof(line))
+			return 0;
+
+		memcpy(line, text, eol - text);
+		line[eol - text] = '\0';
+		text = eol + 1;
+
+		if (line[0] == '#')
+			continue;
+
+		char *le = strstr(line, ",le=\"");
+
+		if (strncmp(line, "stm32_command_latency_seconds_bucket{", 37) == 0 && le != NULL){
+
+			if (sscanf(strchr(le, '}'), "} %llu", &value) != 1)
+				return 0;
+
+			snprintf(labels, sizeof(labels), "%.*s", (int)(le - line - 37), line + 37);
+
+			/* a new series starts from zero */
+			if (strcmp(labels, series) != 0){
+				snprintf(series, sizeof(series), "%s", labels);
+				last = 0;
+				histograms++;
+			}
+
+			if (value < last)
+				return 0;
+
+			last = value;
+			inf = value;
+			continue;
+		}
+
+		if (strncmp(line, "stm32_command_latency_seconds_count{", 36) == 0){
+
+			if (sscanf(strchr(line, '}'), "} %llu", &value) != 1 || value != inf || strncmp(line + 36, series, strlen(series)) != 0)
+				return 0;
+
+			continue;
+		}
+
+		/* counters, sums */
+		if (strncmp(line, "stm32_", 6) != 0 || strchr(line, '{') == NULL || strchr(line, '}') == NULL)
+			return 0;
+	}
+
+	return histograms > 0;
+}
+
+static void check_flash_observed(check_t *check, stm32_flash_t *flash, image_t *image){
+
+	memset(check->sim.flash, 0, CHECK_HIGH_OFFSET + CHECK_HIGH_SIZE);
+	check_image(check, image);
+
+	memset(flash, 0, sizeof(stm32_flash_t));
+	flash->image = image;
+	flash->geometry = check->sim.config.geometry;
+	flash->mode = STM32_FLASH_PAGES;
+}
+
+/* a flash with metrics attached exports parseable JSON and monotonic Prometheus buckets */
+static void check_metrics(check_t *check){
+
+	metrics_t metrics;
+	metrics_t *ports[1] = { &metrics };
+	stm32_flash_t flash;
+	image_t image;
+	char *json = NULL;
+	char *prometheus = NULL;
+	size_t size = 0;
+
+	if (check_open(check, 0) != 0){
+		check_result(check, "metrics export", 0);
+		return;
+	}
+
+	metrics_init(&metrics, check->sim.device);
+	check->ctx.metrics = &metrics;
+
+	check_flash_observed(check, &flash, &image);
+
+	int ok = stm32_flash(&check->ctx, &flash) == STM32_ERR_OK && check_programmed(check) &&
+		metrics_command(&metrics, STM32_WRITE)->ok == flash.frames_written &&
+		metrics_command(&metrics, STM32_EXTENDED_ERASE)->count > 0;
+
+	FILE *out = open_memstream(&json, &size);
+
+	ok = ok && out != NULL && metrics_json(out, ports, 1) == 0;
+
+	if (out != NULL)
+		fclose(out);
+
+	out = open_memstream(&prometheus, &size);
+
+	ok = ok && out != NULL && metrics_prometheus(out, ports, 1) == 0;
+
+	if (out != NULL)
+		fclose(out);
+
+	ok = ok && check_json(json) && strstr(json, "\"write\": {\"count\": ") != NULL && check_prometheus(prometheus);
+
+	check_result(check, "metrics export", ok);
+
+	free(json);
+	free(prometheus);
+	image_free(&image);
+	check_close(check);
+}
+
+#define CHECK_SPANS_MAX		8192
+
+typedef struct check_span {
+	char cat[16];
+	unsigned long long start;
+	unsigned long long end;
+} check_span_t ;
+
+/* the Chrome trace parses, commands follow each other and every phase sits inside one of them */
+static int check_spans(const char *text){
+
+	static check_span_t spans[CHECK_SPANS_MAX];
+	uint32_t spans_count = 0;
+	uint32_t commands = 0;
+	uint32_t i = 0;
+	uint32_t j = 0;
+
+	if (!check_json(text))
+		return 0;
+
+	for(text = strchr(text, '\n'); text != NULL && spans_count < CHECK_SPANS_MAX; text = strchr(text + 1, '\n')){
+
+		check_span_t *span = &spans[spans_count];
+		unsigned long long dur;
+		unsigned tid;
+
+		if (sscanf(text + 1, "{\"name\": \"%*[^\"]\", \"cat\": \"%15[^\"]\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %llu, \"dur\": %llu",
+				span->cat, &tid, &span->start, &dur) != 4)
+			continue;
+
+		span->end = span->start + dur;
+		commands += strcmp(span->cat, "command") == 0;
+		spans_count++;
+	}
+
+	for(i = 0; i < spans_count; i++){
+
+		int inside = 0;
+
+		for(j = 0; j < spans_count; j++){
+
+			if (i == j || strcmp(spans[j].cat, "command") != 0)
+				continue;
+
+			/* commands of one port never overlap */
+			if (strcmp(spans[i].cat, "command") == 0){
+				if (spans[i].start < spans[j].end && spans[j].start < spans[i].end)
+					return 0;
+				continue;
+			}
+
+			inside |= spans[i].start >= spans[j].start && spans[i].end <= spans[j].end;
+		}
+
+		if (strcmp(spans[i].cat, "phase") == 0 && !inside)
+			return 0;
+	}
+
+	return commands > 0 && spans_count > commands;
+}
+
+/* a flash with a timeline attached exports nested command and phase spans */
+static void check_timeline(check_t *check){
+
+	timeline_t timeline;
+	timeline_t *timelines[1] = { &timeline };
+	stm32_flash_t flash;
+	image_t image;
+	char *text = NULL;
+	size_t size = 0;
+
+	if (check_open(check, 0) != 0){
+		check_result(check, "timeline export", 0);
+		return;
+	}
+
+	timeline_init(&timeline, "port \"0\"", 1, 0);
+	check->ctx.timeline = &timeline;
+
+	check_flash_observed(check, &flash, &image);
+
+	int ok = stm32_flash(&check->ctx, &flash) == STM32_ERR_OK && check_programmed(check) && timeline.dropped == 0;
+
+	FILE *out = open_memstream(&text, &size);
+
+	ok = ok && out != NULL && timeline_write(out, timelines, 1) == 0;
+
+	if (out != NULL)
+		fclose(out);
+
+	ok = ok && check_spans(text);
+
+	check_result(check, "timeline export", ok);
+
+	free(text);
+	timeline_free(&timeline);
+	image_free(&image);
+	check_close(check);
+}
+
+static void check_verify(check_t *check, const char *name, uint8_t checksum){
+
+	stm32_verify_t verify;
+	image_t image;
+
+	if (check_open(check, checksum) != 0){
+		check_result(check, name, 0);
+		return;
+	}
+
+	memcpy(check->sim.flash + CHECK_LOW_OFFSET, check_low, sizeof(check_low));
+	memcpy(check->sim.flash + CHECK_HIGH_OFFSET, check_high, sizeof(check_high));
+
+	check_image(check, &image);
+
+	memset(&verify, 0, sizeof(verify));
+	verify.image = &image;
+	verify.geometry = check->sim.config.geometry;
+
+	int ok = stm32_verify(&check->ctx, &verify) == STM32_ERR_OK &&
+		verify.bytes_mismatched == 0 && verify.checksummed == checksum;
+
+	stm32_verify_free(&verify);
+
+	/* one flipped byte in the second sector */
+	check->sim.flash[0x4321] ^= 0x10;
+
+	memset(&verify, 0, sizeof(verify));
+	verify.image = &image;
+	verify.geometry = check->sim.config.geometry;
+
+	ok = ok && stm32_verify(&check->ctx, &verify) == STM32_ERR_OK &&
+		verify.bytes_mismatched == 1 && verify.first_mismatch == check->sim.flash_base + 0x4321 &&
+		verify.units_mismatched == 1 && (verify.mismatch_map[0] & 0x02) != 0;
+
+	check_result(check, name, ok);
+
+	stm32_verify_free(&verify);
+	image_free(&image);
+	check_close(check);
+}
+
+static void check_reset(int fd, void *arg){
+	sim_reset(arg);
+}
+
+/* the link carries 460800 at most, the default list has to walk down to it */
+static void check_autobaud(check_t *check){
+
+	stm32_autobaud_t autobaud;
+	sim_config_t config;
+	char path[CHECK_PATH_MAX];
+
+	memset(&config, 0, sizeof(config));
+	config.rate_max = 460800;
+
+	if (sim_open(&check->sim, &config) != 0){
+		check_result(check, "autobaud", 0);
+		return;
+	}
+
+	check->fd = serial_open(check->sim.device);
+	stm32_ctx_init(&check->ctx, check->fd);
+
+	if (snprintf(path, sizeof(path), "%s/baud", check->dir) >= (int)sizeof(path))
+		path[0] = '\0';
+
+	memset(&autobaud, 0, sizeof(autobaud));
+	autobaud.cache_path = path;
+	autobaud.device = check->sim.device;
+
+	/* the bootloader would stay locked onto 1 Mbaud */
+	uint64_t bytes_rx = check->sim.stats.bytes_rx;
+
+	int ok = check->fd >= 0 && path[0] != '\0' && stm32_autobaud(&check->ctx, &autobaud) == STM32_ERR_INVALID_ARGUMENT &&
+		check->sim.stats.bytes_rx == bytes_rx;
+
+	autobaud.reset = check_reset;
+	autobaud.reset_arg = &check->sim;
+
+	uint32_t commands = check->sim.stats.commands;
+
+	ok = ok && stm32_autobaud(&check->ctx, &autobaud) == STM32_ERR_OK && autobaud.rate == 460800;
+
+	/* two 'get' and two 'read memory' at the winning rate */
+	ok = ok && check->sim.stats.commands == commands + 4;
+
+	/* the remembered rate is tried first and wins straight away */
+	commands = check->sim.stats.commands;
+
+	ok = ok && stm32_autobaud(&check->ctx, &autobaud) == STM32_ERR_OK && autobaud.rate == 460800 &&
+		check->sim.stats.commands == commands + 4;
+
+	/* flash under readout protection refuses the read, the rate with it */
+	check->sim.rdp = 1;
+
+	ok = ok && stm32_autobaud(&check->ctx, &autobaud) != STM32_ERR_OK;
+
+	autobaud.verify_skip = 1;
+
+	ok = ok && stm32_autobaud(&check->ctx, &autobaud) == STM32_ERR_OK && autobaud.rate == 460800;
+
+	check_result(check, "autobaud", ok);
+
+	unlink(path);
+	check_close(check);
+}
+
+static FILE *check_file(check_t *check, const char *name, char *path){
+
+	if (snprintf(path, CHECK_PATH_MAX, "%s/%s", check->dir, name) >= CHECK_PATH_MAX)
+		return NULL;
+
+	return fopen(path, "wb");
+}
+
+/* the file holds the flash, sparse dumps leave erased blocks as holes, the digests match the host's */
+static void check_dump(check_t *check, const char *name, uint32_t flags, int stale){
+
+	static const uint8_t abc[SHA256_DIGEST_SIZE] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+	};
+	static uint8_t contents[CHECK_DUMP_SIZE];
+	static uint8_t expected[CHECK_DUMP_SIZE];
+	char path[CHECK_PATH_MAX];
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	stm32_dump_t dump;
+	sha256_t sha;
+	struct stat st;
+	uint32_t blank = 0;
+	uint32_t i = 0;
+
+	if (check_open(check, 0) != 0){
+		check_result(check, name, 0);
+		return;
+	}
+
+	memcpy(check->sim.flash + CHECK_LOW_OFFSET, check_low, sizeof(check_low));
+	memcpy(check->sim.flash + CHECK_HIGH_OFFSET, check_high, sizeof(check_high));
+
+	/* known answers keep the host digests honest */
+	sha256_init(&sha);
+	sha256_update(&sha, "abc", 3);
+	sha256_final(&sha, digest);
+
+	int ok = memcmp(digest, abc, sizeof(abc)) == 0 && crc32_update(0, "123456789", 9) == 0xCBF43926;
+
+	sha256_init(&sha);
+	sha256_update(&sha, check->sim.flash, CHECK_DUMP_SIZE);
+	sha256_final(&sha, digest);
+
+	int sparse = (flags & STM32_DUMP_SPARSE) != 0;
+
+	/* holes read back as zeros */
+	for(i = 0; i < CHECK_DUMP_SIZE; i += 0x100){
+
+		int erased = sparse && check->sim.flash[i] == 0xFF && memcmp(check->sim.flash + i, check->sim.flash + i + 1, 0xFF) == 0;
+
+		memset(expected + i, 0, 0x100);
+
+		if (erased)
+			blank++;
+		else
+			memcpy(expected + i, check->sim.flash + i, 0x100);
+	}
+
+	/* mapped output needs a file open for reading and writing */
+	int fd = -1;
+
+	if (snprintf(path, sizeof(path), "%s/%s", check->dir, name) < (int)sizeof(path))
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+	/* a reused file keeps its old bytes unless the dump clears them */
+	if (stale && fd >= 0){
+		memset(contents, 0xA5, CHECK_DUMP_SIZE);
+		ok = ok && pwrite(fd, contents, CHECK_DUMP_SIZE, 0) == CHECK_DUMP_SIZE;
+	}
+
+	memset(&dump, 0, sizeof(dump));
+	dump.address = check->sim.flash_base;
+	dump.size = CHECK_DUMP_SIZE;
+	dump.out_fd = fd;
+	dump.flags = flags;
+
+	ok = ok && fd >= 0 && stm32_dump(&check->ctx, &dump) == STM32_ERR_OK &&
+		memcmp(dump.sha256, digest, sizeof(digest)) == 0 &&
+		dump.crc32 == crc32_update(0, check->sim.flash, CHECK_DUMP_SIZE) &&
+		dump.blank_blocks == blank && (blank > 0) == sparse;
+
+	ok = ok && fstat(fd, &st) == 0 && st.st_size == CHECK_DUMP_SIZE &&
+		((uint64_t)st.st_blocks * 512 < CHECK_DUMP_SIZE) == sparse &&
+		pread(fd, contents, CHECK_DUMP_SIZE, 0) == CHECK_DUMP_SIZE &&
+		memcmp(contents, expected, CHECK_DUMP_SIZE) == 0;
+
+	check_result(check, name, ok);
+
+	if (fd >= 0){
+		close(fd);
+		unlink(path);
+	}
+
+	check_close(check);
+}
+
+/* dump records as capture_dump() writes them: timestamp, fd, direction, reserved, length */
+#define CHECK_CAPTURE_HEADER	16
+#define CHECK_CAPTURE_FD		1000	/* not a port, stands for a long buffer */
+#define CHECK_CAPTURE_LONG		0x18000
+
+static uint64_t check_le(const uint8_t *buffer, int size){
+
+	uint64_t value = 0;
+
+	while(size-- > 0)
+		value = (value << 8) | buffer[size];
+
+	return value;
+}
+
+/*
+ * a flush into a target that stopped draining the port times out instead of
+ * blocking, and the capture still holds the part of the frame that went out
+ */
+static void check_stalled(check_t *check){
+
+	static uint8_t sent[sizeof(check_stall)];
+	uint8_t header[CHECK_CAPTURE_HEADER];
+	uint8_t record[0xFFFF];
+	char path[CHECK_PATH_MAX];
+	serial_io_t io;
+	struct timespec start, end;
+	uint32_t sent_size = 0;
+	uint32_t i = 0;
+
+	FILE *file = check_file(check, "capture-stalled", path);
+
+	if (file == NULL || check_open(check, 0) != 0){
+		if (file != NULL)
+			fclose(file);
+		check_result(check, "flush into a stalled target", 0);
+		return;
+	}
+
+	fclose(file);
+
+	for(i = 0; i < sizeof(check_stall); i++)
+		check_stall[i] = i * 13 + (i >> 8);
+
+	sim_stall(&check->sim, 1);
+
+	serial_io_init(&io, check->fd);
+	io.byte_us = 1;
+
+	int ok = capture_start(2 * sizeof(check_stall) / CAPTURE_SLOT_DATA) == 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	serial_errors_t result = serial_io_write(&io, check_stall, sizeof(check_stall));
+
+	if (result == SERIAL_ERR_OK)
+		result = serial_io_flush(&io);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ok = ok && capture_dump(path) == 0;
+
+	capture_stop();
+
+	int flags = fcntl(check->fd, F_GETFL);
+
+	ok = ok && result == SERIAL_ERR_TIMEOUT && end.tv_sec - start.tv_sec < 5 &&
+		flags >= 0 && !(flags & O_NONBLOCK);
+
+	/* whatever the port took before it filled up is on record */
+	file = fopen(path, "rb");
+
+	ok = ok && file != NULL && fread(header, 8, 1, file) == 1;
+
+	while(ok && fread(header, sizeof(header), 1, file) == 1){
+
+		uint32_t size = check_le(header + 14, 2);
+
+		ok = size > 0 && fread(record, size, 1, file) == 1;
+
+		if (ok && (int)check_le(header + 8, 4) == check->fd && header[12] == CAPTURE_TX){
+			ok = sent_size + size <= sizeof(sent);
+
+			if (ok){
+				memcpy(sent + sent_size, record, size);
+				sent_size += size;
+			}
+		}
+	}
+
+	ok = ok && sent_size > 0 && sent_size < sizeof(check_stall) && memcmp(sent, check_stall, sent_size) == 0;
+
+	check_result(check, "flush into a stalled target", ok);
+
+	if (file != NULL)
+		fclose(file);
+
+	unlink(path);
+
+	sim_stall(&check->sim, 0);
+	check_close(check);
+}
+
+/* a session and buffers past the 16 bit record length survive capture, dump and decode */
+static void check_capture(check_t *check){
+
+	static uint8_t long_buffer[CHECK_CAPTURE_LONG];
+	static uint8_t joined[0x10000 + CHECK_CAPTURE_LONG];
+	uint8_t header[CHECK_CAPTURE_HEADER];
+	char path[CHECK_PATH_MAX];
+	char *text = NULL;
+	size_t text_size = 0;
+	uint8_t *data;
+	uint32_t joined_size = 0;
+	uint32_t records = 0;
+	uint32_t i = 0;
+
+	FILE *file = check_file(check, "capture", path);
+
+	if (file == NULL){
+		check_result(check, "capture round trip", 0);
+		return;
+	}
+
+	fclose(file);
+
+	for(i = 0; i < sizeof(long_buffer); i++)
+		long_buffer[i] = i * 7 + (i >> 8);
+
+	int opened = capture_start(4 * CHECK_CAPTURE_LONG / CAPTURE_SLOT_DATA) == 0 && check_open(check, 0) == 0;
+	int ok = opened && stm32_read(&check->ctx, check->sim.flash_base, &data, 0x100) == STM32_ERR_OK;
+
+	/* one buffer of exactly 64 KiB used to be dumped with a zero length */
+	capture_record(CHECK_CAPTURE_FD, CAPTURE_TX, long_buffer, 0x10000);
+	capture_record(CHECK_CAPTURE_FD, CAPTURE_TX, long_buffer, sizeof(long_buffer));
+
+	ok = ok && capture_dump(path) == 0;
+
+	if (opened)
+		check_close(check);
+
+	capture_stop();
+
+	/* every record parses and the long buffers come back whole */
+	file = fopen(path, "rb");
+
+	ok = ok && file != NULL && fread(header, 8, 1, file) == 1 && memcmp(header, "S32CAP\0\1", 8) == 0;
+
+	while(ok && fread(header, sizeof(header), 1, file) == 1){
+
+		uint32_t size = check_le(header + 14, 2);
+		uint8_t record[0xFFFF];
+
+		ok = size > 0 && fread(record, size, 1, file) == 1;
+
+		if (!ok || check_le(header + 8, 4) != CHECK_CAPTURE_FD)
+			continue;
+
+		records++;
+
+		ok = header[12] == CAPTURE_TX && joined_size + size <= sizeof(joined);
+
+		if (ok){
+			memcpy(joined + joined_size, record, size);
+			joined_size += size;
+		}
+	}
+
+	ok = ok && file != NULL && feof(file) && records == 4 && joined_size == sizeof(joined) &&
+		memcmp(joined, long_buffer, 0x10000) == 0 && memcmp(joined + 0x10000, long_buffer, sizeof(long_buffer)) == 0;
+
+	/* and the decoder names the session */
+	FILE *out = open_memstream(&text, &text_size);
+
+	if (file != NULL)
+		rewind(file);
+
+	ok = ok && out != NULL && capture_decode(file, out) == 0;
+
+	if (out != NULL)
+		fclose(out);
+
+	ok = ok && text != NULL &&
+		strstr(text, "INIT") != NULL && strstr(text, "READ (0x11)") != NULL &&
+		strstr(text, "address 0x08000000") != NULL && strstr(text, "read 256 bytes") != NULL &&
+		strstr(text, "[ 256] response 256 bytes") != NULL;
+
+	check_result(check, "capture round trip", ok);
+
+	free(text);
+
+	if (file != NULL)
+		fclose(file);
+
+	unlink(path);
+}
+
+/* frames the library sends in several pieces decode as one, checksum included */
+static void check_capture_pieces(check_t *check){
+
+	static const uint8_t sectors[] = { 1, 2 };
+	static const uint16_t pages[] = { 3, 4 };
+	char path[CHECK_PATH_MAX];
+	char *text = NULL;
+	size_t text_size = 0;
+
+	FILE *file = check_file(check, "capture-pieces", path);
+
+	if (file == NULL){
+		check_result(check, "capture decodes pieced frames", 0);
+		return;
+	}
+
+	fclose(file);
+
+	int opened = capture_start(64) == 0 && check_open(check, 0) == 0;
+
+	int ok = opened &&
+		stm32_extended_erase_special(&check->ctx, STM32_ERASE_MASS) == STM32_ERR_OK &&
+		stm32_extended_erase(&check->ctx, pages, 2) == STM32_ERR_OK &&
+		stm32_write_protect(&check->ctx, sectors, sizeof(sectors)) == STM32_ERR_OK;
+
+	ok = ok && capture_dump(path) == 0;
+
+	if (opened)
+		check_close(check);
+
+	capture_stop();
+
+	file = fopen(path, "rb");
+
+	FILE *out = open_memstream(&text, &text_size);
+
+	ok = ok && file != NULL && out != NULL && capture_decode(file, out) == 0;
+
+	if (out != NULL)
+		fclose(out);
+
+	ok = ok && text != NULL &&
+		strstr(text, "mass erase ") != NULL && strstr(text, "erase 2 pages from 3 ") != NULL &&
+		strstr(text, "protect 2 sectors from 1 ") != NULL && strstr(text, "bad ") == NULL;
+
+	check_result(check, "capture decodes pieced frames", ok);
+
+	free(text);
+
+	if (file != NULL)
+		fclose(file);
+
+	unlink(path);
+}
+
+static void check_hex_record(FILE *file, uint8_t type, uint16_t address, const uint8_t *data, uint8_t size){
+
+	uint8_t sum = size + (address >> 8) + address + type;
+	uint8_t i = 0;
+
+	fprintf(file, ":%02X%04X%02X", size, address, type);
+
+	for(i = 0; i < size; i++){
+		fprintf(file, "%02X", data[i]);
+		sum += data[i];
+	}
+
+	fprintf(file, "%02X\n", (uint8_t)-sum);
+}
+
+static void check_hex(FILE *file, uint32_t address, const uint8_t *data, uint32_t size){
+
+	uint32_t offset = 0;
+
+	for(offset = 0; offset < size; offset += 0x10){
+
+		uint32_t at = address + offset;
+		uint8_t len = size - offset < 0x10 ? size - offset : 0x10;
+
+		/* extended linear address at the start and on every 64 KiB boundary */
+		if (offset == 0 || (at & 0xFFFF) < 0x10){
+
+			uint8_t upper[2] = { at >> 24, at >> 16 };
+
+			check_hex_record(file, 0x04, 0, upper, 2);
+		}
+
+		check_hex_record(file, 0x00, at, data + offset, len);
+	}
+}
+
+static void check_srec(FILE *file, uint32_t address, const uint8_t *data, uint32_t size){
+
+	uint32_t offset = 0;
+
+	for(offset = 0; offset < size; offset += 0x20){
+
+		uint32_t at = address + offset;
+		uint8_t len = size - offset < 0x20 ? size - offset : 0x20;
+		uint8_t sum = len + 5 + (at >> 24) + (at >> 16) + (at >> 8) + at;
+		uint8_t i = 0;
+
+		fprintf(file, "S3%02X%08X", len + 5, at);
+
+		for(i = 0; i < len; i++){
+			fprintf(file, "%02X", data[offset + i]);
+			sum += data[offset + i];
+		}
+
+		fprintf(file, "%02X\n", (uint8_t)~sum);
+	}
+}
+
+/* headers are written in host order, the check runs on little-endian hosts */
+static void check_elf(FILE *file, uint32_t base, uint32_t entry){
+
+	Elf32_Ehdr header;
+	Elf32_Phdr segments[3];
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.e_ident, ELFMAG, SELFMAG);
+	header.e_ident[EI_CLASS] = ELFCLASS32;
+	header.e_ident[EI_DATA] = ELFDATA2LSB;
+	header.e_ident[EI_VERSION] = EV_CURRENT;
+	header.e_type = ET_EXEC;
+	header.e_machine = EM_ARM;
+	header.e_version = EV_CURRENT;
+	header.e_entry = entry;
+	header.e_phoff = sizeof(header);
+	header.e_ehsize = sizeof(header);
+	header.e_phentsize = sizeof(Elf32_Phdr);
+	header.e_phnum = 3;
+
+	/* .bss has no file contents and programs nothing */
+	memset(segments, 0, sizeof(segments));
+	segments[0].p_type = PT_LOAD;
+	segments[0].p_offset = sizeof(header) + sizeof(segments);
+	segments[0].p_paddr = base + CHECK_LOW_OFFSET;
+	segments[0].p_filesz = sizeof(check_low);
+	segments[1].p_type = PT_LOAD;
+	segments[1].p_offset = segments[0].p_offset + sizeof(check_low);
+	segments[1].p_paddr = base + CHECK_HIGH_OFFSET;
+	segments[1].p_filesz = sizeof(check_high);
+	segments[2].p_type = PT_LOAD;
+	segments[2].p_paddr = SIM_RAM_BASE;
+	segments[2].p_memsz = 0x100;
+
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(segments, sizeof(segments), 1, file);
+	fwrite(check_low, sizeof(check_low), 1, file);
+	fwrite(check_high, sizeof(check_high), 1, file);
+}
+
+/* both segments came back with their contents */
+static int check_loaded(const image_t *image, uint32_t base){
+
+	static uint8_t buffer[CHECK_LOW_SIZE];
+
+	return image_covered(image, base + CHECK_LOW_OFFSET, sizeof(check_low)) == sizeof(check_low) &&
+		image_fill(image, base + CHECK_LOW_OFFSET, buffer, sizeof(check_low)) == sizeof(check_low) &&
+		memcmp(buffer, check_low, sizeof(check_low)) == 0 &&
+		image_fill(image, base + CHECK_HIGH_OFFSET, buffer, sizeof(check_high)) == sizeof(check_high) &&
+		memcmp(buffer, check_high, sizeof(check_high)) == 0;
+}
+
+static void check_load(check_t *check, const char *name, image_format_t format, uint32_t base){
+
+	char path[CHECK_PATH_MAX];
+	image_load_t load;
+	image_t image;
+	FILE *file = check_file(check, name, path);
+
+	if (file == NULL){
+		check_result(check, name, 0);
+		return;
+	}
+
+	switch(format){
+		case IMAGE_FORMAT_HEX:
+			check_hex(file, base + CHECK_LOW_OFFSET, check_low, sizeof(check_low));
+			check_hex(file, base + CHECK_HIGH_OFFSET, check_high, sizeof(check_high));
+			fprintf(file, ":0400000508000101ED\n:00000001FF\n");
+			break;
+
+		case IMAGE_FORMAT_SREC:
+			fprintf(file, "S0060000686578B4\n");
+			check_srec(file, base + CHECK_LOW_OFFSET, check_low, sizeof(check_low));
+			check_srec(file, base + CHECK_HIGH_OFFSET, check_high, sizeof(check_high));
+			fprintf(file, "S70508000101F0\n");
+			break;
+
+		case IMAGE_FORMAT_ELF:
+			check_elf(file, base, base + 0x101);
+			break;
+
+		/* raw images cover the gap as well */
+		default:
+			fseek(file, CHECK_LOW_OFFSET, SEEK_SET);
+			fwrite(check_low, sizeof(check_low), 1, file);
+			fseek(file, CHECK_HIGH_OFFSET, SEEK_SET);
+			fwrite(check_high, sizeof(check_high), 1, file);
+			break;
+	}
+
+	fclose(file);
+
+	memset(&load, 0, sizeof(load));
+	load.path = path;
+	load.base = base;
+
+	image_init(&image);
+
+	int ok = image_load(&image, &load) == IMAGE_ERR_OK && load.detected == format;
+
+	if (format == IMAGE_FORMAT_BIN)
+		ok = ok && image.segments_count == 1 && image_size(&image) == CHECK_HIGH_OFFSET + sizeof(check_high);
+	else
+		ok = ok && image.segments_count == 2 && load.entry == base + 0x101;
+
+	ok = ok && check_loaded(&image, base);
+
+	check_result(check, name, ok);
+
+	image_free(&image);
+	unlink(path);
+}
+
+/* malformed input is refused and the image is left empty */
+static void check_load_bad(check_t *check, const char *name, const char *contents, uint32_t line){
+
+	char path[CHECK_PATH_MAX];
+	image_load_t load;
+	image_t image;
+	FILE *file = check_file(check, name, path);
+
+	if (file == NULL){
+		check_result(check, name, 0);
+		return;
+	}
+
+	fputs(contents, file);
+	fclose(file);
+
+	memset(&load, 0, sizeof(load));
+	load.path = path;
+
+	image_init(&image);
+
+	check_result(check, name,
+		image_load(&image, &load) == IMAGE_ERR_FORMAT && load.line == line && image.segments_count == 0
+	);
+
+	image_free(&image);
+	unlink(path);
+}
+
+/* the ELF of check_load() cut inside its second segment */
+static void check_load_truncated(check_t *check){
+
+	char path[CHECK_PATH_MAX];
+	image_load_t load;
+	image_t image;
+	FILE *file = check_file(check, "load truncated elf", path);
+
+	if (file == NULL){
+		check_result(check, "load truncated elf", 0);
+		return;
+	}
+
+	check_elf(file, 0x08000000, 0);
+	fflush(file);
+
+	int ok = ftruncate(fileno(file), ftell(file) - sizeof(check_high) / 2) == 0;
+
+	fclose(file);
+
+	memset(&load, 0, sizeof(load));
+	load.path = path;
+
+	image_init(&image);
+
+	ok = ok && image_load(&image, &load) == IMAGE_ERR_FORMAT && load.detected == IMAGE_FORMAT_ELF && image.segments_count == 0;
+
+	check_result(check, "load truncated elf", ok);
+
+	image_free(&image);
+	unlink(path);
+}
+
+int main(int argc, char *argv[]){
+
+	check_t check;
+	uint32_t seed = 1;
+	uint32_t i = 0;
+
+	memset(&check, 0, sizeof(check));
+
+	/* the upper half repeats like tables and padding do, so it compresses */
+	for(i = 0; i < sizeof(check_low); i++){
+		seed = seed * 1103515245 + 12345;
+		check_low[i] = i < sizeof(check_low) / 2 ? seed >> 16 : check_low[i % 0x40];
+	}
+
+	for(i = 0; i < sizeof(check_high); i++){
+		seed = seed * 1103515245 + 12345;
+		check_high[i] = seed >> 16;
+	}
+
+	memset(check_helper, 0x42, sizeof(check_helper));
+
+	const char *tmp = getenv("TMPDIR");
+
+	snprintf(check.dir, sizeof(check.dir), "%s/stm32check.XXXXXX", tmp != NULL ? tmp : "/tmp");
+
+	if (mkdtemp(check.dir) == NULL){
+		perror(check.dir);
+		return 1;
+	}
+
+	check_flash_mode(&check, "flash write", STM32_FLASH_WRITE, 0, 0);
+	check_flash_mode(&check, "flash mass", STM32_FLASH_MASS, 0, 0);
+	check_flash_mode(&check, "flash delta", STM32_FLASH_DELTA, 0, 0);
+	check_flash_empty(&check);
+	check_flash_mode(&check, "flash pages", STM32_FLASH_PAGES, 0, 0);
+	check_flash_mode(&check, "flash jit", STM32_FLASH_JIT, 0, 0);
+	check_flash_mode(&check, "flash pages through the helper", STM32_FLASH_PAGES, 1, 0);
+	check_flash_mode(&check, "flash pages packed through the helper", STM32_FLASH_PAGES, 1, 1);
+	check_cache(&check);
+	check_resume(&check, "flash resumed from the journal", 0);
+	check_resume(&check, "flash restarted over a changed target", 1);
+	check_farm(&check);
+	check_async(&check);
+	check_metrics(&check);
+	check_timeline(&check);
+	check_unordered(&check);
+
+	check_verify(&check, "verify by read back", 0);
+	check_verify(&check, "verify by checksum", 1);
+
+	check_autobaud(&check);
+	check_stalled(&check);
+	check_capture(&check);
+	check_capture_pieces(&check);
+
+	check_dump(&check, "dump", 0, 0);
+	check_dump(&check, "dump sparse", STM32_DUMP_SPARSE, 0);
+	check_dump(&check, "dump sparse over a used file", STM32_DUMP_SPARSE, 1);
+	check_dump(&check, "dump mapped", STM32_DUMP_SPARSE | STM32_DUMP_MMAP, 0);
+
+	check_load(&check, "load bin", IMAGE_FORMAT_BIN, 0x08000000);
+	check_load(&check, "load hex", IMAGE_FORMAT_HEX, 0x08000000);
+	check_load(&check, "load srec", IMAGE_FORMAT_SREC, 0x08000000);
+	check_load(&check, "load elf", IMAGE_FORMAT_ELF, 0x08000000);
+
+	check_load_bad(&check, "load hex with a bad checksum", ":020000040800F2\n:0400000001020304F1\n:00000001FF\n", 2);
+	check_load_bad(&check, "load hex with a short record", ":020000040800F2\n:04000000010203\n", 2);
+	check_load_bad(&check, "load hex with a bad digit", ":020000040800F2\n:04000000010G0304F2\n", 2);
+	check_load_bad(&check, "load srec with a bad checksum", "S3090800000001020304FF\n", 1);
+	check_load_truncated(&check);
+
+	rmdir(check.dir);
+
+	printf("%u passed, %u failed\n", check.passed, check.failed);
+
+	return check.failed != 0;
+}
@@ -0,0 +1,492 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "capture.h"
+
+#define CAPTURE_MAGIC		"S32CAP\0\1"
+#define CAPTURE_HEAD		0x02	/* first slot of a buffer */
+#define CAPTURE_MIN_SLOTS	64
+#define CAPTURE_RECORD_MAX	0xFFFF	/* the length field is 16 bits, longer buffers take several records */
+
+/* record header in the dump file: timestamp, fd, direction, reserved, length */
+#define CAPTURE_HEADER		(8 + 4 + 1 + 1 + 2)
+
+capture_t * _Atomic capture_ring = NULL;
+
+static uint64_t capture_now(void){
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void put_le(uint8_t *buffer, uint64_t value, int size){
+
+	int i = 0;
+
+	for(i = 0; i < size; i++)
+		buffer[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static uint64_t get_le(const uint8_t *buffer, int size){
+
+	uint64_t value = 0;
+	int i = 0;
+
+	for(i = size - 1; i >= 0; i--)
+		value = (value << 8) | buffer[i];
+
+	return value;
+}
+
+int capture_start(uint32_t slots_count){
+
+	capture_t *ring = malloc(sizeof(capture_t));
+
+	if (ring == NULL)
+		return -1;
+
+	if (slots_count < CAPTURE_MIN_SLOTS)
+		slots_count = CAPTURE_MIN_SLOTS;
+
+	ring->slots = calloc(slots_count, sizeof(capture_slot_t));
+	ring->slots_count = slots_count;
+	atomic_init(&ring->head, 0);
+
+	if (ring->slots == NULL){
+		free(ring);
+		return -1;
+	}
+
+	/* replace any previous ring */
+	capture_stop();
+	atomic_store_explicit(&capture_ring, ring, memory_order_release);
+
+	return 0;
+}
+
+/* callers must make sure no transfer is in flight */
+void capture_stop(void){
+
+	capture_t *ring = atomic_exchange(&capture_ring, NULL);
+
+	if (ring == NULL)
+		return;
+
+	free(ring->slots);
+	free(ring);
+}
+
+void capture_record(int fd, capture_direction_t direction, const void *buffer, int len){
+
+	capture_t *ring = atomic_load_explicit(&capture_ring, memory_order_acquire);
+	const uint8_t *bytes = buffer;
+
+	if (ring == NULL || len <= 0)
+		return;
+
+	uint64_t chunks = (len + CAPTURE_SLOT_DATA - 1) / CAPTURE_SLOT_DATA;
+
+	/* a buffer larger than the whole ring keeps its tail */
+	if (chunks > ring->slots_count){
+		bytes += (chunks - ring->slots_count) * CAPTURE_SLOT_DATA;
+		len -= (chunks - ring->slots_count) * CAPTURE_SLOT_DATA;
+		chunks = ring->slots_count;
+	}
+
+	uint64_t first = atomic_fetch_add_explicit(&ring->head, chunks, memory_order_relaxed);
+	uint64_t timestamp = capture_now();
+	uint64_t i = 0;
+
+	for(i = 0; i < chunks; i++){
+
+		capture_slot_t *slot = &ring->slots[(first + i) % ring->slots_count];
+		int size = len < CAPTURE_SLOT_DATA ? len : CAPTURE_SLOT_DATA;
+
+		/* seqlock style: readers drop slots whose sequence moved under them */
+		atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+
+		slot->timestamp = timestamp;
+		slot->fd = fd;
+		slot->direction = direction;
+		slot->length = size;
+		slot->flags = (i == 0 ? CAPTURE_HEAD : 0) | (i + 1 < chunks ? CAPTURE_CONTINUED : 0);
+		memcpy(slot->data, bytes, size);
+
+		atomic_store_explicit(&slot->sequence, first + i + 1, memory_order_release);
+
+		bytes += size;
+		len -= size;
+	}
+}
+
+static int capture_write(FILE *file, uint8_t *header, const uint8_t *record, uint32_t record_size){
+
+	put_le(header + 14, record_size, 2);
+
+	return fwrite(header, CAPTURE_HEADER, 1, file) != 1 || fwrite(record, record_size, 1, file) != 1;
+}
+
+int capture_dump(const char *path){
+
+	capture_t *ring = atomic_load_explicit(&capture_ring, memory_order_acquire);
+	uint8_t header[CAPTURE_HEADER];
+	uint8_t *record;
+	uint32_t record_size = 0;
+	capture_slot_t slot;
+	int in_buffer = 0;
+	int failed = 0;
+
+	if (ring == NULL)
+		return -1;
+
+	record = malloc(CAPTURE_RECORD_MAX);
+
+	if (record == NULL)
+		return -1;
+
+	FILE *file = fopen(path, "wb");
+
+	if (file == NULL){
+		free(record);
+		return -1;
+	}
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t index = head > ring->slots_count ? head - ring->slots_count : 0;
+
+	failed |= fwrite(CAPTURE_MAGIC, 8, 1, file) != 1;
+
+	/* reassemble buffers from their slots, skipping anything overwritten */
+	for(; index < head && !failed; index++){
+
+		capture_slot_t *live = &ring->slots[index % ring->slots_count];
+		uint64_t sequence = atomic_load_explicit(&live->sequence, memory_order_acquire);
+
+		memcpy((uint8_t *)&slot + sizeof(slot.sequence), (uint8_t *)live + sizeof(slot.sequence), sizeof(slot) - sizeof(slot.sequence));
+		atomic_thread_fence(memory_order_acquire);
+
+		if (sequence != index + 1 || atomic_load_explicit(&live->sequence, memory_order_relaxed) != sequence){
+			in_buffer = 0;
+			continue;
+		}
+
+		if (slot.flags & CAPTURE_HEAD){
+			in_buffer = 1;
+			record_size = 0;
+			put_le(header, slot.timestamp, 8);
+			put_le(header + 8, (uint32_t)slot.fd, 4);
+			header[12] = slot.direction;
+			header[13] = 0;
+		} else if (!in_buffer){
+			continue;
+		}
+
+		/* the full part goes out under the buffer's header, the rest follows */
+		if (record_size + slot.length > CAPTURE_RECORD_MAX){
+			failed |= capture_write(file, header, record, record_size);
+			record_size = 0;
+		}
+
+		memcpy(record + record_size, slot.data, slot.length);
+		record_size += slot.length;
+
+		if (slot.flags & CAPTURE_CONTINUED)
+			continue;
+
+		failed |= capture_write(file, header, record, record_size);
+		in_buffer = 0;
+	}
+
+	failed |= fclose(file) != 0;
+	free(record);
+
+	return failed ? -1 : 0;
+}
+
+/* offline decoder */
+
+typedef struct decode_port {
+	int32_t fd;
+	uint8_t command;	/* last command sent, 0xFF when idle */
+	uint8_t frames;		/* host frames sent since the command */
+	uint8_t head[4];	/* first bytes of a page list */
+	uint32_t got;		/* page list bytes seen so far */
+	uint8_t sum;		/* xor of them, zero once the checksum is in */
+} decode_port_t ;
+
+#define DECODE_PORTS	64
+#define DECODE_IDLE		0xFF
+
+static const char *command_name(uint8_t command){
+
+	switch(command){
+		case 0x00: return "GET";
+		case 0x01: return "GET VERSION";
+		case 0x02: return "GET ID";
+		case 0x11: return "READ";
+		case 0x21: return "GO";
+		case 0x31: return "WRITE";
+		case 0x43: return "ERASE";
+		case 0x44: return "EXTENDED ERASE";
+		case 0x63: return "WRITE PROTECT";
+		case 0x73: return "WRITE UNPROTECT";
+		case 0x82: return "READOUT PROTECT";
+		case 0x92: return "READOUT UNPROTECT";
+		case 0xA1: return "GET CHECKSUM";
+		default:
+			return NULL;
+	}
+}
+
+static uint8_t xor_sum(const uint8_t *data, uint32_t size){
+
+	uint8_t sum = 0;
+
+	while(size--)
+		sum ^= *data++;
+
+	return sum;
+}
+
+/* bytes a page list needs, 0 while its length is not known yet */
+static uint32_t list_size(const decode_port_t *port){
+
+	if (port->command == 0x44 && port->got >= 2){
+
+		uint16_t count = (port->head[0] << 8) | port->head[1];
+
+		return count >= 0xFFF0 ? 3 : 2u + 2u * (count + 1u) + 1u;
+	}
+
+	if (port->command == 0x63 && port->got >= 1)
+		return 1u + (port->head[0] + 1u) + 1u;
+
+	return 0;
+}
+
+/*
+ * erase and write protect lists leave the host as several gathered pieces, each
+ * captured as its own record, so they are put back together before decoding
+ */
+static void decode_list(decode_port_t *port, const uint8_t *data, uint32_t size, char *note, size_t note_size){
+
+	uint32_t i = 0;
+
+	for(i = 0; i < size; i++){
+
+		if (port->got < sizeof(port->head))
+			port->head[port->got] = data[i];
+
+		port->sum ^= data[i];
+		port->got++;
+	}
+
+	uint32_t need = list_size(port);
+
+	if (need == 0 || port->got < need){
+		snprintf(note, note_size, "pages, %u bytes so far", port->got);
+		return;
+	}
+
+	const char *checksum = port->got > need ? ", bad length" : port->sum != 0 ? ", bad checksum" : "";
+	uint16_t count = (port->head[0] << 8) | port->head[1];
+
+	if (port->command == 0x63)
+		snprintf(note, note_size, "protect %u sectors from %u%s", port->head[0] + 1, port->head[1], checksum);
+	else if (count >= 0xFFF0)
+		snprintf(note, note_size, "%s%s", count == 0xFFFF ? "mass erase" : count == 0xFFFE ? "bank 1 erase" : "bank 2 erase", checksum);
+	else
+		snprintf(note, note_size, "erase %u pages from %u%s", count + 1, (port->head[2] << 8) | port->head[3], checksum);
+
+	port->command = DECODE_IDLE;
+}
+
+static void decode_tx(decode_port_t *port, const uint8_t *data, uint32_t size, char *note, size_t note_size){
+
+	/* the rest of a page list, whatever its bytes look like */
+	if ((port->command == 0x44 || port->command == 0x63) && port->got > 0){
+		decode_list(port, data, size, note, note_size);
+		return;
+	}
+
+	if (size == 1 && data[0] == 0x7F){
+		port->command = DECODE_IDLE;
+		snprintf(note, note_size, "INIT");
+		return;
+	}
+
+	/* a complemented pair is a command unless READ waits for its length */
+	int read_length = port->command == 0x11 && port->frames == 1;
+
+	if (size == 2 && (data[0] ^ data[1]) == 0xFF && !read_length && command_name(data[0]) != NULL){
+		port->command = data[0];
+		port->frames = 0;
+		port->got = 0;
+		port->sum = 0;
+		snprintf(note, note_size, "%s (0x%02X)", command_name(data[0]), data[0]);
+		return;
+	}
+
+	port->frames++;
+
+	if ((port->command == 0x11 || port->command == 0x31 || port->command == 0x21 || port->command == 0xA1) && port->frames == 1 && size == 5){
+		uint32_t address = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+
+		snprintf(note, note_size, "address 0x%08X%s", address, xor_sum(data, 4) == data[4] ? "" : ", bad checksum");
+		return;
+	}
+
+	switch(port->command){
+		case 0x11:
+			if (size == 2 && (data[0] ^ data[1]) == 0xFF){
+				snprintf(note, note_size, "read %u bytes", data[0] + 1);
+				port->command = DECODE_IDLE;
+				return;
+			}
+			break;
+
+		case 0x31:
+			if (size >= 3 && size == (uint32_t)data[0] + 3u){
+				snprintf(note, note_size, "data %u bytes%s", data[0] + 1, xor_sum(data, size - 1) == data[size - 1] ? "" : ", bad checksum");
+				port->command = DECODE_IDLE;
+				return;
+			}
+			break;
+
+		case 0x44:
+		case 0x63:
+			if (port->frames == 1){
+				decode_list(port, data, size, note, note_size);
+				return;
+			}
+			break;
+
+		case 0xA1:
+			if (size == 5 && port->frames <= 4){
+				static const char *fields[] = { "size", "polynomial", "initial value" };
+				uint32_t value = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+
+				snprintf(note, note_size, "%s 0x%08X%s", fields[port->frames - 2], value, xor_sum(data, 4) == data[4] ? "" : ", bad checksum");
+
+				if (port->frames == 4)
+					port->command = DECODE_IDLE;
+				return;
+			}
+			break;
+	}
+
+	snprintf(note, note_size, "data");
+}
+
+static void decode_rx(decode_port_t *port, const uint8_t *data, uint32_t size, char *note, size_t note_size){
+
+	if (size == 1 && data[0] == 0x79){
+		snprintf(note, note_size, "ACK");
+		return;
+	}
+
+	if (size == 1 && data[0] == 0x1F){
+		port->command = DECODE_IDLE;
+		snprintf(note, note_size, "NACK");
+		return;
+	}
+
+	snprintf(note, note_size, "response %u bytes", size);
+}
+
+int capture_decode(FILE *in, FILE *out){
+
+	decode_port_t ports[DECODE_PORTS];
+	uint8_t header[CAPTURE_HEADER];
+	uint8_t magic[8];
+	uint8_t *data;
+	uint64_t origin = 0;
+	int ports_count = 0;
+	int first = 1;
+
+	if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, CAPTURE_MAGIC, 8) != 0)
+		return -1;
+
+	data = malloc(CAPTURE_RECORD_MAX);
+
+	if (data == NULL)
+		return -1;
+
+	while(fread(header, sizeof(header), 1, in) == 1){
+
+		uint64_t timestamp = get_le(header, 8);
+		int32_t fd = (int32_t)get_le(header + 8, 4);
+		uint8_t direction = header[12];
+		uint32_t size = get_le(header + 14, 2);
+		decode_port_t *port = NULL;
+		char note[96];
+		uint32_t i = 0;
+		int p = 0;
+
+		if (size > 0 && fread(data, size, 1, in) != 1)
+			break;
+
+		if (first){
+			origin = timestamp;
+			first = 0;
+		}
+
+		for(p = 0; p < ports_count; p++)
+			if (ports[p].fd == fd)
+				port = &ports[p];
+
+		if (port == NULL){
+			port = &ports[ports_count < DECODE_PORTS ? ports_count++ : DECODE_PORTS - 1];
+			port->fd = fd;
+			port->command = DECODE_IDLE;
+			port->frames = 0;
+			port->got = 0;
+			port->sum = 0;
+		}
+
+		if (direction == CAPTURE_TX)
+			decode_tx(port, data, size, note, sizeof(note));
+		else
+			decode_rx(port, data, size, note, sizeof(note));
+
+		fprintf(out, "%12.6f fd %-3d %s [%4u] %-24s", (timestamp - origin) / 1e9, fd, direction == CAPTURE_TX ? ">>" : "<<", size, note);
+
+		for(i = 0; i < size && i < 16; i++)
+			fprintf(out, " %02x", data[i]);
+
+		fprintf(out, "%s\n", size > 16 ? " ..." : "");
+	}
+
+	free(data);
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define CAPTURE_SLOT_DATA	48	/* payload bytes per slot, longer buffers span slots */
+
+typedef enum capture_direction {
+	CAPTURE_TX,
+	CAPTURE_RX
+} capture_direction_t ;
+
+#define CAPTURE_CONTINUED	0x01	/* next slot carries the rest of the buffer */
+
+typedef struct capture_slot {
+	_Atomic uint64_t sequence;	/* global slot index + 1 once published, 0 while written */
+	uint64_t timestamp;			/* CLOCK_MONOTONIC, nanoseconds */
+	int32_t fd;
+	uint16_t length;
+	uint8_t direction;
+	uint8_t flags;
+	uint8_t data[CAPTURE_SLOT_DATA];
+} capture_slot_t ;
+
+/* lock-free ring, writers reserve slots with a single atomic add */
+typedef struct capture {
+	_Atomic uint64_t head;
+	uint32_t slots_count;
+	capture_slot_t *slots;
+} capture_t ;
+
+extern capture_t * _Atomic capture_ring;
+
+#define CAPTURE_RECORD(fd, direction, buffer, len) \
+	do { if (atomic_load_explicit(&capture_ring, memory_order_relaxed) != NULL) capture_record(fd, direction, buffer, len); } while (0)
+
+int capture_start(uint32_t slots_count);
+void capture_stop(void);
+void capture_record(int fd, capture_direction_t direction, const void *buffer, int len);
+int capture_dump(const char *path);
+int capture_decode(FILE *in, FILE *out);
+
+#endif /* CAPTURE_H_ */
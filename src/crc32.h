@@ -0,0 +1,41 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* IEEE 802.3 CRC-32 (zlib), start with crc = 0 */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size);
+
+#define CRC32_STM32_POLY	0x04C11DB7
+#define CRC32_STM32_INIT	0xFFFFFFFF
+
+/*
+ * CRC-32/MPEG-2 as the STM32 CRC unit computes it, fed with little-endian
+ * 32-bit words, start with crc = CRC32_STM32_INIT, no final xor
+ */
+uint32_t crc32_stm32(uint32_t crc, const void *data, size_t words);
+
+#endif /* CRC32_H_ */
@@ -0,0 +1,113 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "erase_map.h"
+#include "geometry.h"
+
+static void erase_map_set(erase_map_t *map, uint32_t first, uint32_t last, int erased){
+
+	uint32_t i = 0;
+
+	for(i = first; i <= last && i < map->granules_count; i++){
+		if (erased)
+			map->bits[i / 8] |= 1 << (i % 8);
+		else
+			map->bits[i / 8] &= ~(1 << (i % 8));
+	}
+}
+
+/* granules overlapping the range, -1 when it leaves the flash */
+static int erase_map_range(const erase_map_t *map, uint32_t address, uint32_t size, uint32_t *first, uint32_t *last){
+
+	uint32_t base = map->geometry->base;
+
+	if (size == 0 || address < base || (uint64_t)address - base + size > (uint64_t)map->granules_count * ERASE_MAP_GRANULE)
+		return -1;
+
+	*first = (address - base) / ERASE_MAP_GRANULE;
+	*last = (address - base + size - 1) / ERASE_MAP_GRANULE;
+
+	return 0;
+}
+
+int erase_map_init(erase_map_t *map, const geometry_t *geometry){
+
+	map->geometry = geometry;
+	map->granules_count = geometry_size(geometry) / ERASE_MAP_GRANULE;
+
+	/* nothing is known about the target yet */
+	map->bits = calloc(map->granules_count / 8 + 1, 1);
+
+	return map->bits == NULL ? -1 : 0;
+}
+
+void erase_map_free(erase_map_t *map){
+
+	free(map->bits);
+	map->bits = NULL;
+	map->granules_count = 0;
+}
+
+void erase_map_all(erase_map_t *map, int erased){
+	memset(map->bits, erased ? 0xFF : 0, map->granules_count / 8 + 1);
+}
+
+void erase_map_pages(erase_map_t *map, const uint16_t *pages, uint32_t pages_size){
+
+	uint32_t i = 0;
+
+	for(i = 0; i < pages_size; i++){
+
+		uint32_t address, size, first, last;
+
+		if (
+			geometry_page(map->geometry, pages[i], &address, &size) == 0 &&
+			erase_map_range(map, address, size, &first, &last) == 0
+		)
+			erase_map_set(map, first, last, 1);
+	}
+}
+
+void erase_map_written(erase_map_t *map, uint32_t address, uint32_t size){
+
+	uint32_t first, last;
+
+	if (erase_map_range(map, address, size, &first, &last) == 0)
+		erase_map_set(map, first, last, 0);
+}
+
+int erase_map_is_erased(const erase_map_t *map, uint32_t address, uint32_t size){
+
+	uint32_t first, last, i;
+
+	if (erase_map_range(map, address, size, &first, &last) != 0)
+		return 0;
+
+	for(i = first; i <= last; i++)
+		if (!(map->bits[i / 8] & (1 << (i % 8))))
+			return 0;
+
+	return 1;
+}
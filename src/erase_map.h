@@ -0,0 +1,45 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef ERASE_MAP_H_
+#define ERASE_MAP_H_
+
+#include <stdint.h>
+#include "geometry.h"
+
+#define ERASE_MAP_GRANULE	64	/* tracking resolution, divides every page size */
+
+/* which parts of the flash are known to be erased and not written since */
+typedef struct erase_map {
+	const geometry_t *geometry;
+	uint32_t granules_count;
+	uint8_t *bits;
+} erase_map_t ;
+
+int erase_map_init(erase_map_t *map, const geometry_t *geometry);
+void erase_map_free(erase_map_t *map);
+void erase_map_all(erase_map_t *map, int erased);
+void erase_map_pages(erase_map_t *map, const uint16_t *pages, uint32_t pages_size);
+void erase_map_written(erase_map_t *map, uint32_t address, uint32_t size);
+int erase_map_is_erased(const erase_map_t *map, uint32_t address, uint32_t size);
+
+#endif /* ERASE_MAP_H_ */
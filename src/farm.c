@@ -0,0 +1,229 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "farm.h"
+#include "stm32.h"
+#include "stm32_flash.h"
+#include "stm32_cache.h"
+#include "stm32_journal.h"
+#include "serial.h"
+
+typedef struct farm_pool {
+	farm_t *farm;
+	atomic_uint next;
+} farm_pool_t ;
+
+typedef struct farm_job {
+	farm_pool_t *pool;
+	farm_port_t *port;
+} farm_job_t ;
+
+static double farm_now(void){
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void farm_port_progress(uint32_t done, uint32_t total, void *arg){
+
+	farm_job_t *job = arg;
+	farm_t *farm = job->pool->farm;
+
+	farm->progress(job->port, done, total, farm->progress_arg);
+}
+
+static void farm_flash_port(farm_pool_t *pool, farm_port_t *port){
+
+	farm_t *farm = pool->farm;
+	farm_job_t job = { pool, port };
+	stm32_cache_t cache;
+	stm32_journal_t journal;
+	stm32_flash_t flash;
+	stm32_ctx_t *ctx;
+
+	port->stage = FARM_STAGE_OPEN;
+	port->result = STM32_ERR_SERIAL;
+
+	/* the context embeds the serial_io buffers, sizeof(stm32_ctx_t) is too much for small thread stacks */
+	ctx = malloc(sizeof(stm32_ctx_t));
+
+	if (ctx == NULL){
+		port->result = STM32_ERR_SYSTEM;
+		return;
+	}
+
+	int fd = serial_open(port->device);
+
+	if (fd < 0){
+		free(ctx);
+		return;
+	}
+
+	stm32_ctx_init(ctx, fd);
+	ctx->metrics = port->metrics;
+	ctx->timeline = port->timeline;
+	port->stage = FARM_STAGE_SETUP;
+
+	if (
+		serial_setup(fd, SERIAL_BAUD_115200, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOP_BITS_1) != SERIAL_ERR_OK ||
+		(farm->rate != 0 && serial_set_rate(fd, farm->rate) != SERIAL_ERR_OK)
+	)
+		goto out;
+
+	stm32_ctx_rate(ctx, farm->rate ? farm->rate : 115200);
+	serial_flush(fd);
+	port->stage = FARM_STAGE_INIT;
+
+	if ((port->result = stm32_init(ctx)) != STM32_ERR_OK)
+		goto out;
+
+	/* every port works on its own copy of the job, the image stays shared */
+	flash = farm->job;
+	flash.cache = NULL;
+	flash.journal = NULL;
+
+	if (farm->progress != NULL){
+		flash.progress = farm_port_progress;
+		flash.progress_arg = &job;
+	}
+
+	if (farm->cache_dir != NULL && flash.geometry != NULL){
+
+		port->stage = FARM_STAGE_CACHE;
+
+		if ((port->result = stm32_cache_open(ctx, &cache, farm->cache_dir, flash.geometry, 0)) != STM32_ERR_OK)
+			goto out;
+
+		flash.cache = &cache;
+	}
+
+	if (farm->journal_dir != NULL && flash.geometry != NULL){
+
+		port->stage = FARM_STAGE_JOURNAL;
+
+		if ((port->result = stm32_journal_open(ctx, &journal, farm->journal_dir, flash.image, flash.geometry, 0)) != STM32_ERR_OK){
+			if (flash.cache != NULL)
+				stm32_cache_close(&cache);
+			goto out;
+		}
+
+		flash.journal = &journal;
+	}
+
+	port->stage = FARM_STAGE_FLASH;
+	port->result = stm32_flash(ctx, &flash);
+	port->pages_changed = flash.pages_changed;
+	port->frames_written = flash.frames_written;
+	port->frames_resumed = flash.frames_resumed;
+
+	if (flash.cache != NULL)
+		stm32_cache_close(&cache);
+
+	if (flash.journal != NULL)
+		stm32_journal_close(&journal);
+
+	if (port->result == STM32_ERR_OK)
+		port->stage = FARM_STAGE_DONE;
+
+out:
+	port->stats = ctx->stats;
+	serial_close(fd);
+	free(ctx);
+}
+
+static void *farm_worker(void *arg){
+
+	farm_pool_t *pool = arg;
+	farm_t *farm = pool->farm;
+	uint32_t index;
+
+	/* ports are handed out one at a time, fast ports pick up more work */
+	while((index = atomic_fetch_add(&pool->next, 1)) < farm->ports_count){
+
+		farm_port_t *port = &farm->ports[index];
+		double start = farm_now();
+
+		farm_flash_port(pool, port);
+		port->seconds = farm_now() - start;
+	}
+
+	return NULL;
+}
+
+int farm_run(farm_t *farm){
+
+	farm_pool_t pool;
+	pthread_t *threads;
+	uint32_t started = 0;
+	uint32_t i = 0;
+
+	if (farm == NULL || farm->ports == NULL || farm->ports_count == 0 || farm->job.image == NULL)
+		return -1;
+
+	uint32_t workers = farm->workers;
+
+	if (workers == 0 || workers > farm->ports_count)
+		workers = farm->ports_count;
+
+	threads = malloc(workers * sizeof(pthread_t));
+
+	if (threads == NULL)
+		return -1;
+
+	pool.farm = farm;
+	atomic_init(&pool.next, 0);
+
+	double start = farm_now();
+
+	for(i = 0; i < workers; i++)
+		if (pthread_create(&threads[started], NULL, farm_worker, &pool) == 0)
+			started++;
+
+	/* with no worker at all nothing would ever run */
+	if (started == 0)
+		farm_worker(&pool);
+
+	for(i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	farm->seconds = farm_now() - start;
+	farm->ports_ok = 0;
+
+	for(i = 0; i < farm->ports_count; i++)
+		farm->ports_ok += farm->ports[i].stage == FARM_STAGE_DONE;
+
+	farm->throughput = farm->seconds > 0 ? (double)image_size(farm->job.image) * farm->ports_ok / farm->seconds : 0;
+
+	return farm->ports_ok == farm->ports_count ? 0 : 1;
+}
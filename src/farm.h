@@ -0,0 +1,76 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef FARM_H_
+#define FARM_H_
+
+#include <stdint.h>
+#include "stm32.h"
+#include "stm32_flash.h"
+
+typedef enum farm_stage {
+	FARM_STAGE_OPEN,
+	FARM_STAGE_SETUP,
+	FARM_STAGE_INIT,
+	FARM_STAGE_CACHE,
+	FARM_STAGE_JOURNAL,
+	FARM_STAGE_FLASH,
+	FARM_STAGE_DONE
+} farm_stage_t ;
+
+typedef struct farm_port {
+	const char *device;
+	metrics_t *metrics;			/* optional, filled in as the port is flashed */
+	timeline_t *timeline;		/* optional, likewise */
+
+	/* filled in by farm_run() */
+	farm_stage_t stage;			/* FARM_STAGE_DONE on success, otherwise where it failed */
+	stm32_errors_t result;
+	double seconds;
+	stm32_stats_t stats;
+	uint32_t pages_changed;
+	uint32_t frames_written;
+	uint32_t frames_resumed;
+} farm_port_t ;
+
+typedef void (*farm_progress_t)(const farm_port_t *port, uint32_t done, uint32_t total, void *arg);
+
+typedef struct farm {
+	farm_port_t *ports;
+	uint32_t ports_count;
+	uint32_t workers;			/* 0 runs every port at once */
+	uint32_t rate;				/* baud rate, 0 for 115200 */
+	stm32_flash_t job;			/* template, the image is shared read-only by all ports */
+	const char *cache_dir;		/* per-device page hash caches, may be NULL */
+	const char *journal_dir;	/* per-device resume journals, may be NULL */
+	farm_progress_t progress;	/* may be called from several threads at once */
+	void *progress_arg;
+
+	/* filled in by farm_run() */
+	uint32_t ports_ok;
+	double seconds;
+	double throughput;			/* image bytes per second over all good ports */
+} farm_t ;
+
+int farm_run(farm_t *farm);
+
+#endif /* FARM_H_ */
@@ -0,0 +1,129 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include "geometry.h"
+
+#define KB	1024
+
+static const geometry_region_t stm32f4_512k[] = {
+	{ 16 * KB, 4 }, { 64 * KB, 1 }, { 128 * KB, 3 }
+};
+
+static const geometry_region_t stm32f4_1m[] = {
+	{ 16 * KB, 4 }, { 64 * KB, 1 }, { 128 * KB, 7 }
+};
+
+static const geometry_region_t stm32f4_2m[] = {
+	{ 16 * KB, 4 }, { 64 * KB, 1 }, { 128 * KB, 7 },
+	{ 16 * KB, 4 }, { 64 * KB, 1 }, { 128 * KB, 7 }
+};
+
+static const geometry_region_t stm32f7_1m[] = {
+	{ 32 * KB, 4 }, { 128 * KB, 1 }, { 256 * KB, 3 }
+};
+
+const geometry_t geometry_stm32f4_512k = { 0x08000000, stm32f4_512k, 3 };
+const geometry_t geometry_stm32f4_1m = { 0x08000000, stm32f4_1m, 3 };
+const geometry_t geometry_stm32f4_2m = { 0x08000000, stm32f4_2m, 6 };
+const geometry_t geometry_stm32f7_1m = { 0x08000000, stm32f7_1m, 3 };
+
+void geometry_uniform(geometry_t *geometry, geometry_region_t *region, uint32_t base, uint32_t page_size, uint16_t pages_count){
+
+	region->page_size = page_size;
+	region->pages_count = pages_count;
+
+	geometry->base = base;
+	geometry->regions = region;
+	geometry->regions_count = 1;
+}
+
+uint32_t geometry_pages(const geometry_t *geometry){
+
+	uint32_t pages = 0;
+	uint8_t i = 0;
+
+	for(i = 0; i < geometry->regions_count; i++)
+		pages += geometry->regions[i].pages_count;
+
+	return pages;
+}
+
+uint32_t geometry_size(const geometry_t *geometry){
+
+	uint32_t size = 0;
+	uint8_t i = 0;
+
+	for(i = 0; i < geometry->regions_count; i++)
+		size += geometry->regions[i].page_size * geometry->regions[i].pages_count;
+
+	return size;
+}
+
+int geometry_find(const geometry_t *geometry, uint32_t address, uint16_t *page){
+
+	uint32_t offset = address - geometry->base;
+	uint32_t first = 0;
+	uint8_t i = 0;
+
+	if (address < geometry->base)
+		return -1;
+
+	for(i = 0; i < geometry->regions_count; i++){
+
+		const geometry_region_t *region = &geometry->regions[i];
+		uint32_t size = region->page_size * region->pages_count;
+
+		if (offset < size){
+			*page = first + offset / region->page_size;
+			return 0;
+		}
+
+		offset -= size;
+		first += region->pages_count;
+	}
+
+	return -1;
+}
+
+int geometry_page(const geometry_t *geometry, uint16_t page, uint32_t *address, uint32_t *size){
+
+	uint32_t offset = geometry->base;
+	uint8_t i = 0;
+
+	for(i = 0; i < geometry->regions_count; i++){
+
+		const geometry_region_t *region = &geometry->regions[i];
+
+		if (page < region->pages_count){
+			*address = offset + page * region->page_size;
+			*size = region->page_size;
+			return 0;
+		}
+
+		offset += region->page_size * region->pages_count;
+		page -= region->pages_count;
+	}
+
+	return -1;
+}
@@ -0,0 +1,53 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef GEOMETRY_H_
+#define GEOMETRY_H_
+
+#include <stdint.h>
+
+/* run of equally sized erase pages (or sectors) */
+typedef struct geometry_region {
+	uint32_t page_size;
+	uint16_t pages_count;
+} geometry_region_t ;
+
+/* flash layout, pages are numbered from base as 'extended erase' expects */
+typedef struct geometry {
+	uint32_t base;
+	const geometry_region_t *regions;
+	uint8_t regions_count;
+} geometry_t ;
+
+/* mixed sector layouts, sectors numbered as 'extended erase' expects */
+extern const geometry_t geometry_stm32f4_512k;
+extern const geometry_t geometry_stm32f4_1m;
+extern const geometry_t geometry_stm32f4_2m;	/* dual bank */
+extern const geometry_t geometry_stm32f7_1m;
+
+void geometry_uniform(geometry_t *geometry, geometry_region_t *region, uint32_t base, uint32_t page_size, uint16_t pages_count);
+uint32_t geometry_pages(const geometry_t *geometry);
+uint32_t geometry_size(const geometry_t *geometry);
+int geometry_find(const geometry_t *geometry, uint32_t address, uint16_t *page);
+int geometry_page(const geometry_t *geometry, uint16_t page, uint32_t *address, uint32_t *size);
+
+#endif /* GEOMETRY_H_ */
@@ -0,0 +1,290 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "image.h"
+
+#define ALIGN_DOWN(x)	((x) & ~(uint64_t)(IMAGE_FRAME_ALIGN - 1))
+#define ALIGN_UP(x)		ALIGN_DOWN((x) + IMAGE_FRAME_ALIGN - 1)
+
+static uint64_t segment_end(const image_segment_t *segment){
+	return (uint64_t)segment->address + segment->size;
+}
+
+static int segment_compare(const void *a, const void *b){
+
+	const image_segment_t *sa = a;
+	const image_segment_t *sb = b;
+
+	if (sa->address != sb->address)
+		return sa->address < sb->address ? -1 : 1;
+
+	return 0;
+}
+
+/* index of the first segment ending after address */
+static uint32_t image_find(const image_t *image, uint32_t address){
+
+	uint32_t low = 0;
+	uint32_t high = image->segments_count;
+
+	while(low < high){
+		uint32_t mid = low + (high - low) / 2;
+
+		if (segment_end(&image->segments[mid]) <= address)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+image_errors_t image_init(image_t *image){
+
+	if (image == NULL)
+		return IMAGE_ERR_INVALID_ARGUMENT;
+
+	image->segments = NULL;
+	image->segments_count = 0;
+	image->segments_capacity = 0;
+	image->map = NULL;
+	image->map_size = 0;
+	image->buffer = NULL;
+
+	return IMAGE_ERR_OK;
+}
+
+void image_free(image_t *image){
+
+	if (image == NULL)
+		return;
+
+	free(image->segments);
+	free(image->buffer);
+
+	if (image->map != NULL)
+		munmap(image->map, image->map_size);
+
+	image_init(image);
+}
+
+image_errors_t image_add(image_t *image, uint32_t address, const uint8_t *data, uint32_t size){
+
+	if (image == NULL || data == NULL || size == 0)
+		return IMAGE_ERR_INVALID_ARGUMENT;
+
+	/* segment must not wrap the address space */
+	if ((uint64_t)address + size > 0x100000000ULL)
+		return IMAGE_ERR_INVALID_ARGUMENT;
+
+	if (image->segments_count == image->segments_capacity){
+
+		uint32_t capacity = image->segments_capacity ? image->segments_capacity * 2 : 16;
+		image_segment_t *segments = realloc(image->segments, capacity * sizeof(image_segment_t));
+
+		if (segments == NULL)
+			return IMAGE_ERR_SYSTEM;
+
+		image->segments = segments;
+		image->segments_capacity = capacity;
+	}
+
+	image_segment_t *segment = &image->segments[image->segments_count++];
+
+	segment->address = address;
+	segment->size = size;
+	segment->data = data;
+
+	return IMAGE_ERR_OK;
+}
+
+image_errors_t image_coalesce(image_t *image){
+
+	if (image == NULL)
+		return IMAGE_ERR_INVALID_ARGUMENT;
+
+	if (image->segments_count < 2)
+		return IMAGE_ERR_OK;
+
+	qsort(image->segments, image->segments_count, sizeof(image_segment_t), segment_compare);
+
+	uint32_t i = 0;
+	uint32_t last = 0;
+
+	for(i = 1; i < image->segments_count; i++){
+
+		image_segment_t *prev = &image->segments[last];
+		image_segment_t *next = &image->segments[i];
+
+		if (segment_end(prev) > next->address)
+			return IMAGE_ERR_OVERLAP;
+
+		/* merge only when both the addresses and the backing memory are continuous */
+		if (segment_end(prev) == next->address && prev->data + prev->size == next->data){
+			prev->size += next->size;
+			continue;
+		}
+
+		image->segments[++last] = *next;
+	}
+
+	image->segments_count = last + 1;
+
+	return IMAGE_ERR_OK;
+}
+
+/* sorted and free of overlaps, as frames and lookups expect */
+int image_ordered(const image_t *image){
+
+	uint32_t i = 0;
+
+	for(i = 1; i < image->segments_count; i++)
+		if (segment_end(&image->segments[i - 1]) > image->segments[i].address)
+			return 0;
+
+	return 1;
+}
+
+uint32_t image_size(const image_t *image){
+
+	uint32_t size = 0;
+	uint32_t i = 0;
+
+	for(i = 0; i < image->segments_count; i++)
+		size += image->segments[i].size;
+
+	return size;
+}
+
+uint32_t image_covered(const image_t *image, uint32_t address, uint32_t size){
+
+	uint64_t end = (uint64_t)address + size;
+	uint32_t covered = 0;
+	uint32_t i = image_find(image, address);
+
+	for(; i < image->segments_count && image->segments[i].address < end; i++){
+
+		const image_segment_t *segment = &image->segments[i];
+
+		uint64_t from = segment->address > address ? segment->address : address;
+		uint64_t to = segment_end(segment) < end ? segment_end(segment) : end;
+
+		covered += to - from;
+	}
+
+	return covered;
+}
+
+uint32_t image_fill(const image_t *image, uint32_t address, uint8_t *buffer, uint32_t size){
+
+	uint64_t end = (uint64_t)address + size;
+	uint32_t covered = 0;
+	uint32_t i = image_find(image, address);
+
+	memset(buffer, IMAGE_FILL, size);
+
+	for(; i < image->segments_count && image->segments[i].address < end; i++){
+
+		const image_segment_t *segment = &image->segments[i];
+
+		uint64_t from = segment->address > address ? segment->address : address;
+		uint64_t to = segment_end(segment) < end ? segment_end(segment) : end;
+
+		memcpy(buffer + (from - address), segment->data + (from - segment->address), to - from);
+		covered += to - from;
+	}
+
+	return covered;
+}
+
+void image_frames_init(image_frames_t *frames, const image_t *image){
+	image_frames_range(frames, image, 0, 0);
+	frames->end = 0x100000000ULL;
+}
+
+void image_frames_range(image_frames_t *frames, const image_t *image, uint32_t address, uint32_t size){
+
+	frames->image = image;
+	frames->end = (uint64_t)address + size;
+	frames->segment = image_find(image, address);
+	frames->address = address;
+
+	if (frames->segment < image->segments_count && image->segments[frames->segment].address > address)
+		frames->address = image->segments[frames->segment].address;
+}
+
+int image_frames_next(image_frames_t *frames, image_frame_t *frame){
+
+	const image_t *image = frames->image;
+
+	if (frames->segment >= image->segments_count || frames->address >= frames->end)
+		return 0;
+
+	uint64_t start = ALIGN_DOWN(frames->address);
+	uint64_t limit = (start & ~(uint64_t)(IMAGE_FRAME_SIZE - 1)) + IMAGE_FRAME_SIZE;
+	uint64_t last = frames->address;
+
+	if (limit > frames->end)
+		limit = frames->end;
+
+	memset(frame->data, IMAGE_FILL, IMAGE_FRAME_SIZE);
+	frame->payload = 0;
+
+	while(1){
+
+		const image_segment_t *segment = &image->segments[frames->segment];
+		uint64_t to = segment_end(segment) < limit ? segment_end(segment) : limit;
+
+		memcpy(
+			frame->data + (frames->address - start),
+			segment->data + (frames->address - segment->address),
+			to - frames->address
+		);
+
+		frame->payload += to - frames->address;
+		last = to;
+
+		/* frame is full or the range is exhausted */
+		if (to < segment_end(segment)){
+			frames->address = to;
+			break;
+		}
+
+		if (++frames->segment >= image->segments_count)
+			break;
+
+		frames->address = image->segments[frames->segment].address;
+
+		/* join the next segment while it shares the window and a padded word, never going back */
+		if (frames->address < last || frames->address >= limit || ALIGN_UP(last) < ALIGN_DOWN(frames->address))
+			break;
+	}
+
+	frame->address = start;
+	frame->size = ALIGN_UP(last) - start;
+
+	return 1;
+}
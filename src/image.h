@@ -0,0 +1,89 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMAGE_FRAME_SIZE	0x100	/* largest 'write memory' block */
+#define IMAGE_FRAME_ALIGN	4		/* 'write memory' address and size alignment */
+#define IMAGE_FILL			(uint8_t)0xFF
+
+typedef enum image_errors {
+	IMAGE_ERR_OK,
+	IMAGE_ERR_INVALID_ARGUMENT,
+	IMAGE_ERR_OVERLAP,
+	IMAGE_ERR_SYSTEM,
+	IMAGE_ERR_FORMAT
+} image_errors_t ;
+
+/* continuous run of bytes at a target address, data is not owned */
+typedef struct image_segment {
+	uint32_t address;
+	uint32_t size;
+	const uint8_t *data;
+} image_segment_t ;
+
+/* sparse address-ranged image */
+typedef struct image {
+	image_segment_t *segments;
+	uint32_t segments_count;
+	uint32_t segments_capacity;
+
+	/* storage a loader backs the segments with, released by image_free() */
+	void *map;
+	size_t map_size;
+	uint8_t *buffer;
+} image_t ;
+
+/* single 'write memory' block, aligned and padded with IMAGE_FILL */
+typedef struct image_frame {
+	uint32_t address;
+	uint16_t size;
+	uint16_t payload;	/* image bytes carried by the frame */
+	uint8_t data[IMAGE_FRAME_SIZE];
+} image_frame_t ;
+
+/* frame iterator over an address range of an image_ordered() image, image_coalesce() makes one */
+typedef struct image_frames {
+	const image_t *image;
+	uint32_t segment;
+	uint32_t address;
+	uint64_t end;
+} image_frames_t ;
+
+image_errors_t image_init(image_t *image);
+void image_free(image_t *image);
+image_errors_t image_add(image_t *image, uint32_t address, const uint8_t *data, uint32_t size);
+image_errors_t image_coalesce(image_t *image);
+int image_ordered(const image_t *image);
+uint32_t image_size(const image_t *image);
+uint32_t image_covered(const image_t *image, uint32_t address, uint32_t size);
+uint32_t image_fill(const image_t *image, uint32_t address, uint8_t *buffer, uint32_t size);
+
+void image_frames_init(image_frames_t *frames, const image_t *image);
+void image_frames_range(image_frames_t *frames, const image_t *image, uint32_t address, uint32_t size);
+int image_frames_next(image_frames_t *frames, image_frame_t *frame);
+
+#endif /* IMAGE_H_ */
@@ -0,0 +1,414 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "image_load.h"
+
+/* hex digit value plus one, 0 for anything else */
+static const uint8_t hex_values[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16
+};
+
+/* one line of a text format, without its line break */
+typedef struct load_text {
+	const uint8_t *next;
+	const uint8_t *end;
+	const uint8_t *line;
+	uint32_t size;
+	uint32_t number;
+} load_text_t ;
+
+static int text_line(load_text_t *text){
+
+	while(text->next < text->end){
+
+		const uint8_t *line = text->next;
+		const uint8_t *eol = memchr(line, '\n', text->end - line);
+
+		if (eol == NULL)
+			eol = text->end;
+
+		text->next = eol < text->end ? eol + 1 : eol;
+		text->number++;
+
+		/* trailing CR and blanks, then skip empty lines */
+		while(eol > line && (eol[-1] == '\r' || eol[-1] == ' ' || eol[-1] == '\t'))
+			eol--;
+
+		if (eol > line){
+			text->line = line;
+			text->size = eol - line;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* decodes size bytes from hex pairs, -1 on a bad digit, otherwise their sum */
+static int hex_decode(const uint8_t *text, uint8_t *out, uint32_t size, uint8_t *sum){
+
+	uint8_t bad = 0;
+	uint8_t total = 0;
+	uint32_t i = 0;
+
+	for(i = 0; i < size; i++){
+
+		uint8_t high = hex_values[text[2 * i]];
+		uint8_t low = hex_values[text[2 * i + 1]];
+
+		bad |= !high | !low;
+		out[i] = (high - 1) << 4 | (low - 1);
+		total += out[i];
+	}
+
+	*sum += total;
+
+	return bad ? -1 : 0;
+}
+
+/* adds a run, growing the last segment while the address and the storage follow on */
+static image_errors_t load_append(image_t *image, uint32_t address, const uint8_t *data, uint32_t size){
+
+	if (size == 0)
+		return IMAGE_ERR_OK;
+
+	if (image->segments_count > 0){
+
+		image_segment_t *last = &image->segments[image->segments_count - 1];
+
+		if ((uint64_t)last->address + last->size == address && last->data + last->size == data){
+
+			if ((uint64_t)address + size > 0x100000000ULL)
+				return IMAGE_ERR_FORMAT;
+
+			last->size += size;
+			return IMAGE_ERR_OK;
+		}
+	}
+
+	if (image_add(image, address, data, size) != IMAGE_ERR_OK)
+		return (uint64_t)address + size > 0x100000000ULL ? IMAGE_ERR_FORMAT : IMAGE_ERR_SYSTEM;
+
+	return IMAGE_ERR_OK;
+}
+
+static image_errors_t load_hex(image_t *image, image_load_t *load){
+
+	load_text_t text = { image->map, (const uint8_t *)image->map + image->map_size, NULL, 0, 0 };
+	uint32_t used = 0;
+	uint32_t base = 0;
+	image_errors_t result;
+
+	while(text_line(&text)){
+
+		uint8_t header[4];
+		uint8_t scratch[0x100];
+		uint8_t sum = 0;
+
+		load->line = text.number;
+
+		/* ':' count, address, type, data and checksum as hex pairs */
+		if (text.line[0] != ':' || text.size < 11 || hex_decode(text.line + 1, header, 4, &sum) != 0)
+			return IMAGE_ERR_FORMAT;
+
+		uint8_t count = header[0];
+		uint16_t offset = (uint16_t)header[1] << 8 | header[2];
+		uint8_t type = header[3];
+
+		if (text.size != 11u + 2u * count)
+			return IMAGE_ERR_FORMAT;
+
+		/* data goes straight to the image buffer, everything else is a few bytes */
+		uint8_t *data = type == 0x00 ? image->buffer + used : scratch;
+
+		if (
+			hex_decode(text.line + 9, data, count, &sum) != 0 ||
+			hex_decode(text.line + 9 + 2 * count, scratch + count, 1, &sum) != 0 || sum != 0
+		)
+			return IMAGE_ERR_FORMAT;
+
+		switch(type){
+			case 0x00:
+				if ((result = load_append(image, base + offset, data, count)) != IMAGE_ERR_OK)
+					return result;
+
+				used += count;
+				break;
+
+			case 0x01:
+				load->line = 0;
+				return IMAGE_ERR_OK;
+
+			case 0x02:
+			case 0x04:
+				if (count != 2)
+					return IMAGE_ERR_FORMAT;
+
+				base = ((uint32_t)data[0] << 8 | data[1]) << (type == 0x02 ? 4 : 16);
+				break;
+
+			case 0x03:
+			case 0x05:
+				if (count != 4)
+					return IMAGE_ERR_FORMAT;
+
+				if (type == 0x03)
+					load->entry = ((uint32_t)data[0] << 8 | data[1]) * 16 + ((uint32_t)data[2] << 8 | data[3]);
+				else
+					load->entry = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+				break;
+
+			default:
+				return IMAGE_ERR_FORMAT;
+		}
+	}
+
+	/* the end of file record is mandatory */
+	load->line = text.number;
+
+	return IMAGE_ERR_FORMAT;
+}
+
+static image_errors_t load_srec(image_t *image, image_load_t *load){
+
+	/* address bytes by record type, 0 for the reserved S4 */
+	static const uint8_t address_sizes[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+
+	load_text_t text = { image->map, (const uint8_t *)image->map + image->map_size, NULL, 0, 0 };
+	uint32_t used = 0;
+	image_errors_t result;
+
+	while(text_line(&text)){
+
+		uint8_t header[5];
+		uint8_t scratch[0x100];
+		uint8_t sum = 0;
+
+		load->line = text.number;
+
+		if (text.size < 4)
+			return IMAGE_ERR_FORMAT;
+
+		/* 'S' type, then count, address, data and checksum as hex pairs */
+		uint8_t type = text.line[1] - '0';
+
+		if (text.line[0] != 'S' || type > 9 || address_sizes[type] == 0 || hex_decode(text.line + 2, header, 1, &sum) != 0)
+			return IMAGE_ERR_FORMAT;
+
+		uint8_t count = header[0];
+		uint8_t address_size = address_sizes[type];
+
+		if (text.size != 4u + 2u * count || count < address_size + 1)
+			return IMAGE_ERR_FORMAT;
+
+		uint32_t address = 0;
+		uint32_t i = 0;
+
+		if (hex_decode(text.line + 4, header + 1, address_size, &sum) != 0)
+			return IMAGE_ERR_FORMAT;
+
+		for(i = 0; i < address_size; i++)
+			address = address << 8 | header[1 + i];
+
+		uint32_t size = count - address_size - 1;
+		uint8_t *data = type >= 1 && type <= 3 ? image->buffer + used : scratch;
+		const uint8_t *digits = text.line + 4 + 2 * address_size;
+
+		/* the checksum is the complement of the sum of everything before it */
+		if (
+			hex_decode(digits, data, size, &sum) != 0 ||
+			hex_decode(digits + 2 * size, scratch + size, 1, &sum) != 0 || sum != 0xFF
+		)
+			return IMAGE_ERR_FORMAT;
+
+		if (type >= 1 && type <= 3){
+
+			if ((result = load_append(image, address, data, size)) != IMAGE_ERR_OK)
+				return result;
+
+			used += size;
+
+		} else if (type >= 7){
+			load->entry = address;
+		}
+	}
+
+	load->line = 0;
+
+	return IMAGE_ERR_OK;
+}
+
+static uint16_t get_le16(const uint8_t *data){
+	return data[0] | (uint16_t)data[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *data){
+	return data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static image_errors_t load_elf(image_t *image, image_load_t *load){
+
+	const uint8_t *map = image->map;
+	uint64_t size = image->map_size;
+	image_errors_t result;
+
+	if (size < sizeof(Elf32_Ehdr) || map[EI_CLASS] != ELFCLASS32 || map[EI_DATA] != ELFDATA2LSB)
+		return IMAGE_ERR_FORMAT;
+
+	uint32_t phoff = get_le32(map + offsetof(Elf32_Ehdr, e_phoff));
+	uint16_t phentsize = get_le16(map + offsetof(Elf32_Ehdr, e_phentsize));
+	uint16_t phnum = get_le16(map + offsetof(Elf32_Ehdr, e_phnum));
+	uint16_t i = 0;
+
+	if (phnum > 0 && (phentsize < sizeof(Elf32_Phdr) || phoff + (uint64_t)phnum * phentsize > size))
+		return IMAGE_ERR_FORMAT;
+
+	load->entry = get_le32(map + offsetof(Elf32_Ehdr, e_entry));
+
+	/* file backed part of every loadable segment, .bss has nothing to program */
+	for(i = 0; i < phnum; i++){
+
+		const uint8_t *header = map + phoff + (uint32_t)i * phentsize;
+		uint32_t offset = get_le32(header + offsetof(Elf32_Phdr, p_offset));
+		uint32_t filesz = get_le32(header + offsetof(Elf32_Phdr, p_filesz));
+
+		if (get_le32(header + offsetof(Elf32_Phdr, p_type)) != PT_LOAD || filesz == 0)
+			continue;
+
+		if ((uint64_t)offset + filesz > size)
+			return IMAGE_ERR_FORMAT;
+
+		if ((result = load_append(image, get_le32(header + offsetof(Elf32_Phdr, p_paddr)), map + offset, filesz)) != IMAGE_ERR_OK)
+			return result;
+	}
+
+	return IMAGE_ERR_OK;
+}
+
+static image_format_t load_detect(const uint8_t *map, size_t size){
+
+	if (size >= SELFMAG && memcmp(map, ELFMAG, SELFMAG) == 0)
+		return IMAGE_FORMAT_ELF;
+
+	if (size >= 11 && map[0] == ':' && hex_values[map[1]] && hex_values[map[2]])
+		return IMAGE_FORMAT_HEX;
+
+	if (size >= 10 && map[0] == 'S' && map[1] >= '0' && map[1] <= '9' && hex_values[map[2]] && hex_values[map[3]])
+		return IMAGE_FORMAT_SREC;
+
+	return IMAGE_FORMAT_BIN;
+}
+
+static image_errors_t load_map(image_t *image, const char *path){
+
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return IMAGE_ERR_SYSTEM;
+
+	if (fstat(fd, &st) != 0){
+		close(fd);
+		return IMAGE_ERR_SYSTEM;
+	}
+
+	/* nothing to map, or more than the address space holds */
+	if (!S_ISREG(st.st_mode) || st.st_size == 0 || (uint64_t)st.st_size > 0xFFFFFFFFULL){
+		close(fd);
+		return st.st_size == 0 ? IMAGE_ERR_FORMAT : IMAGE_ERR_INVALID_ARGUMENT;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return IMAGE_ERR_SYSTEM;
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	image->map = map;
+	image->map_size = st.st_size;
+
+	return IMAGE_ERR_OK;
+}
+
+image_errors_t image_load(image_t *image, image_load_t *load){
+
+	image_errors_t result;
+
+	if (image == NULL || load == NULL || load->path == NULL || image->map != NULL || image->buffer != NULL)
+		return IMAGE_ERR_INVALID_ARGUMENT;
+
+	load->detected = load->format;
+	load->entry = 0;
+	load->line = 0;
+
+	if ((result = load_map(image, load->path)) != IMAGE_ERR_OK){
+		image_free(image);
+		return result;
+	}
+
+	if (load->detected == IMAGE_FORMAT_AUTO)
+		load->detected = load_detect(image->map, image->map_size);
+
+	/* text formats decode into one buffer, two digits per byte at most */
+	if (load->detected == IMAGE_FORMAT_HEX || load->detected == IMAGE_FORMAT_SREC){
+
+		image->buffer = malloc(image->map_size / 2 + 1);
+
+		if (image->buffer == NULL){
+			image_free(image);
+			return IMAGE_ERR_SYSTEM;
+		}
+	}
+
+	switch(load->detected){
+		case IMAGE_FORMAT_HEX : result = load_hex(image, load); break;
+		case IMAGE_FORMAT_SREC: result = load_srec(image, load); break;
+		case IMAGE_FORMAT_ELF : result = load_elf(image, load); break;
+		default:
+			result = load_append(image, load->base, image->map, image->map_size);
+			break;
+	}
+
+	if (result == IMAGE_ERR_OK)
+		result = image_coalesce(image);
+
+	if (result != IMAGE_ERR_OK)
+		image_free(image);
+
+	return result;
+}
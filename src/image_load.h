@@ -0,0 +1,55 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef IMAGE_LOAD_H_
+#define IMAGE_LOAD_H_
+
+#include <stdint.h>
+#include "image.h"
+
+typedef enum image_format {
+	IMAGE_FORMAT_AUTO,
+	IMAGE_FORMAT_BIN,
+	IMAGE_FORMAT_HEX,		/* Intel HEX, I8HEX to I32HEX */
+	IMAGE_FORMAT_SREC,		/* Motorola S-record, S19 to S37 */
+	IMAGE_FORMAT_ELF		/* 32-bit little-endian, PT_LOAD segments at their physical address */
+} image_format_t ;
+
+typedef struct image_load {
+	const char *path;
+	image_format_t format;	/* IMAGE_FORMAT_AUTO tells ELF, HEX and SREC by content, anything else is raw */
+	uint32_t base;			/* load address of a raw binary */
+
+	/* filled in by image_load() */
+	image_format_t detected;
+	uint32_t entry;			/* start address record or ELF entry point, 0 when absent */
+	uint32_t line;			/* HEX or SREC line a format error was found on */
+} image_load_t ;
+
+/*
+ * maps the file and adds its contents to an image that has no loader storage
+ * yet, segments point into the mapping or one decode buffer, the image comes
+ * back sorted and coalesced and is released on failure
+ */
+image_errors_t image_load(image_t *image, image_load_t *load);
+
+#endif /* IMAGE_LOAD_H_ */
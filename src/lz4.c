@@ -0,0 +1,198 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+
+#include <string.h>
+#include <stdint.h>
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH		4
+#define LZ4_LAST_LITERALS	5	/* the block always ends with literals */
+#define LZ4_MATCH_LIMIT		12	/* no match starts this close to the end */
+#define LZ4_MAX_OFFSET		0xFFFF
+#define LZ4_HASH_BITS		12
+
+static uint32_t lz4_read32(const uint8_t *p){
+
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+
+	return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence){
+	return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* 15 in the token nibble, then 255 per byte until the remainder */
+static uint8_t *lz4_put_length(uint8_t *out, uint32_t length){
+
+	for(length -= 15; length >= 255; length -= 255)
+		*out++ = 255;
+
+	*out++ = length;
+
+	return out;
+}
+
+static uint8_t *lz4_sequence(uint8_t *out, const uint8_t *literals, uint32_t literals_size, uint32_t offset, uint32_t match_size){
+
+	uint8_t *token = out++;
+
+	*token = (literals_size < 15 ? literals_size : 15) << 4;
+
+	if (literals_size >= 15)
+		out = lz4_put_length(out, literals_size);
+
+	memcpy(out, literals, literals_size);
+	out += literals_size;
+
+	/* the final sequence carries literals only */
+	if (match_size == 0)
+		return out;
+
+	*out++ = offset & 0xFF;
+	*out++ = offset >> 8;
+
+	match_size -= LZ4_MIN_MATCH;
+	*token |= match_size < 15 ? match_size : 15;
+
+	if (match_size >= 15)
+		out = lz4_put_length(out, match_size);
+
+	return out;
+}
+
+/* greedy single-probe matcher, returns the compressed size or 0 when dst is too small */
+uint32_t lz4_compress(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t dst_size){
+
+	uint32_t table[1 << LZ4_HASH_BITS];
+	uint32_t anchor = 0;
+	uint32_t i = 0;
+	uint8_t *out = dst;
+
+	if (dst_size < LZ4_BOUND(src_size))
+		return 0;
+
+	memset(table, 0xFF, sizeof(table));
+
+	while(src_size > LZ4_MATCH_LIMIT && i < src_size - LZ4_MATCH_LIMIT){
+
+		uint32_t sequence = lz4_read32(src + i);
+		uint32_t h = lz4_hash(sequence);
+		uint32_t candidate = table[h];
+
+		table[h] = i;
+
+		if (candidate == 0xFFFFFFFF || i - candidate > LZ4_MAX_OFFSET || lz4_read32(src + candidate) != sequence){
+			i++;
+			continue;
+		}
+
+		/* extend forwards, stopping short of the trailing literals */
+		uint32_t limit = src_size - LZ4_LAST_LITERALS;
+		uint32_t match = LZ4_MIN_MATCH;
+
+		while(i + match < limit && src[candidate + match] == src[i + match])
+			match++;
+
+		/* and backwards into the pending literals */
+		while(i > anchor && candidate > 0 && src[candidate - 1] == src[i - 1]){
+			i--;
+			candidate--;
+			match++;
+		}
+
+		out = lz4_sequence(out, src + anchor, i - anchor, i - candidate, match);
+		i += match;
+		anchor = i;
+	}
+
+	out = lz4_sequence(out, src + anchor, src_size - anchor, 0, 0);
+
+	return out - dst;
+}
+
+static int lz4_get_length(const uint8_t **in, const uint8_t *end, uint32_t *length){
+
+	uint8_t byte;
+
+	do {
+		if (*in >= end)
+			return -1;
+
+		byte = *(*in)++;
+		*length += byte;
+	} while(byte == 255);
+
+	return 0;
+}
+
+/* returns the decompressed size, -1 for malformed input or a short dst */
+int32_t lz4_decompress(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t dst_size){
+
+	const uint8_t *in = src;
+	const uint8_t *end = src + src_size;
+	uint32_t out = 0;
+
+	while(in < end){
+
+		uint8_t token = *in++;
+		uint32_t literals = token >> 4;
+
+		if (literals == 15 && lz4_get_length(&in, end, &literals) != 0)
+			return -1;
+
+		if (literals > (uint32_t)(end - in) || literals > dst_size - out)
+			return -1;
+
+		memcpy(dst + out, in, literals);
+		in += literals;
+		out += literals;
+
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			return -1;
+
+		uint32_t offset = in[0] | (in[1] << 8);
+		uint32_t match = token & 0x0F;
+
+		in += 2;
+
+		if (match == 15 && lz4_get_length(&in, end, &match) != 0)
+			return -1;
+
+		match += LZ4_MIN_MATCH;
+
+		if (offset == 0 || offset > out || match > dst_size - out)
+			return -1;
+
+		/* byte by byte, the source may overlap what is being written */
+		for(; match > 0; match--, out++)
+			dst[out] = dst[out - offset];
+	}
+
+	return out;
+}
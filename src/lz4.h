@@ -0,0 +1,36 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+
+#ifndef LZ4_H_
+#define LZ4_H_
+
+#include <stdint.h>
+
+/* LZ4 block format, no frame header, decodable by the reference decoder */
+
+#define LZ4_BOUND(size)	((size) + (size) / 255 + 16)	/* worst case compressed size */
+
+uint32_t lz4_compress(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t dst_size);
+int32_t lz4_decompress(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t dst_size);
+
+#endif /* LZ4_H_ */
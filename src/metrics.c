@@ -0,0 +1,395 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include "metrics.h"
+
+typedef struct metrics_name {
+	uint8_t opcode;
+	const char *name;
+} metrics_name_t ;
+
+/* slot order, the last entry collects unknown opcodes */
+static const metrics_name_t metrics_names[] = {
+	{ 0x7F, "init" },
+	{ 0x00, "get" },
+	{ 0x01, "get_version" },
+	{ 0x02, "get_id" },
+	{ 0x11, "read" },
+	{ 0x21, "go" },
+	{ 0x31, "write" },
+	{ 0x44, "extended_erase" },
+	{ 0x63, "write_protect" },
+	{ 0x73, "write_unprotect" },
+	{ 0x82, "readout_protect" },
+	{ 0x92, "readout_unprotect" },
+	{ 0xA1, "get_checksum" },
+	{ 0xFF, "other" }
+};
+
+#define METRICS_NAMES	(sizeof(metrics_names) / sizeof(metrics_names[0]))
+
+/* Prometheus histogram bounds, us */
+static const uint64_t metrics_bounds[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000
+};
+
+static uint32_t metrics_slot(uint8_t opcode){
+
+	uint32_t i = 0;
+
+	for(i = 0; i < METRICS_NAMES - 1; i++)
+		if (metrics_names[i].opcode == opcode)
+			return i;
+
+	return METRICS_NAMES - 1;
+}
+
+static uint32_t histogram_index(uint64_t value){
+
+	if (value < METRICS_SUB)
+		return value;
+
+	uint32_t octave = 63 - __builtin_clzll(value);
+
+	if (octave >= METRICS_OCTAVES)
+		return METRICS_BUCKETS - 1;
+
+	uint32_t shift = octave - METRICS_SUB_BITS;
+
+	return METRICS_SUB + shift * METRICS_SUB + ((value >> shift) & (METRICS_SUB - 1));
+}
+
+/* largest value counted by a bucket */
+static uint64_t histogram_upper(uint32_t index){
+
+	if (index < METRICS_SUB)
+		return index;
+
+	uint32_t shift = (index - METRICS_SUB) / METRICS_SUB;
+	uint64_t sub = (index - METRICS_SUB) % METRICS_SUB;
+
+	return ((METRICS_SUB + sub + 1) << shift) - 1;
+}
+
+void metrics_init(metrics_t *metrics, const char *port){
+
+	memset(metrics, 0, sizeof(metrics_t));
+
+	if (port != NULL)
+		strncpy(metrics->port, port, METRICS_PORT_SIZE - 1);
+}
+
+void metrics_histogram_add(metrics_histogram_t *histogram, uint64_t value_us){
+
+	if (histogram->count == 0 || value_us < histogram->min_us)
+		histogram->min_us = value_us;
+
+	if (value_us > histogram->max_us)
+		histogram->max_us = value_us;
+
+	histogram->count++;
+	histogram->sum_us += value_us;
+	histogram->buckets[histogram_index(value_us)]++;
+}
+
+/* value at or below which the quantile of samples falls, within the bucket resolution */
+uint64_t metrics_histogram_percentile(const metrics_histogram_t *histogram, double quantile){
+
+	if (histogram->count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(quantile * histogram->count + 0.5);
+	uint64_t seen = 0;
+	uint32_t i = 0;
+
+	if (rank < 1)
+		rank = 1;
+
+	for(i = 0; i < METRICS_BUCKETS; i++){
+
+		seen += histogram->buckets[i];
+
+		if (seen >= rank){
+			uint64_t upper = histogram_upper(i);
+			return upper < histogram->max_us ? upper : histogram->max_us;
+		}
+	}
+
+	return histogram->max_us;
+}
+
+double metrics_histogram_mean(const metrics_histogram_t *histogram){
+	return histogram->count ? (double)histogram->sum_us / histogram->count : 0;
+}
+
+static void histogram_merge(metrics_histogram_t *histogram, const metrics_histogram_t *other){
+
+	uint32_t i = 0;
+
+	if (other->count == 0)
+		return;
+
+	if (histogram->count == 0 || other->min_us < histogram->min_us)
+		histogram->min_us = other->min_us;
+
+	if (other->max_us > histogram->max_us)
+		histogram->max_us = other->max_us;
+
+	histogram->count += other->count;
+	histogram->sum_us += other->sum_us;
+
+	for(i = 0; i < METRICS_BUCKETS; i++)
+		histogram->buckets[i] += other->buckets[i];
+}
+
+/* adds another port's numbers, for fleet totals */
+void metrics_merge(metrics_t *metrics, const metrics_t *other){
+
+	uint32_t i = 0;
+
+	for(i = 0; i < METRICS_NAMES; i++){
+
+		metrics_command_t *command = &metrics->commands[i];
+		const metrics_command_t *from = &other->commands[i];
+
+		command->count += from->count;
+		command->ok += from->ok;
+		command->timeouts += from->timeouts;
+		command->errors += from->errors;
+		command->acks += from->acks;
+		command->nacks += from->nacks;
+		command->bytes_tx += from->bytes_tx;
+		command->bytes_rx += from->bytes_rx;
+
+		histogram_merge(&command->latency, &from->latency);
+	}
+}
+
+void metrics_ack(metrics_t *metrics, uint8_t opcode, int ack){
+
+	metrics_command_t *command = &metrics->commands[metrics_slot(opcode)];
+
+	if (ack)
+		command->acks++;
+	else
+		command->nacks++;
+}
+
+void metrics_record(metrics_t *metrics, uint8_t opcode, metrics_outcome_t outcome, uint64_t latency_us, uint64_t bytes_tx, uint64_t bytes_rx){
+
+	metrics_command_t *command = &metrics->commands[metrics_slot(opcode)];
+
+	command->count++;
+	command->bytes_tx += bytes_tx;
+	command->bytes_rx += bytes_rx;
+
+	switch(outcome){
+		case METRICS_OK     : command->ok++;		break;
+		case METRICS_TIMEOUT: command->timeouts++;	break;
+		default:
+			command->errors++;
+			break;
+	}
+
+	metrics_histogram_add(&command->latency, latency_us);
+}
+
+const char *metrics_command_name(uint8_t opcode){
+	return metrics_names[metrics_slot(opcode)].name;
+}
+
+const metrics_command_t *metrics_command(const metrics_t *metrics, uint8_t opcode){
+	return &metrics->commands[metrics_slot(opcode)];
+}
+
+/* port names go into quoted strings, JSON and Prometheus escape the same three characters here */
+static void metrics_quote(FILE *out, const char *text){
+
+	fputc('"', out);
+
+	for(; *text; text++){
+		switch(*text){
+			case '"' : fputs("\\\"", out); break;
+			case '\\': fputs("\\\\", out); break;
+			case '\n': fputs("\\n", out);  break;
+			default:
+				if ((unsigned char)*text >= 0x20)
+					fputc(*text, out);
+				break;
+		}
+	}
+
+	fputc('"', out);
+}
+
+int metrics_json(FILE *out, metrics_t *const *ports, uint32_t ports_count){
+
+	uint32_t p = 0;
+	uint32_t i = 0;
+
+	fputs("{\"ports\": [", out);
+
+	for(p = 0; p < ports_count; p++){
+
+		uint32_t listed = 0;
+
+		fputs(p ? ", {\"port\": " : "{\"port\": ", out);
+		metrics_quote(out, ports[p]->port);
+		fputs(", \"commands\": {", out);
+
+		for(i = 0; i < METRICS_NAMES; i++){
+
+			const metrics_command_t *command = &ports[p]->commands[i];
+			const metrics_histogram_t *latency = &command->latency;
+
+			if (command->count == 0 && command->acks == 0 && command->nacks == 0)
+				continue;
+
+			fprintf(out,
+				"%s\"%s\": {\"count\": %llu, \"ok\": %llu, \"timeouts\": %llu, \"errors\": %llu, "
+				"\"acks\": %llu, \"nacks\": %llu, \"bytes_tx\": %llu, \"bytes_rx\": %llu, "
+				"\"latency_us\": {\"min\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}}",
+				listed++ ? ", " : "", metrics_names[i].name,
+				(unsigned long long)command->count, (unsigned long long)command->ok,
+				(unsigned long long)command->timeouts, (unsigned long long)command->errors,
+				(unsigned long long)command->acks, (unsigned long long)command->nacks,
+				(unsigned long long)command->bytes_tx, (unsigned long long)command->bytes_rx,
+				(unsigned long long)latency->min_us, metrics_histogram_mean(latency),
+				(unsigned long long)metrics_histogram_percentile(latency, 0.50),
+				(unsigned long long)metrics_histogram_percentile(latency, 0.90),
+				(unsigned long long)metrics_histogram_percentile(latency, 0.99),
+				(unsigned long long)latency->max_us);
+		}
+
+		fputs("}}", out);
+	}
+
+	fputs("]}\n", out);
+
+	return ferror(out) ? -1 : 0;
+}
+
+static void prometheus_labels(FILE *out, const metrics_t *metrics, uint32_t slot){
+
+	fputs("{port=", out);
+	metrics_quote(out, metrics->port);
+	fprintf(out, ",command=\"%s\"", metrics_names[slot].name);
+}
+
+typedef struct prometheus_series {
+	const char *value;		/* of the family's extra label, NULL when it has none */
+	size_t offset;			/* of the uint64_t counter in metrics_command_t */
+} prometheus_series_t ;
+
+static void prometheus_family(FILE *out, metrics_t *const *ports, uint32_t ports_count, const char *name, const char *help,
+		const char *label, const prometheus_series_t *series, uint32_t series_count){
+
+	uint32_t p = 0;
+	uint32_t i = 0;
+	uint32_t s = 0;
+
+	fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+
+	for(p = 0; p < ports_count; p++)
+		for(i = 0; i < METRICS_NAMES; i++){
+
+			const metrics_command_t *command = &ports[p]->commands[i];
+
+			if (command->count == 0 && command->acks == 0 && command->nacks == 0)
+				continue;
+
+			for(s = 0; s < series_count; s++){
+
+				fputs(name, out);
+				prometheus_labels(out, ports[p], i);
+
+				if (label != NULL)
+					fprintf(out, ",%s=\"%s\"", label, series[s].value);
+
+				fprintf(out, "} %llu\n", (unsigned long long)*(const uint64_t*)((const uint8_t*)command + series[s].offset));
+			}
+		}
+}
+
+#define SERIES(value, field)	{ value, offsetof(metrics_command_t, field) }
+#define FAMILY(name, help, label, series) \
+	prometheus_family(out, ports, ports_count, name, help, label, series, sizeof(series) / sizeof(series[0]))
+
+int metrics_prometheus(FILE *out, metrics_t *const *ports, uint32_t ports_count){
+
+	static const prometheus_series_t commands[] = { SERIES(NULL, count) };
+	static const prometheus_series_t results[] = { SERIES("ok", ok), SERIES("timeout", timeouts), SERIES("error", errors) };
+	static const prometheus_series_t replies[] = { SERIES("ack", acks), SERIES("nack", nacks) };
+	static const prometheus_series_t bytes[] = { SERIES("tx", bytes_tx), SERIES("rx", bytes_rx) };
+
+	uint32_t p = 0;
+	uint32_t i = 0;
+	uint32_t b = 0;
+
+	FAMILY("stm32_commands_total", "Bootloader commands issued.", NULL, commands);
+	FAMILY("stm32_command_results_total", "Bootloader commands by outcome.", "result", results);
+	FAMILY("stm32_command_replies_total", "Replies to the command byte.", "reply", replies);
+	FAMILY("stm32_bytes_total", "Bytes on the wire.", "direction", bytes);
+
+	fputs("# HELP stm32_command_latency_seconds Bootloader command latency.\n", out);
+	fputs("# TYPE stm32_command_latency_seconds histogram\n", out);
+
+	for(p = 0; p < ports_count; p++)
+		for(i = 0; i < METRICS_NAMES; i++){
+
+			const metrics_histogram_t *latency = &ports[p]->commands[i].latency;
+			uint64_t seen = 0;
+			uint32_t bucket = 0;
+
+			if (latency->count == 0)
+				continue;
+
+			/* HDR buckets folded into the fixed bounds, a bucket counts where its upper edge fits */
+			for(b = 0; b < sizeof(metrics_bounds) / sizeof(metrics_bounds[0]); b++){
+
+				for(; bucket < METRICS_BUCKETS && histogram_upper(bucket) <= metrics_bounds[b]; bucket++)
+					seen += latency->buckets[bucket];
+
+				fputs("stm32_command_latency_seconds_bucket", out);
+				prometheus_labels(out, ports[p], i);
+				fprintf(out, ",le=\"%g\"} %llu\n", metrics_bounds[b] / 1e6, (unsigned long long)seen);
+			}
+
+			fputs("stm32_command_latency_seconds_bucket", out);
+			prometheus_labels(out, ports[p], i);
+			fprintf(out, ",le=\"+Inf\"} %llu\n", (unsigned long long)latency->count);
+
+			fputs("stm32_command_latency_seconds_sum", out);
+			prometheus_labels(out, ports[p], i);
+			fprintf(out, "} %.6f\n", latency->sum_us / 1e6);
+
+			fputs("stm32_command_latency_seconds_count", out);
+			prometheus_labels(out, ports[p], i);
+			fprintf(out, "} %llu\n", (unsigned long long)latency->count);
+		}
+
+	return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,86 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* log-linear latency buckets, 16 per power of two (6.25% resolution) up to 2^40 us */
+#define METRICS_SUB_BITS	4
+#define METRICS_SUB			(1 << METRICS_SUB_BITS)
+#define METRICS_OCTAVES		40
+#define METRICS_BUCKETS		(METRICS_SUB + (METRICS_OCTAVES - METRICS_SUB_BITS) * METRICS_SUB)
+
+#define METRICS_COMMANDS	16
+#define METRICS_PORT_SIZE	64
+
+typedef enum metrics_outcome {
+	METRICS_OK,
+	METRICS_TIMEOUT,
+	METRICS_FAILED
+} metrics_outcome_t ;
+
+typedef struct metrics_histogram {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t min_us;
+	uint64_t max_us;
+	uint32_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t ;
+
+typedef struct metrics_command {
+	uint64_t count;
+	uint64_t ok;
+	uint64_t timeouts;
+	uint64_t errors;
+	uint64_t acks;			/* replies to the command byte */
+	uint64_t nacks;
+	uint64_t bytes_tx;
+	uint64_t bytes_rx;
+	metrics_histogram_t latency;
+} metrics_command_t ;
+
+/* one port, written by the thread driving it */
+typedef struct metrics {
+	char port[METRICS_PORT_SIZE];
+	metrics_command_t commands[METRICS_COMMANDS];
+} metrics_t ;
+
+void metrics_init(metrics_t *metrics, const char *port);
+void metrics_merge(metrics_t *metrics, const metrics_t *other);
+
+void metrics_ack(metrics_t *metrics, uint8_t opcode, int ack);
+void metrics_record(metrics_t *metrics, uint8_t opcode, metrics_outcome_t outcome, uint64_t latency_us, uint64_t bytes_tx, uint64_t bytes_rx);
+
+const char *metrics_command_name(uint8_t opcode);
+const metrics_command_t *metrics_command(const metrics_t *metrics, uint8_t opcode);
+
+void metrics_histogram_add(metrics_histogram_t *histogram, uint64_t value_us);
+uint64_t metrics_histogram_percentile(const metrics_histogram_t *histogram, double quantile);
+double metrics_histogram_mean(const metrics_histogram_t *histogram);
+
+int metrics_json(FILE *out, metrics_t *const *ports, uint32_t ports_count);
+int metrics_prometheus(FILE *out, metrics_t *const *ports, uint32_t ports_count);
+
+#endif /* METRICS_H_ */
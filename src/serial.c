@@ -19,7 +19,6 @@
 
 */
 
-#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -27,18 +26,14 @@
 #include <termios.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <time.h>
 
 #include "serial.h"
-
-void hex_trace(const uint8_t *buffer, int len){
-	int i = 0;
-	for (i = 0; i < len; i++) {
-		if (buffer[i] < 0x10)
-			printf("0");
-		printf("%x ", buffer[i] & (~((~0)<<8)));
-	}
-	printf("\n");
-}
+#include "trace.h"
+#include "capture.h"
 
 int serial_open(const char *device){
 
@@ -66,10 +61,57 @@ serial_errors_t serial_close(int fd){
 	if(fd < 0)
 		return SERIAL_ERR_INVALIG_ARGUMENT;
 
-	close(fd);
+	if (close(fd) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	return SERIAL_ERR_OK;
+}
+
+uint32_t serial_baud_rate(serial_baud_t baud){
+
+	switch(baud) {
+		case SERIAL_BAUD_1200   : return 1200;
+		case SERIAL_BAUD_1800   : return 1800;
+		case SERIAL_BAUD_2400   : return 2400;
+		case SERIAL_BAUD_4800   : return 4800;
+		case SERIAL_BAUD_9600   : return 9600;
+		case SERIAL_BAUD_19200  : return 19200;
+		case SERIAL_BAUD_38400  : return 38400;
+		case SERIAL_BAUD_57600  : return 57600;
+		case SERIAL_BAUD_115200 : return 115200;
+		case SERIAL_BAUD_230400 : return 230400;
+		case SERIAL_BAUD_460800 : return 460800;
+		case SERIAL_BAUD_500000 : return 500000;
+		case SERIAL_BAUD_576000 : return 576000;
+		case SERIAL_BAUD_921600 : return 921600;
+		case SERIAL_BAUD_1000000: return 1000000;
+		case SERIAL_BAUD_1152000: return 1152000;
+		case SERIAL_BAUD_1500000: return 1500000;
+		case SERIAL_BAUD_2000000: return 2000000;
+		case SERIAL_BAUD_2500000: return 2500000;
+		case SERIAL_BAUD_3000000: return 3000000;
+		case SERIAL_BAUD_3500000: return 3500000;
+		case SERIAL_BAUD_4000000: return 4000000;
+		default:
+			return 0;
+	}
+}
+
+static uint64_t serial_now_ms(void){
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
 serial_errors_t serial_read(int fd, const void *buffer, int len){
+	return serial_read_timeout(fd, buffer, len, SERIAL_TIMEOUT_DEFAULT);
+}
+
+/* reads exactly len bytes or gives up once timeout_ms have passed since the call */
+serial_errors_t serial_read_timeout(int fd, const void *buffer, int len, uint32_t timeout_ms){
 
 	int plen = len;
 
@@ -77,21 +119,53 @@ serial_errors_t serial_read(int fd, const void *buffer, int len){
 		return SERIAL_ERR_INVALIG_ARGUMENT;
 
 	uint8_t *bufptr = (uint8_t*)buffer;
-	int r = 0;
+	uint64_t deadline = serial_now_ms() + timeout_ms;
+	serial_errors_t result = SERIAL_ERR_OK;
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
 
 	while(len > 0){
+
+		uint64_t now = serial_now_ms();
+
+		if (now >= deadline){
+			result = SERIAL_ERR_TIMEOUT;
+			break;
+		}
+
+		int r = poll(&pfd, 1, (int)(deadline - now));
+
+		if (r < 0 && errno != EINTR){
+			result = SERIAL_ERR_SYSTEM;
+			break;
+		}
+
+		if (r < 1)
+			continue;
+
 		r = read(fd, bufptr, len);
+
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		/* readable with nothing to read is a hangup */
 		if (r < 1){
-			return SERIAL_ERR_SYSTEM;
+			result = SERIAL_ERR_SYSTEM;
+			break;
 		}
+
 		len -= r;
 		bufptr += r;
 	}
 
-	printf("[%d] << ", plen);
-	hex_trace(buffer, plen);
+	if (plen > len){
+		TRACE_HEX(TRACE_DATA, "<<", buffer, plen - len);
+		CAPTURE_RECORD(fd, CAPTURE_RX, buffer, plen - len);
+	}
 
-	return SERIAL_ERR_OK;
+	return result;
 }
 
 serial_errors_t serial_write(int fd, const void *buffer, int len){
@@ -112,8 +186,8 @@ serial_errors_t serial_write(int fd, const void *buffer, int len){
 		bufptr += r;
 	}
 
-	printf("\n[%d] >> ", plen);
-	hex_trace(buffer, plen);
+	TRACE_HEX(TRACE_DATA, ">>", buffer, plen);
+	CAPTURE_RECORD(fd, CAPTURE_TX, buffer, plen);
 
 	return SERIAL_ERR_OK;
 }
@@ -130,18 +204,67 @@ serial_errors_t serial_setup(int fd, serial_baud_t baud, serial_bits_t bits, ser
 
 	tcflag_t	i_port_parity;
 
-	switch(baud) {
-		case SERIAL_BAUD_1200  : c_port_baud = B1200  ; break;
-		case SERIAL_BAUD_1800  : c_port_baud = B1800  ; break;
-		case SERIAL_BAUD_2400  : c_port_baud = B2400  ; break;
-		case SERIAL_BAUD_4800  : c_port_baud = B4800  ; break;
-		case SERIAL_BAUD_9600  : c_port_baud = B9600  ; break;
-		case SERIAL_BAUD_19200 : c_port_baud = B19200 ; break;
-		case SERIAL_BAUD_38400 : c_port_baud = B38400 ; break;
-		case SERIAL_BAUD_57600 : c_port_baud = B57600 ; break;
-		case SERIAL_BAUD_115200: c_port_baud = B115200; break;
+	int custom_rate = 0;
+
+	uint32_t rate = serial_baud_rate(baud);
+
+	if (rate == 0)
+		return SERIAL_ERR_INVALIG_ARGUMENT;
+
+	/* rates without a Bxxx constant are set through serial_set_rate() */
+	switch(rate) {
+		case 1200   : c_port_baud = B1200   ; break;
+		case 1800   : c_port_baud = B1800   ; break;
+		case 2400   : c_port_baud = B2400   ; break;
+		case 4800   : c_port_baud = B4800   ; break;
+		case 9600   : c_port_baud = B9600   ; break;
+		case 19200  : c_port_baud = B19200  ; break;
+		case 38400  : c_port_baud = B38400  ; break;
+		case 57600  : c_port_baud = B57600  ; break;
+		case 115200 : c_port_baud = B115200 ; break;
+#ifdef B230400
+		case 230400 : c_port_baud = B230400 ; break;
+#endif
+#ifdef B460800
+		case 460800 : c_port_baud = B460800 ; break;
+#endif
+#ifdef B500000
+		case 500000 : c_port_baud = B500000 ; break;
+#endif
+#ifdef B576000
+		case 576000 : c_port_baud = B576000 ; break;
+#endif
+#ifdef B921600
+		case 921600 : c_port_baud = B921600 ; break;
+#endif
+#ifdef B1000000
+		case 1000000: c_port_baud = B1000000; break;
+#endif
+#ifdef B1152000
+		case 1152000: c_port_baud = B1152000; break;
+#endif
+#ifdef B1500000
+		case 1500000: c_port_baud = B1500000; break;
+#endif
+#ifdef B2000000
+		case 2000000: c_port_baud = B2000000; break;
+#endif
+#ifdef B2500000
+		case 2500000: c_port_baud = B2500000; break;
+#endif
+#ifdef B3000000
+		case 3000000: c_port_baud = B3000000; break;
+#endif
+#ifdef B3500000
+		case 3500000: c_port_baud = B3500000; break;
+#endif
+#ifdef B4000000
+		case 4000000: c_port_baud = B4000000; break;
+#endif
 		default:
-			return SERIAL_ERR_INVALIG_ARGUMENT;
+			c_port_baud = B115200;
+			custom_rate = 1;
+			break;
 	}
 
 	switch(bits) {
@@ -218,7 +341,7 @@ serial_errors_t serial_setup(int fd, serial_baud_t baud, serial_bits_t bits, ser
 	///////////////////////////////////
 
 	// Choosing raw input.
-	settings.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+	settings.c_lflag &= ~(ICANON | ECHO | ECHOE | ECHONL | ISIG | IEXTEN);
 
 	///////////////////////////////////
 	// Input options
@@ -231,6 +354,9 @@ serial_errors_t serial_setup(int fd, serial_baud_t baud, serial_bits_t bits, ser
 	// Disable software flow control.
 	settings.c_iflag &= ~(IXON | IXOFF | IXANY);
 
+	// Pass CR, NL and breaks through untranslated.
+	settings.c_iflag &= ~(ICRNL | INLCR | IGNCR | IGNBRK | BRKINT);
+
 	///////////////////////////////////
 	// Output options
 	///////////////////////////////////
@@ -242,12 +368,16 @@ serial_errors_t serial_setup(int fd, serial_baud_t baud, serial_bits_t bits, ser
 	// Control characters
 	///////////////////////////////////
 
+	// Reads never block in the driver, deadlines are kept by serial_read_timeout().
 	settings.c_cc[VMIN ] = 0;
-	settings.c_cc[VTIME] = 30;
+	settings.c_cc[VTIME] = 0;
 
 	if (tcsetattr(fd, TCSANOW, &settings) != 0)
 		return SERIAL_ERR_SYSTEM;
 
+	if (custom_rate)
+		return serial_set_rate(fd, rate);
+
 	return SERIAL_ERR_OK;
 }
 
@@ -280,3 +410,418 @@ serial_errors_t serial_signal(int fd, serial_signals_t signal, int value){
 	return SERIAL_ERR_OK;
 }
 
+
+serial_errors_t serial_nonblock(int fd, int enable){
+
+	if(fd < 0)
+		return SERIAL_ERR_INVALIG_ARGUMENT;
+
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return SERIAL_ERR_SYSTEM;
+
+	flags = enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+
+	if (fcntl(fd, F_SETFL, flags) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	return SERIAL_ERR_OK;
+}
+
+/* single non-blocking read, returns bytes read, 0 when nothing is pending, -1 on error or hangup */
+int serial_read_some(int fd, void *buffer, int len){
+
+	if(fd < 0 || len < 0)
+		return -1;
+
+	int r = read(fd, buffer, len);
+
+	if (r < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+	/* VMIN 0 reads return 0 when nothing is pending, only a hangup says more */
+	if (r == 0){
+
+		struct pollfd pfd;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (len > 0 && poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+			return -1;
+
+		return 0;
+	}
+
+	TRACE_HEX(TRACE_DATA, "<<", buffer, r);
+	CAPTURE_RECORD(fd, CAPTURE_RX, buffer, r);
+
+	return r;
+}
+
+/* single non-blocking write, returns bytes written, 0 when the port is full, -1 on error */
+int serial_write_some(int fd, const void *buffer, int len){
+
+	if(fd < 0 || len < 0)
+		return -1;
+
+	int r = write(fd, buffer, len);
+
+	if (r < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+	TRACE_HEX(TRACE_DATA, ">>", buffer, r);
+	CAPTURE_RECORD(fd, CAPTURE_TX, buffer, r);
+
+	return r;
+}
+
+void serial_io_init(serial_io_t *io, int fd){
+
+	io->fd = fd;
+	io->head = 0;
+	io->tail = 0;
+	io->gather_count = 0;
+	io->staged = 0;
+	io->byte_us = SERIAL_IO_BYTE_US;
+}
+
+/* bytes read ahead and not handed out yet */
+uint32_t serial_io_pending(const serial_io_t *io){
+	return io->tail - io->head;
+}
+
+/* bytes gathered and not sent yet */
+uint32_t serial_io_gathered(const serial_io_t *io){
+
+	uint32_t bytes = 0;
+	int i = 0;
+
+	for(i = 0; i < io->gather_count; i++)
+		bytes += io->gather[i].iov_len;
+
+	return bytes;
+}
+
+/* reads exactly len bytes like serial_read_timeout(), after sending what was gathered */
+serial_errors_t serial_io_read_timeout(serial_io_t *io, void *buffer, int len, uint32_t timeout_ms){
+
+	int plen = len;
+
+	if(io->fd < 0 || len < 0)
+		return SERIAL_ERR_INVALIG_ARGUMENT;
+
+	serial_errors_t flushed = serial_io_flush(io);
+
+	if (flushed != SERIAL_ERR_OK)
+		return flushed;
+
+	uint8_t *bufptr = (uint8_t*)buffer;
+	uint64_t deadline = serial_now_ms() + timeout_ms;
+	serial_errors_t result = SERIAL_ERR_OK;
+	struct pollfd pfd;
+
+	pfd.fd = io->fd;
+	pfd.events = POLLIN;
+
+	while(len > 0){
+
+		uint32_t pending = io->tail - io->head;
+
+		if (pending > 0){
+
+			uint32_t n = pending < (uint32_t)len ? pending : (uint32_t)len;
+
+			memcpy(bufptr, io->ahead + io->head, n);
+
+			io->head += n;
+			bufptr += n;
+			len -= n;
+			continue;
+		}
+
+		uint64_t now = serial_now_ms();
+
+		if (now >= deadline){
+			result = SERIAL_ERR_TIMEOUT;
+			break;
+		}
+
+		int r = poll(&pfd, 1, (int)(deadline - now));
+
+		if (r < 0 && errno != EINTR){
+			result = SERIAL_ERR_SYSTEM;
+			break;
+		}
+
+		if (r < 1)
+			continue;
+
+		/* the read-ahead is empty, large reads go straight to the caller */
+		io->head = 0;
+		io->tail = 0;
+
+		if (len >= SERIAL_IO_AHEAD)
+			r = read(io->fd, bufptr, len);
+		else
+			r = read(io->fd, io->ahead, SERIAL_IO_AHEAD);
+
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		/* readable with nothing to read is a hangup */
+		if (r < 1){
+			result = SERIAL_ERR_SYSTEM;
+			break;
+		}
+
+		if (len >= SERIAL_IO_AHEAD){
+			len -= r;
+			bufptr += r;
+		} else {
+			io->tail = r;
+		}
+	}
+
+	if (plen > len){
+		TRACE_HEX(TRACE_DATA, "<<", buffer, plen - len);
+		CAPTURE_RECORD(io->fd, CAPTURE_RX, buffer, plen - len);
+	}
+
+	return result;
+}
+
+/* queues a piece of the frame being built, a full gather is sent first */
+serial_errors_t serial_io_write(serial_io_t *io, const void *buffer, int len){
+
+	if(io->fd < 0 || len < 0)
+		return SERIAL_ERR_INVALIG_ARGUMENT;
+
+	if (len == 0)
+		return SERIAL_ERR_OK;
+
+	int copy = len <= SERIAL_IO_COPY;
+
+	if (io->gather_count == SERIAL_IO_GATHER || (copy && io->staged + len > SERIAL_IO_STAGE)){
+
+		serial_errors_t result = serial_io_flush(io);
+
+		if (result != SERIAL_ERR_OK)
+			return result;
+	}
+
+	struct iovec *piece = &io->gather[io->gather_count++];
+
+	piece->iov_base = (void *)buffer;
+	piece->iov_len = len;
+
+	if (copy){
+		memcpy(io->stage + io->staged, buffer, len);
+		piece->iov_base = io->stage + io->staged;
+		io->staged += len;
+	}
+
+	return SERIAL_ERR_OK;
+}
+
+/* writes the pieces out on a non-blocking port, waiting for room until the deadline, sent counts what went out */
+static serial_errors_t serial_io_send(serial_io_t *io, struct iovec *iov, int count, uint64_t deadline, uint64_t *sent){
+
+	int first = 0;
+
+	*sent = 0;
+
+	while(first < count){
+
+		ssize_t r = writev(io->fd, iov + first, count - first);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r < 0 && errno == EAGAIN){
+
+			struct pollfd pfd;
+			uint64_t now = serial_now_ms();
+
+			if (now >= deadline)
+				return SERIAL_ERR_TIMEOUT;
+
+			pfd.fd = io->fd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+
+			int p = poll(&pfd, 1, (int)(deadline - now));
+
+			if (p < 0 && errno != EINTR)
+				return SERIAL_ERR_SYSTEM;
+
+			if (p > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+				return SERIAL_ERR_SYSTEM;
+
+			continue;
+		}
+
+		if (r < 0)
+			return SERIAL_ERR_SYSTEM;
+
+		*sent += r;
+
+		while(first < count && (size_t)r >= iov[first].iov_len)
+			r -= iov[first++].iov_len;
+
+		if (first < count){
+			iov[first].iov_base = (uint8_t *)iov[first].iov_base + r;
+			iov[first].iov_len -= r;
+		}
+	}
+
+	return SERIAL_ERR_OK;
+}
+
+/*
+ * sends the gathered pieces with as few writev() calls as the port allows, a port
+ * that stays full longer than the transfer time of the pieces times out. serial_open()
+ * leaves the port blocking, a blocking writev() would never see the deadline, so the
+ * port is non-blocking for the duration of the flush
+ */
+serial_errors_t serial_io_flush(serial_io_t *io){
+
+	struct iovec iov[SERIAL_IO_GATHER];
+	int count = io->gather_count;
+	uint64_t bytes = serial_io_gathered(io);
+	int i = 0;
+
+	if (count == 0)
+		return SERIAL_ERR_OK;
+
+	int flags = fcntl(io->fd, F_GETFL);
+
+	if (flags < 0)
+		return SERIAL_ERR_SYSTEM;
+
+	if (!(flags & O_NONBLOCK) && fcntl(io->fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	/* partial writes advance a copy, the pieces stay intact for tracing */
+	memcpy(iov, io->gather, count * sizeof(struct iovec));
+
+	uint64_t deadline = serial_now_ms() + (bytes * io->byte_us + 999) / 1000 + SERIAL_IO_SLACK_MS;
+
+	io->gather_count = 0;
+	io->staged = 0;
+
+	uint64_t sent = 0;
+	serial_errors_t result = serial_io_send(io, iov, count, deadline, &sent);
+
+	if (!(flags & O_NONBLOCK) && fcntl(io->fd, F_SETFL, flags) != 0 && result == SERIAL_ERR_OK)
+		result = SERIAL_ERR_SYSTEM;
+
+	/* a failed flush still shows what reached the wire, the post-mortem needs it most */
+	for(i = 0; i < count && sent > 0; i++){
+
+		size_t len = io->gather[i].iov_len < sent ? io->gather[i].iov_len : (size_t)sent;
+
+		TRACE_HEX(TRACE_DATA, ">>", io->gather[i].iov_base, len);
+		CAPTURE_RECORD(io->fd, CAPTURE_TX, io->gather[i].iov_base, len);
+
+		sent -= len;
+	}
+
+	return result;
+}
+
+/* drops what was read ahead or gathered along with the port queues */
+serial_errors_t serial_io_discard(serial_io_t *io){
+
+	io->head = 0;
+	io->tail = 0;
+	io->gather_count = 0;
+	io->staged = 0;
+
+	return serial_flush(io->fd);
+}
+
+static uint32_t poll_events(int events){
+
+	uint32_t result = 0;
+
+	if (events & SERIAL_POLL_READ)
+		result |= EPOLLIN;
+
+	if (events & SERIAL_POLL_WRITE)
+		result |= EPOLLOUT;
+
+	return result;
+}
+
+static serial_errors_t poll_ctl(int poll_fd, int op, int fd, int events, void *data){
+
+	struct epoll_event event;
+
+	if(poll_fd < 0 || fd < 0)
+		return SERIAL_ERR_INVALIG_ARGUMENT;
+
+	memset(&event, 0, sizeof(event));
+	event.events = poll_events(events);
+	event.data.ptr = data;
+
+	if (epoll_ctl(poll_fd, op, fd, &event) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	return SERIAL_ERR_OK;
+}
+
+int serial_poll_open(void){
+	return epoll_create1(EPOLL_CLOEXEC);
+}
+
+serial_errors_t serial_poll_add(int poll_fd, int fd, int events, void *data){
+	return poll_ctl(poll_fd, EPOLL_CTL_ADD, fd, events, data);
+}
+
+serial_errors_t serial_poll_modify(int poll_fd, int fd, int events, void *data){
+	return poll_ctl(poll_fd, EPOLL_CTL_MOD, fd, events, data);
+}
+
+serial_errors_t serial_poll_remove(int poll_fd, int fd){
+	return poll_ctl(poll_fd, EPOLL_CTL_DEL, fd, 0, NULL);
+}
+
+/* waits for readiness, returns the number of events, 0 on timeout, -1 on error */
+int serial_poll_wait(int poll_fd, serial_event_t *events, int events_size, int timeout_ms){
+
+	struct epoll_event ready[64];
+
+	if(poll_fd < 0 || events == NULL || events_size < 1)
+		return -1;
+
+	if (events_size > 64)
+		events_size = 64;
+
+	int count = 0;
+
+	do {
+		count = epoll_wait(poll_fd, ready, events_size, timeout_ms);
+	} while(count < 0 && errno == EINTR);
+
+	if (count < 0)
+		return -1;
+
+	int i = 0;
+
+	for(i = 0; i < count; i++){
+
+		events[i].data = ready[i].data.ptr;
+		events[i].events = 0;
+
+		if (ready[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			events[i].events |= SERIAL_POLL_READ;
+
+		if (ready[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			events[i].events |= SERIAL_POLL_WRITE;
+	}
+
+	return count;
+}
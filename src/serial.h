@@ -23,6 +23,9 @@
 #ifndef SERIAL_H_
 #define SERIAL_H_
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 typedef enum serial_baud {
 	SERIAL_BAUD_1200,
 	SERIAL_BAUD_1800,
@@ -32,7 +35,20 @@ typedef enum serial_baud {
 	SERIAL_BAUD_19200,
 	SERIAL_BAUD_38400,
 	SERIAL_BAUD_57600,
-	SERIAL_BAUD_115200
+	SERIAL_BAUD_115200,
+	SERIAL_BAUD_230400,
+	SERIAL_BAUD_460800,
+	SERIAL_BAUD_500000,
+	SERIAL_BAUD_576000,
+	SERIAL_BAUD_921600,
+	SERIAL_BAUD_1000000,
+	SERIAL_BAUD_1152000,
+	SERIAL_BAUD_1500000,
+	SERIAL_BAUD_2000000,
+	SERIAL_BAUD_2500000,
+	SERIAL_BAUD_3000000,
+	SERIAL_BAUD_3500000,
+	SERIAL_BAUD_4000000
 } serial_baud_t ;
 
 typedef enum serial_bits {
@@ -61,16 +77,73 @@ typedef enum serial_signals {
 typedef enum serial_errors {
 	SERIAL_ERR_OK,
 	SERIAL_ERR_INVALIG_ARGUMENT,
-	SERIAL_ERR_SYSTEM
+	SERIAL_ERR_SYSTEM,
+	SERIAL_ERR_TIMEOUT
 } serial_errors_t ;
 
+#define SERIAL_TIMEOUT_DEFAULT	3000	/* ms, serial_read() deadline */
+
+/* readiness bits for the serial_poll_*() driver */
+#define SERIAL_POLL_READ	0x01
+#define SERIAL_POLL_WRITE	0x02
+
+typedef struct serial_event {
+	void *data;		/* as registered with serial_poll_add() */
+	int events;		/* SERIAL_POLL_* bits, errors and hangups report both */
+} serial_event_t ;
+
+#define SERIAL_IO_AHEAD		0x400	/* read-ahead */
+#define SERIAL_IO_GATHER	16		/* pieces one flush can carry */
+#define SERIAL_IO_STAGE		0x40	/* pieces up to SERIAL_IO_COPY bytes are copied here */
+#define SERIAL_IO_COPY		0x10
+#define SERIAL_IO_BYTE_US	2292	/* 9600 baud 8E1 with 2x slack until the owner sets the rate */
+#define SERIAL_IO_SLACK_MS	100		/* added to the transfer time of a flush */
+
+/*
+ * buffered port, reads drain everything pending into the read-ahead, writes are
+ * gathered and go out in one writev() before the next read or on a flush,
+ * larger pieces are referenced and must stay untouched until then
+ */
+typedef struct serial_io {
+	int fd;
+	uint32_t head;			/* next byte to hand out */
+	uint32_t tail;			/* end of the bytes read ahead */
+	uint8_t ahead[SERIAL_IO_AHEAD];
+	struct iovec gather[SERIAL_IO_GATHER];
+	int gather_count;
+	uint32_t staged;
+	uint8_t stage[SERIAL_IO_STAGE];
+	uint32_t byte_us;		/* time on the wire per byte, bounds each flush */
+} serial_io_t ;
 
 int serial_open(const char *device);
 serial_errors_t serial_flush(int fd);
 serial_errors_t serial_close(int fd);
 serial_errors_t serial_setup(int fd, serial_baud_t baud, serial_bits_t bits, serial_parity_t parity, serial_stop_bits_t stop_bits);
+serial_errors_t serial_set_rate(int fd, uint32_t rate);
+uint32_t serial_get_rate(int fd);
+uint32_t serial_baud_rate(serial_baud_t baud);
 serial_errors_t serial_read(int fd, const void *buffer, int len);
+serial_errors_t serial_read_timeout(int fd, const void *buffer, int len, uint32_t timeout_ms);
 serial_errors_t serial_write(int fd, const void *buffer, int len);
 serial_errors_t serial_signal(int fd, serial_signals_t signal, int status);
 
+serial_errors_t serial_nonblock(int fd, int enable);
+int serial_read_some(int fd, void *buffer, int len);
+int serial_write_some(int fd, const void *buffer, int len);
+
+void serial_io_init(serial_io_t *io, int fd);
+serial_errors_t serial_io_read_timeout(serial_io_t *io, void *buffer, int len, uint32_t timeout_ms);
+serial_errors_t serial_io_write(serial_io_t *io, const void *buffer, int len);
+serial_errors_t serial_io_flush(serial_io_t *io);
+serial_errors_t serial_io_discard(serial_io_t *io);
+uint32_t serial_io_pending(const serial_io_t *io);
+uint32_t serial_io_gathered(const serial_io_t *io);
+
+int serial_poll_open(void);
+serial_errors_t serial_poll_add(int poll_fd, int fd, int events, void *data);
+serial_errors_t serial_poll_modify(int poll_fd, int fd, int events, void *data);
+serial_errors_t serial_poll_remove(int poll_fd, int fd);
+int serial_poll_wait(int poll_fd, serial_event_t *events, int events_size, int timeout_ms);
+
 #endif /* SERIAL_H_ */
@@ -0,0 +1,103 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+/*
+   Arbitrary baud rates. Lives apart from serial.c because the kernel
+   termios2 definitions clash with the libc <termios.h> ones.
+*/
+
+#include <stdint.h>
+#include "serial.h"
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+serial_errors_t serial_set_rate(int fd, uint32_t rate){
+
+	struct termios2 settings;
+
+	if(fd < 0 || rate == 0)
+		return SERIAL_ERR_INVALIG_ARGUMENT;
+
+	if (ioctl(fd, TCGETS2, &settings) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	/* BOTHER takes the rate verbatim from c_ispeed/c_ospeed */
+	settings.c_cflag &= ~CBAUD;
+	settings.c_cflag |= BOTHER;
+	settings.c_ispeed = rate;
+	settings.c_ospeed = rate;
+
+	if (ioctl(fd, TCSETS2, &settings) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	return SERIAL_ERR_OK;
+}
+
+/* the output rate the port runs at, 0 when it cannot be read */
+uint32_t serial_get_rate(int fd){
+
+	struct termios2 settings;
+
+	if(fd < 0 || ioctl(fd, TCGETS2, &settings) != 0)
+		return 0;
+
+	return settings.c_ospeed;
+}
+
+#else
+
+#include <termios.h>
+
+serial_errors_t serial_set_rate(int fd, uint32_t rate){
+
+	struct termios settings;
+
+	if(fd < 0 || rate == 0)
+		return SERIAL_ERR_INVALIG_ARGUMENT;
+
+	if (tcgetattr(fd, &settings) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	/* BSD style systems take the numeric rate as speed_t */
+	if (cfsetispeed(&settings, rate) != 0 || cfsetospeed(&settings, rate) != 0)
+		return SERIAL_ERR_INVALIG_ARGUMENT;
+
+	if (tcsetattr(fd, TCSANOW, &settings) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	return SERIAL_ERR_OK;
+}
+
+uint32_t serial_get_rate(int fd){
+
+	struct termios settings;
+
+	if(fd < 0 || tcgetattr(fd, &settings) != 0)
+		return 0;
+
+	return cfgetospeed(&settings);
+}
+
+#endif
@@ -0,0 +1,150 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_transform(sha256_t *sha, const uint8_t *block){
+
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	int i = 0;
+
+	for(i = 0; i < 16; i++)
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+			(uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+
+	for(i = 16; i < 64; i++){
+		uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = sha->state[0]; b = sha->state[1]; c = sha->state[2]; d = sha->state[3];
+	e = sha->state[4]; f = sha->state[5]; g = sha->state[6]; h = sha->state[7];
+
+	for(i = 0; i < 64; i++){
+		uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	sha->state[0] += a; sha->state[1] += b; sha->state[2] += c; sha->state[3] += d;
+	sha->state[4] += e; sha->state[5] += f; sha->state[6] += g; sha->state[7] += h;
+}
+
+void sha256_init(sha256_t *sha){
+
+	sha->state[0] = 0x6a09e667;
+	sha->state[1] = 0xbb67ae85;
+	sha->state[2] = 0x3c6ef372;
+	sha->state[3] = 0xa54ff53a;
+	sha->state[4] = 0x510e527f;
+	sha->state[5] = 0x9b05688c;
+	sha->state[6] = 0x1f83d9ab;
+	sha->state[7] = 0x5be0cd19;
+
+	sha->length = 0;
+	sha->block_size = 0;
+}
+
+void sha256_update(sha256_t *sha, const void *data, size_t size){
+
+	const uint8_t *bytes = data;
+
+	sha->length += size;
+
+	/* complete a pending partial block first */
+	if (sha->block_size > 0){
+
+		size_t n = SHA256_BLOCK_SIZE - sha->block_size;
+
+		if (n > size)
+			n = size;
+
+		memcpy(sha->block + sha->block_size, bytes, n);
+		sha->block_size += n;
+		bytes += n;
+		size -= n;
+
+		if (sha->block_size < SHA256_BLOCK_SIZE)
+			return;
+
+		sha256_transform(sha, sha->block);
+		sha->block_size = 0;
+	}
+
+	/* hash whole blocks straight from the caller buffer */
+	while(size >= SHA256_BLOCK_SIZE){
+		sha256_transform(sha, bytes);
+		bytes += SHA256_BLOCK_SIZE;
+		size -= SHA256_BLOCK_SIZE;
+	}
+
+	memcpy(sha->block, bytes, size);
+	sha->block_size = size;
+}
+
+void sha256_final(sha256_t *sha, uint8_t *digest){
+
+	uint64_t bits = sha->length * 8;
+	int i = 0;
+
+	sha->block[sha->block_size++] = 0x80;
+
+	if (sha->block_size > SHA256_BLOCK_SIZE - 8){
+		memset(sha->block + sha->block_size, 0, SHA256_BLOCK_SIZE - sha->block_size);
+		sha256_transform(sha, sha->block);
+		sha->block_size = 0;
+	}
+
+	memset(sha->block + sha->block_size, 0, SHA256_BLOCK_SIZE - 8 - sha->block_size);
+
+	for(i = 0; i < 8; i++)
+		sha->block[SHA256_BLOCK_SIZE - 1 - i] = (bits >> (i * 8)) & 0xFF;
+
+	sha256_transform(sha, sha->block);
+
+	for(i = 0; i < 8; i++){
+		digest[i * 4 + 0] = (sha->state[i] >> 24) & 0xFF;
+		digest[i * 4 + 1] = (sha->state[i] >> 16) & 0xFF;
+		digest[i * 4 + 2] = (sha->state[i] >> 8) & 0xFF;
+		digest[i * 4 + 3] = (sha->state[i] >> 0) & 0xFF;
+	}
+}
@@ -0,0 +1,907 @@
+#define _GNU_SOURCE	/* posix_openpt(), ptsname_r() */
+
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include "sim.h"
+#include "serial.h"
+#include "stm32_cache.h"
+#include "stm32_helper.h"
+#include "crc32.h"
+#include "lz4.h"
+
+#define SIM_ACK					(uint8_t)0x79
+#define SIM_NACK				(uint8_t)0x1F
+
+#define SIM_INIT				(uint8_t)0x7F
+#define SIM_GET					(uint8_t)0x00
+#define SIM_GET_RPS				(uint8_t)0x01
+#define SIM_GET_ID				(uint8_t)0x02
+#define SIM_READ				(uint8_t)0x11
+#define SIM_GO					(uint8_t)0x21
+#define SIM_WRITE				(uint8_t)0x31
+#define SIM_EXTENDED_ERASE		(uint8_t)0x44
+#define SIM_WRITE_PROTECT		(uint8_t)0x63
+#define SIM_WRITE_UNPROTECT		(uint8_t)0x73
+#define SIM_READOUT_PROTECT		(uint8_t)0x82
+#define SIM_READOUT_UNPROTECT	(uint8_t)0x92
+#define SIM_GET_CHECKSUM		(uint8_t)0xA1
+
+#define SIM_STOP				-1	/* sim_close() was called */
+#define SIM_STALL_POLL_MS		10	/* how often a stalled simulator looks for sim_stall() to end */
+
+static const uint8_t sim_commands[] = {
+	SIM_GET, SIM_GET_RPS, SIM_GET_ID, SIM_READ, SIM_GO, SIM_WRITE, SIM_EXTENDED_ERASE,
+	SIM_WRITE_PROTECT, SIM_WRITE_UNPROTECT, SIM_READOUT_PROTECT, SIM_READOUT_UNPROTECT
+};
+
+static uint64_t sim_now_ns(void){
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void sim_sleep_until(uint64_t deadline_ns){
+
+	struct timespec ts;
+
+	ts.tv_sec = deadline_ns / 1000000000ULL;
+	ts.tv_nsec = deadline_ns % 1000000000ULL;
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void sim_delay_us(uint64_t us){
+
+	if (us > 0)
+		sim_sleep_until(sim_now_ns() + us * 1000);
+}
+
+/* the wire carries one byte at a time at the configured rate in either direction */
+static void sim_pace(sim_t *sim, uint32_t len){
+
+	uint32_t rate = sim->config.rate ? sim->config.rate : sim->locked_rate;
+
+	if (rate == 0)
+		return;
+
+	uint64_t now = sim_now_ns();
+
+	if (sim->wire_ns < now)
+		sim->wire_ns = now;
+
+	sim->wire_ns += (uint64_t)len * 11 * 1000000000ULL / rate;
+
+	sim_sleep_until(sim->wire_ns);
+}
+
+/* exactly len bytes from the host, SIM_STOP once the simulator is closing */
+static int sim_recv(sim_t *sim, uint8_t *buffer, uint32_t len){
+
+	struct pollfd pfd[2];
+
+	pfd[0].fd = sim->master;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = sim->wakeup[0];
+	pfd[1].events = POLLIN;
+
+	while(len > 0){
+
+		if (atomic_load(&sim->stop))
+			return SIM_STOP;
+
+		/* a stalled target leaves the host bytes queued until the port fills up */
+		if (atomic_load(&sim->stalled)){
+
+			if (poll(pfd + 1, 1, SIM_STALL_POLL_MS) > 0)
+				return SIM_STOP;
+
+			continue;
+		}
+
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+			return SIM_STOP;
+
+		if (pfd[1].revents)
+			return SIM_STOP;
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		int r = read(sim->master, buffer, len);
+
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		if (r < 1)
+			return SIM_STOP;
+
+		sim_pace(sim, r);
+
+		sim->stats.bytes_rx += r;
+		buffer += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int sim_send(sim_t *sim, const uint8_t *buffer, uint32_t len){
+
+	sim_pace(sim, len);
+
+	while(len > 0){
+
+		int r = write(sim->master, buffer, len);
+
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		if (r < 1)
+			return SIM_STOP;
+
+		sim->stats.bytes_tx += r;
+		buffer += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int sim_reply(sim_t *sim, uint8_t reply){
+
+	if (reply == SIM_NACK)
+		sim->stats.nacks++;
+
+	return sim_send(sim, &reply, 1);
+}
+
+static uint8_t sim_xor(const uint8_t *buffer, uint32_t len){
+
+	uint8_t check_summ = 0;
+
+	while(len--)
+		check_summ ^= *buffer++;
+
+	return check_summ;
+}
+
+/* host memory behind a target range, NULL when it is not mapped */
+static uint8_t *sim_memory(sim_t *sim, uint32_t address, uint32_t size){
+
+	uint64_t end = (uint64_t)address + size;
+
+	if (address >= sim->flash_base && end <= (uint64_t)sim->flash_base + sim->flash_size)
+		return sim->flash + (address - sim->flash_base);
+
+	if (address >= SIM_RAM_BASE && end <= (uint64_t)SIM_RAM_BASE + sim->config.ram_size)
+		return sim->ram + (address - SIM_RAM_BASE);
+
+	if (address >= sim->config.uid_address && end <= (uint64_t)sim->config.uid_address + SIM_UID_SIZE)
+		return sim->config.uid + (address - sim->config.uid_address);
+
+	return NULL;
+}
+
+static int sim_in_flash(const sim_t *sim, const uint8_t *memory){
+	return memory >= sim->flash && memory < sim->flash + sim->flash_size;
+}
+
+static int sim_protected(const sim_t *sim, uint32_t address, uint32_t size){
+
+	uint32_t end = address + size;
+
+	while(address < end){
+
+		uint16_t page;
+		uint32_t page_address;
+		uint32_t page_size;
+
+		if (geometry_find(sim->config.geometry, address, &page) != 0)
+			return 0;
+
+		if (page < 0x100 && (sim->wrp[page / 8] & (1 << (page % 8))))
+			return 1;
+
+		geometry_page(sim->config.geometry, page, &page_address, &page_size);
+		address = page_address + page_size;
+	}
+
+	return 0;
+}
+
+static void sim_erase_range(sim_t *sim, uint32_t address, uint32_t size){
+
+	memset(sim->flash + (address - sim->flash_base), 0xFF, size);
+	sim_delay_us((uint64_t)sim->config.erase_kb_us * ((size + 1023) / 1024));
+}
+
+/* four address bytes and their checksum, then ACK or NACK */
+static int sim_address(sim_t *sim, uint32_t *address){
+
+	uint8_t buffer[5];
+
+	if (sim_recv(sim, buffer, 5) != 0)
+		return SIM_STOP;
+
+	if (sim_xor(buffer, 4) != buffer[4])
+		return 1;
+
+	*address = ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+
+	return 0;
+}
+
+static int sim_get(sim_t *sim){
+
+	uint8_t buffer[4 + sizeof(sim_commands)];
+	uint8_t count = sizeof(sim_commands);
+
+	memcpy(buffer + 2, sim_commands, sizeof(sim_commands));
+
+	if (sim->config.checksum)
+		buffer[2 + count++] = SIM_GET_CHECKSUM;
+
+	buffer[0] = count;
+	buffer[1] = sim->config.version;
+	buffer[2 + count] = SIM_ACK;
+
+	return sim_send(sim, buffer, 3 + count);
+}
+
+static int sim_get_rps(sim_t *sim){
+
+	uint8_t buffer[4] = { sim->config.version, 0x00, 0x00, SIM_ACK };
+
+	return sim_send(sim, buffer, sizeof(buffer));
+}
+
+static int sim_get_id(sim_t *sim){
+
+	uint8_t buffer[4] = { 1, sim->config.pid >> 8, sim->config.pid & 0xFF, SIM_ACK };
+
+	return sim_send(sim, buffer, sizeof(buffer));
+}
+
+static int sim_read(sim_t *sim){
+
+	uint8_t buffer[2];
+	uint32_t address;
+	int result = sim_address(sim, &address);
+
+	if (result != 0)
+		return result == SIM_STOP ? SIM_STOP : sim_reply(sim, SIM_NACK);
+
+	if (sim_memory(sim, address, 1) == NULL)
+		return sim_reply(sim, SIM_NACK);
+
+	if (sim_reply(sim, SIM_ACK) != 0 || sim_recv(sim, buffer, 2) != 0)
+		return SIM_STOP;
+
+	uint8_t *memory = sim_memory(sim, address, buffer[0] + 1);
+
+	if ((buffer[0] ^ buffer[1]) != 0xFF || memory == NULL)
+		return sim_reply(sim, SIM_NACK);
+
+	if (sim_reply(sim, SIM_ACK) != 0)
+		return SIM_STOP;
+
+	return sim_send(sim, memory, buffer[0] + 1);
+}
+
+static int sim_get_checksum(sim_t *sim){
+
+	uint8_t buffer[5];
+	uint32_t address;
+	uint32_t size;
+	uint32_t polynomial;
+	uint32_t crc;
+	int result;
+
+	/* word aligned start address and size in bytes, each ACKed on its own */
+	if ((result = sim_address(sim, &address)) != 0 || (address & 3) != 0)
+		return result == SIM_STOP ? SIM_STOP : sim_reply(sim, SIM_NACK);
+
+	if (sim_reply(sim, SIM_ACK) != 0)
+		return SIM_STOP;
+
+	if ((result = sim_address(sim, &size)) != 0 || size == 0 || (size & 3) != 0 || sim_memory(sim, address, size) == NULL)
+		return result == SIM_STOP ? SIM_STOP : sim_reply(sim, SIM_NACK);
+
+	if (sim_reply(sim, SIM_ACK) != 0)
+		return SIM_STOP;
+
+	/* CRC unit polynomial and initial value */
+	if ((result = sim_address(sim, &polynomial)) != 0)
+		return result == SIM_STOP ? SIM_STOP : sim_reply(sim, SIM_NACK);
+
+	if (sim_reply(sim, SIM_ACK) != 0)
+		return SIM_STOP;
+
+	if ((result = sim_address(sim, &crc)) != 0)
+		return result == SIM_STOP ? SIM_STOP : sim_reply(sim, SIM_NACK);
+
+	if (sim_reply(sim, SIM_ACK) != 0)
+		return SIM_STOP;
+
+	/* the CRC unit, one little-endian word at a time */
+	const uint8_t *memory = sim_memory(sim, address, size);
+	uint32_t i;
+	int k;
+
+	for(i = 0; i < size; i += 4){
+
+		crc ^= memory[i] | (uint32_t)memory[i + 1] << 8 | (uint32_t)memory[i + 2] << 16 | (uint32_t)memory[i + 3] << 24;
+
+		for(k = 0; k < 32; k++)
+			crc = crc & 0x80000000 ? (crc << 1) ^ polynomial : crc << 1;
+	}
+
+	buffer[0] = crc >> 24;
+	buffer[1] = crc >> 16;
+	buffer[2] = crc >> 8;
+	buffer[3] = crc;
+	buffer[4] = sim_xor(buffer, 4);
+
+	return sim_send(sim, buffer, 5);
+}
+
+static int sim_write(sim_t *sim){
+
+	uint8_t buffer[0x102];
+	uint32_t address;
+	int result = sim_address(sim, &address);
+
+	if (result != 0)
+		return result == SIM_STOP ? SIM_STOP : sim_reply(sim, SIM_NACK);
+
+	if (address % 4 != 0 || sim_memory(sim, address, 1) == NULL)
+		return sim_reply(sim, SIM_NACK);
+
+	if (sim_reply(sim, SIM_ACK) != 0 || sim_recv(sim, buffer, 1) != 0)
+		return SIM_STOP;
+
+	uint32_t size = buffer[0] + 1;
+
+	if (sim_recv(sim, buffer + 1, size + 1) != 0)
+		return SIM_STOP;
+
+	uint8_t *memory = sim_memory(sim, address, size);
+
+	if (sim_xor(buffer, size + 1) != buffer[size + 1] || memory == NULL || sim_protected(sim, address, size))
+		return sim_reply(sim, SIM_NACK);
+
+	/* flash programming only clears bits, the unique ID is read-only */
+	if (sim_in_flash(sim, memory)){
+
+		uint32_t i = 0;
+
+		for(i = 0; i < size; i++)
+			memory[i] &= buffer[i + 1];
+	} else if (memory >= sim->ram && memory < sim->ram + sim->config.ram_size)
+		memcpy(memory, buffer + 1, size);
+
+	sim_delay_us(sim->config.write_us);
+
+	return sim_reply(sim, SIM_ACK);
+}
+
+static int sim_helper_ack(sim_t *sim, uint8_t seq, uint8_t status, uint32_t crc){
+
+	uint8_t ack[STM32_HELPER_ACK] = { STM32_HELPER_SYNC_TARGET, seq, status, 0 };
+
+	ack[4] = crc & 0xFF;
+	ack[5] = (crc >> 8) & 0xFF;
+	ack[6] = (crc >> 16) & 0xFF;
+	ack[7] = (crc >> 24) & 0xFF;
+
+	if (status != STM32_HELPER_STATUS_OK)
+		sim->stats.helper_errors++;
+
+	return sim_send(sim, ack, sizeof(ack));
+}
+
+/* stands in for the helper firmware until it is told to reset */
+static int sim_helper(sim_t *sim){
+
+	uint8_t buffer[STM32_HELPER_HEADER + STM32_HELPER_BLOCK_MAX + 4];
+	uint8_t raw[STM32_HELPER_BLOCK_MAX];
+	uint16_t block = sim->config.helper_block;
+	uint8_t hello[STM32_HELPER_HELLO] = {
+		'S', 'H', STM32_HELPER_VERSION, sim->config.helper_window, block & 0xFF, block >> 8, STM32_HELPER_FLAG_LZ4, 0
+	};
+	uint8_t expected = 0;
+
+	if (sim_send(sim, hello, sizeof(hello)) != 0)
+		return SIM_STOP;
+
+	while(1){
+
+		/* hunt for the start of a block */
+		if (sim_recv(sim, buffer, 1) != 0)
+			return SIM_STOP;
+
+		if (buffer[0] != STM32_HELPER_SYNC_HOST)
+			continue;
+
+		if (sim_recv(sim, buffer + 1, STM32_HELPER_HEADER - 1) != 0)
+			return SIM_STOP;
+
+		uint8_t op = buffer[1];
+		uint8_t seq = buffer[2];
+		uint32_t address = buffer[4] | (buffer[5] << 8) | (buffer[6] << 16) | ((uint32_t)buffer[7] << 24);
+		uint32_t size = buffer[8] | (buffer[9] << 8);
+		uint32_t raw_size = buffer[10] | (buffer[11] << 8);
+
+		if (size > block)
+			continue;
+
+		if (sim_recv(sim, buffer + STM32_HELPER_HEADER, size + 4) != 0)
+			return SIM_STOP;
+
+		const uint8_t *trailer = buffer + STM32_HELPER_HEADER + size;
+		uint32_t crc = crc32_update(0, buffer, STM32_HELPER_HEADER + size);
+		int corrupt = crc != (trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24));
+
+		/* everything after a bad block is dropped until it is sent again */
+		if (seq != expected)
+			continue;
+
+		sim->stats.helper_blocks++;
+
+		if (sim->config.helper_corrupt_every != 0 && sim->stats.helper_blocks % sim->config.helper_corrupt_every == 0)
+			corrupt = 1;
+
+		if (corrupt){
+			if (sim_helper_ack(sim, seq, STM32_HELPER_STATUS_CRC, crc) != 0)
+				return SIM_STOP;
+			continue;
+		}
+
+		expected++;
+
+		if (op == STM32_HELPER_RESET){
+			sim->initialised = 0;
+			return sim_helper_ack(sim, seq, STM32_HELPER_STATUS_OK, crc);
+		}
+
+		const uint8_t *data = buffer + STM32_HELPER_HEADER;
+		uint8_t status = STM32_HELPER_STATUS_OK;
+		uint32_t i = 0;
+
+		if (op == STM32_HELPER_WRITE_LZ4){
+
+			if (raw_size > block || lz4_decompress(data, size, raw, raw_size) != (int32_t)raw_size)
+				status = STM32_HELPER_STATUS_DECODE;
+
+			data = raw;
+			size = raw_size;
+		} else if (op != STM32_HELPER_WRITE)
+			status = STM32_HELPER_STATUS_PROGRAM;
+
+		uint8_t *memory = sim_memory(sim, address, size);
+
+		if (status == STM32_HELPER_STATUS_OK && (address % 4 != 0 || memory == NULL || !sim_in_flash(sim, memory) || sim_protected(sim, address, size)))
+			status = STM32_HELPER_STATUS_ADDRESS;
+
+		if (status == STM32_HELPER_STATUS_OK){
+
+			for(i = 0; i < size; i++)
+				memory[i] &= data[i];
+
+			sim_delay_us((uint64_t)sim->config.write_us * ((size + 0xFF) / 0x100));
+		}
+
+		if (sim_helper_ack(sim, seq, status, crc) != 0)
+			return SIM_STOP;
+	}
+}
+
+static int sim_go(sim_t *sim){
+
+	uint32_t address;
+	int result = sim_address(sim, &address);
+
+	if (result != 0)
+		return result == SIM_STOP ? SIM_STOP : sim_reply(sim, SIM_NACK);
+
+	uint8_t *memory = sim_memory(sim, address, 4);
+
+	if (memory == NULL || (!sim_in_flash(sim, memory) && !(memory >= sim->ram && memory < sim->ram + sim->config.ram_size)))
+		return sim_reply(sim, SIM_NACK);
+
+	if (sim_reply(sim, SIM_ACK) != 0)
+		return SIM_STOP;
+
+	/* code in SRAM is taken to be the helper, flash holds the application */
+	if (!sim_in_flash(sim, memory))
+		return sim_helper(sim);
+
+	sim->app = 1;
+
+	return 0;
+}
+
+static int sim_extended_erase(sim_t *sim){
+
+	uint8_t buffer[2 + 0x10000 * 2 + 1];
+	const geometry_t *geometry = sim->config.geometry;
+
+	if (sim_recv(sim, buffer, 2) != 0)
+		return SIM_STOP;
+
+	uint16_t count = (buffer[0] << 8) | buffer[1];
+
+	/* special erase */
+	if (count >= 0xFFF0){
+
+		if (sim_recv(sim, buffer + 2, 1) != 0)
+			return SIM_STOP;
+
+		if (sim_xor(buffer, 2) != buffer[2] || count < 0xFFFD)
+			return sim_reply(sim, SIM_NACK);
+
+		uint32_t half = sim->flash_size / 2;
+
+		switch(count){
+			case 0xFFFF: sim_erase_range(sim, sim->flash_base, sim->flash_size); break;
+			case 0xFFFE: sim_erase_range(sim, sim->flash_base, half); break;
+			case 0xFFFD: sim_erase_range(sim, sim->flash_base + half, half); break;
+		}
+
+		return sim_reply(sim, SIM_ACK);
+	}
+
+	uint32_t len = (count + 1) * 2 + 1;
+
+	if (sim_recv(sim, buffer + 2, len) != 0)
+		return SIM_STOP;
+
+	if (sim_xor(buffer, len + 1) != buffer[len + 1])
+		return sim_reply(sim, SIM_NACK);
+
+	/* the whole list is checked before anything is erased */
+	uint32_t i = 0;
+
+	for(i = 0; i <= count; i++){
+
+		uint16_t page = (buffer[2 + i * 2] << 8) | buffer[3 + i * 2];
+		uint32_t address;
+		uint32_t size;
+
+		if (geometry_page(geometry, page, &address, &size) != 0 || sim_protected(sim, address, size))
+			return sim_reply(sim, SIM_NACK);
+	}
+
+	for(i = 0; i <= count; i++){
+
+		uint16_t page = (buffer[2 + i * 2] << 8) | buffer[3 + i * 2];
+		uint32_t address;
+		uint32_t size;
+
+		geometry_page(geometry, page, &address, &size);
+		sim_erase_range(sim, address, size);
+	}
+
+	return sim_reply(sim, SIM_ACK);
+}
+
+static int sim_write_protect(sim_t *sim){
+
+	uint8_t buffer[0x102];
+
+	if (sim_recv(sim, buffer, 1) != 0 || sim_recv(sim, buffer + 1, buffer[0] + 2) != 0)
+		return SIM_STOP;
+
+	if (sim_xor(buffer, buffer[0] + 2) != buffer[buffer[0] + 2])
+		return sim_reply(sim, SIM_NACK);
+
+	uint32_t i = 0;
+
+	for(i = 0; i <= buffer[0]; i++)
+		sim->wrp[buffer[i + 1] / 8] |= 1 << (buffer[i + 1] % 8);
+
+	return sim_reply(sim, SIM_ACK);
+}
+
+static int sim_readout_unprotect(sim_t *sim){
+
+	sim_erase_range(sim, sim->flash_base, sim->flash_size);
+
+	sim->rdp = 0;
+	memset(sim->wrp, 0, sizeof(sim->wrp));
+
+	return sim_reply(sim, SIM_ACK);
+}
+
+/* one command after its ACK, the option byte commands end with a target reset */
+static int sim_command(sim_t *sim, uint8_t command){
+
+	int result = 0;
+
+	switch(command){
+		case SIM_GET              : return sim_get(sim);
+		case SIM_GET_RPS          : return sim_get_rps(sim);
+		case SIM_GET_ID           : return sim_get_id(sim);
+		case SIM_READ             : return sim_read(sim);
+		case SIM_GO               : return sim_go(sim);
+		case SIM_WRITE            : return sim_write(sim);
+		case SIM_EXTENDED_ERASE   : return sim_extended_erase(sim);
+		case SIM_GET_CHECKSUM     : return sim_get_checksum(sim);
+
+		case SIM_WRITE_PROTECT    : result = sim_write_protect(sim); break;
+		case SIM_WRITE_UNPROTECT  : memset(sim->wrp, 0, sizeof(sim->wrp)); result = sim_reply(sim, SIM_ACK); break;
+		case SIM_READOUT_PROTECT  : sim->rdp = 1; result = sim_reply(sim, SIM_ACK); break;
+		case SIM_READOUT_UNPROTECT: result = sim_readout_unprotect(sim); break;
+	}
+
+	sim->initialised = 0;
+
+	return result;
+}
+
+static int sim_blocked(const sim_t *sim, uint8_t command){
+
+	if (memchr(sim_commands, command, sizeof(sim_commands)) == NULL && !(command == SIM_GET_CHECKSUM && sim->config.checksum))
+		return 1;
+
+	/* memory access is refused while readout protection is active */
+	return sim->rdp && (
+		command == SIM_READ || command == SIM_GO || command == SIM_WRITE ||
+		command == SIM_EXTENDED_ERASE || command == SIM_GET_CHECKSUM
+	);
+}
+
+/* the byte arrived at a rate the bootloader is not locked onto or the link cannot carry */
+static int sim_garbled(sim_t *sim){
+
+	uint32_t rate = serial_get_rate(sim->slave);
+
+	if (sim->locked_rate == 0)
+		sim->locked_rate = rate;
+
+	return rate != sim->locked_rate || rate > sim->config.rate_max;
+}
+
+static void *sim_thread(void *arg){
+
+	sim_t *sim = arg;
+	uint8_t buffer[2];
+
+	while(1){
+
+		if (sim_recv(sim, buffer, 1) != 0)
+			break;
+
+		if (atomic_exchange(&sim->reset, 0)){
+			sim->initialised = 0;
+			sim->app = 0;
+			sim->locked_rate = 0;
+			sim->dropping = 0;
+		}
+
+		if (sim->dropping)
+			continue;
+
+		if (sim->config.rate_max != 0 && sim_garbled(sim))
+			continue;
+
+		/* the application does not speak the protocol */
+		if (sim->app)
+			continue;
+
+		/* the autobaud byte, also acknowledged once initialised */
+		if (buffer[0] == SIM_INIT){
+			sim->initialised = 1;
+			sim_delay_us(sim->config.latency_us);
+			if (sim_reply(sim, SIM_ACK) != 0)
+				break;
+			continue;
+		}
+
+		/* a real bootloader ignores everything before the autobaud byte */
+		if (!sim->initialised)
+			continue;
+
+		if (sim_recv(sim, buffer + 1, 1) != 0)
+			break;
+
+		sim->stats.commands++;
+
+		if (sim->config.drop_after != 0 && sim->stats.commands > sim->config.drop_after){
+			sim->dropping = 1;
+			continue;
+		}
+
+		sim_delay_us(sim->config.latency_us);
+
+		int result = 0;
+
+		if ((buffer[0] ^ buffer[1]) != 0xFF || sim_blocked(sim, buffer[0]))
+			result = sim_reply(sim, SIM_NACK);
+		else if (sim->config.nack_every != 0 && sim->stats.commands % sim->config.nack_every == 0){
+			sim->stats.nacks_injected++;
+			result = sim_reply(sim, SIM_NACK);
+		} else if ((result = sim_reply(sim, SIM_ACK)) == 0)
+			result = sim_command(sim, buffer[0]);
+
+		if (result != 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static int sim_pty(sim_t *sim){
+
+	struct termios settings;
+
+	sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (sim->master < 0)
+		return -1;
+
+	if (
+		grantpt(sim->master) != 0 ||
+		unlockpt(sim->master) != 0 ||
+		ptsname_r(sim->master, sim->device, sizeof(sim->device)) != 0
+	)
+		return -1;
+
+	sim->slave = open(sim->device, O_RDWR | O_NOCTTY);
+
+	if (sim->slave < 0)
+		return -1;
+
+	/* raw until the host runs serial_setup() */
+	if (tcgetattr(sim->slave, &settings) != 0)
+		return -1;
+
+	cfmakeraw(&settings);
+
+	if (tcsetattr(sim->slave, TCSANOW, &settings) != 0)
+		return -1;
+
+	return 0;
+}
+
+int sim_open(sim_t *sim, const sim_config_t *config){
+
+	if (sim == NULL)
+		return -1;
+
+	memset(sim, 0, sizeof(sim_t));
+
+	sim->master = -1;
+	sim->slave = -1;
+	sim->wakeup[0] = -1;
+	sim->wakeup[1] = -1;
+
+	if (config != NULL)
+		sim->config = *config;
+
+	if (sim->config.geometry == NULL)
+		sim->config.geometry = &geometry_stm32f4_1m;
+
+	if (sim->config.pid == 0)
+		sim->config.pid = 0x413;
+
+	if (sim->config.version == 0)
+		sim->config.version = 0x31;
+
+	if (sim->config.uid_address == 0)
+		sim->config.uid_address = stm32_uid_address(sim->config.pid);
+
+	if (sim->config.ram_size == 0)
+		sim->config.ram_size = 0x20000;
+
+	if (sim->config.helper_window == 0 || sim->config.helper_window > STM32_HELPER_WINDOW_MAX)
+		sim->config.helper_window = 4;
+
+	if (sim->config.helper_block == 0 || sim->config.helper_block > STM32_HELPER_BLOCK_MAX)
+		sim->config.helper_block = 0x1000;
+
+	sim->flash_base = sim->config.geometry->base;
+	sim->flash_size = geometry_size(sim->config.geometry);
+	sim->flash = malloc(sim->flash_size);
+	sim->ram = calloc(1, sim->config.ram_size);
+
+	if (sim->flash == NULL || sim->ram == NULL){
+		sim_close(sim);
+		return -1;
+	}
+
+	memset(sim->flash, 0xFF, sim->flash_size);
+
+	if (pipe(sim->wakeup) != 0 || sim_pty(sim) != 0 || pthread_create(&sim->thread, NULL, sim_thread, sim) != 0){
+		sim_close(sim);
+		return -1;
+	}
+
+	sim->running = 1;
+
+	return 0;
+}
+
+void sim_close(sim_t *sim){
+
+	if (sim == NULL)
+		return;
+
+	if (sim->running){
+
+		uint8_t wake = 0;
+
+		atomic_store(&sim->stop, 1);
+
+		if (write(sim->wakeup[1], &wake, 1) == 1)
+			pthread_join(sim->thread, NULL);
+
+		sim->running = 0;
+	}
+
+	if (sim->slave >= 0)
+		close(sim->slave);
+
+	if (sim->master >= 0)
+		close(sim->master);
+
+	if (sim->wakeup[0] >= 0){
+		close(sim->wakeup[0]);
+		close(sim->wakeup[1]);
+	}
+
+	free(sim->flash);
+	free(sim->ram);
+
+	sim->flash = NULL;
+	sim->ram = NULL;
+	sim->master = -1;
+	sim->slave = -1;
+	sim->wakeup[0] = -1;
+	sim->wakeup[1] = -1;
+}
+
+/* restarts the bootloader like a reset pin, whatever the host sent before is lost, config changes made before take effect */
+void sim_reset(sim_t *sim){
+
+	atomic_store(&sim->reset, 1);
+	tcflush(sim->master, TCIFLUSH);
+}
+
+/* stops or resumes draining what the host sends, like a target holding off flow control */
+void sim_stall(sim_t *sim, int stall){
+
+	atomic_store(&sim->stalled, stall);
+}
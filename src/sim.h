@@ -0,0 +1,106 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "geometry.h"
+
+#define SIM_UID_SIZE	12
+#define SIM_DEVICE_MAX	64
+#define SIM_RAM_BASE	0x20000000
+
+/* target behaviour, zeroed fields take the defaults noted */
+typedef struct sim_config {
+	const geometry_t *geometry;	/* flash layout, geometry_stm32f4_1m */
+	uint16_t pid;				/* 'get id' answer, 0x413 */
+	uint8_t version;			/* bootloader version, 0x31 */
+	uint32_t uid_address;		/* unique ID location, from the pid */
+	uint8_t uid[SIM_UID_SIZE];
+	uint32_t ram_size;			/* SRAM at SIM_RAM_BASE, 0x20000 */
+	uint8_t checksum;			/* offer 'get checksum' (0xA1) like newer bootloaders, off */
+
+	/* RAM helper run by 'go' into SRAM, see stm32_helper.h */
+	uint8_t helper_window;		/* blocks in flight, 4 */
+	uint16_t helper_block;		/* largest block, 0x1000 */
+
+	/* timing, all optional */
+	uint32_t rate;				/* paces both directions to this baud rate (8E1) */
+	uint32_t rate_max;			/* fastest host rate the link carries, the bootloader then locks onto
+								   the rate of the first byte it sees and paces to it until sim_reset() */
+	uint32_t latency_us;		/* turnaround before every response */
+	uint32_t write_us;			/* programming time of one 'write memory' frame */
+	uint32_t erase_kb_us;		/* erase time per KiB, also used for mass erase */
+
+	/* faults */
+	uint32_t nack_every;		/* NACK every Nth command instead of its first ACK */
+	uint32_t helper_corrupt_every;	/* report a CRC error for every Nth helper block */
+	uint32_t drop_after;		/* goes silent on command N + 1 like a target losing power, until sim_reset() */
+} sim_config_t ;
+
+typedef struct sim_stats {
+	uint32_t commands;
+	uint32_t nacks;
+	uint32_t nacks_injected;
+	uint32_t helper_blocks;
+	uint32_t helper_errors;
+	uint64_t bytes_rx;
+	uint64_t bytes_tx;
+} sim_stats_t ;
+
+/* AN3155 bootloader on the master side of a pseudo-terminal */
+typedef struct sim {
+	sim_config_t config;
+	char device[SIM_DEVICE_MAX];	/* slave side, open it with serial_open() */
+
+	uint8_t *flash;
+	uint32_t flash_base;
+	uint32_t flash_size;
+	uint8_t *ram;
+	uint8_t rdp;					/* readout protection active */
+	uint8_t wrp[0x100 / 8];			/* write protected pages */
+	sim_stats_t stats;				/* updated by the simulator thread */
+
+	int master;
+	int slave;						/* held open so host closes never hang up the master */
+	int wakeup[2];
+	uint8_t initialised;
+	uint8_t app;					/* jumped into flash, the bootloader no longer answers */
+	uint32_t locked_rate;			/* with rate_max, 0 until the first byte */
+	uint8_t dropping;				/* past drop_after */
+	atomic_int reset;				/* set by sim_reset(), taken by the simulator thread */
+	atomic_int stalled;				/* set by sim_stall(), the master is not drained */
+	uint64_t wire_ns;
+	atomic_int stop;
+	uint8_t running;
+	pthread_t thread;
+} sim_t ;
+
+int sim_open(sim_t *sim, const sim_config_t *config);
+void sim_close(sim_t *sim);
+void sim_reset(sim_t *sim);
+void sim_stall(sim_t *sim, int stall);
+
+#endif /* SIM_H_ */
@@ -22,53 +22,231 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include "stm32.h"
 #include "serial.h"
-
-#define STM32_INIT				(uint8_t)0x7F
-#define STM32_ACK				(uint8_t)0x79
-#define STM32_NACK				(uint8_t)0x1F
-#define STM32_GET				(uint8_t)0x00
-#define STM32_GET_RPS			(uint8_t)0x01
-#define STM32_GET_ID			(uint8_t)0x02
-#define STM32_READ				(uint8_t)0x11
-#define STM32_WRITE				(uint8_t)0x31
-#define STM32_EXTENDED_ERASE	(uint8_t)0x44
-#define STM32_WRITE_PROTECT		(uint8_t)0x63
-#define STM32_WRITE_UNPROTECT	(uint8_t)0x73
-#define STM32_READOUT_PROTECT	(uint8_t)0x82
-#define STM32_READOUT_UNPROTECT	(uint8_t)0x92
+#include "clock.h"
 
 #define STM32_EE_ERASE_MASS		(uint16_t)0xFFFF
 #define STM32_EE_ERASE_BANK1	(uint16_t)0xFFFE
 #define STM32_EE_ERASE_BANK2	(uint16_t)0xFFFD
+#define STM32_EE_MAX_PAGES		0x100	/* pages sent in one 'extended erase' frame */
+
+#define STM32_DEFAULT_PAGE_KB	2		/* F0, F1, F3, L4 and G4 page, used when the geometry is unknown */
+#define STM32_WORST_FLASH_KB	2048
+
+static void ctx_phase(stm32_ctx_t *ctx, const char *phase, uint64_t start_us, int len){
+
+	timeline_event_t *event = timeline_add(ctx->timeline, TIMELINE_PHASE, phase, start_us);
+
+	if (event != NULL)
+		event->size = len;
+}
+
+/* queues a piece of the frame, it goes out with the next read, phase names it on the timeline */
+static stm32_errors_t ctx_write(stm32_ctx_t *ctx, const char *phase, const void *buffer, int len){
+
+	ctx->stats.bytes_tx += len;
+	ctx->tx_phase = phase;
+
+	serial_errors_t result = serial_io_write(&ctx->io, buffer, len);
+
+	if (result == SERIAL_ERR_TIMEOUT)
+		return STM32_ERR_TIMEOUT;
+
+	if (result != SERIAL_ERR_OK)
+		return STM32_ERR_SERIAL;
+
+	return STM32_ERR_OK;
+}
+
+/* timeout_ms covers the target's reaction, the transfer time of len bytes is added on top */
+static stm32_errors_t ctx_read(stm32_ctx_t *ctx, const char *phase, const void *buffer, int len, uint32_t timeout_ms){
+
+	uint64_t start_us = ctx->timeline != NULL ? clock_now_us() : 0;
+	uint32_t gathered = serial_io_gathered(&ctx->io);
+	serial_errors_t result = SERIAL_ERR_OK;
+
+	/* the gathered frame goes out first, timed as the phase of its writes */
+	if (gathered > 0){
+
+		result = serial_io_flush(&ctx->io);
+
+		if (ctx->timeline != NULL){
+			ctx_phase(ctx, ctx->tx_phase, start_us, gathered);
+			start_us = clock_now_us();
+		}
+	}
+
+	uint64_t transfer_ms = ((uint64_t)len * ctx->timeouts.byte_us + 999) / 1000;
+
+	if (result == SERIAL_ERR_OK)
+		result = serial_io_read_timeout(&ctx->io, (void *)buffer, len, timeout_ms + transfer_ms);
+
+	if (ctx->timeline != NULL)
+		ctx_phase(ctx, phase, start_us, len);
+
+	if (result == SERIAL_ERR_TIMEOUT)
+		return STM32_ERR_TIMEOUT;
+
+	if (result != SERIAL_ERR_OK)
+		return STM32_ERR_SERIAL;
+
+	ctx->stats.bytes_rx += len;
+
+	return STM32_ERR_OK;
+}
+
+static const geometry_t *ctx_geometry(const stm32_ctx_t *ctx){
+
+	if (ctx->geometry != NULL)
+		return ctx->geometry;
+
+	return ctx->erased != NULL ? ctx->erased->geometry : NULL;
+}
+
+/* erase ACK deadline, scaled by the size of the pages being erased */
+uint32_t stm32_erase_timeout(const stm32_ctx_t *ctx, const uint16_t *pages, uint16_t pages_size){
+
+	const geometry_t *geometry = ctx_geometry(ctx);
+	uint64_t kb = 0;
+	uint16_t i = 0;
 
-static stm32_errors_t send_cmd(int fd, uint8_t cmd, uint8_t *response){
+	for(i = 0; i < pages_size; i++){
+
+		uint32_t address;
+		uint32_t size;
+
+		if (geometry != NULL && geometry_page(geometry, pages[i], &address, &size) == 0)
+			kb += (size + 1023) / 1024;
+		else
+			kb += STM32_DEFAULT_PAGE_KB;
+	}
+
+	return ctx->timeouts.erase_ms + kb * ctx->timeouts.erase_kb_ms;
+}
+
+/* mass erase deadline, a bank erase is given the same time */
+static uint32_t erase_all_timeout(const stm32_ctx_t *ctx){
+
+	const geometry_t *geometry = ctx_geometry(ctx);
+	uint64_t kb = geometry != NULL ? (geometry_size(geometry) + 1023) / 1024 : STM32_WORST_FLASH_KB;
+
+	return ctx->timeouts.erase_ms + kb * ctx->timeouts.erase_kb_ms;
+}
+
+typedef struct ctx_span {
+	uint64_t start_us;
+	uint64_t bytes_tx;
+	uint64_t bytes_rx;
+	uint32_t address;	/* shown on the timeline */
+	uint16_t size;
+} ctx_span_t ;
+
+static ctx_span_t ctx_begin(const stm32_ctx_t *ctx){
+
+	ctx_span_t span;
+
+	span.start_us = ctx->metrics != NULL || ctx->timeline != NULL ? clock_now_us() : 0;
+	span.bytes_tx = ctx->stats.bytes_tx;
+	span.bytes_rx = ctx->stats.bytes_rx;
+	span.address = 0;
+	span.size = 0;
+
+	return span;
+}
+
+static stm32_errors_t ctx_end(stm32_ctx_t *ctx, const ctx_span_t *span, uint8_t opcode, stm32_errors_t result){
+
+	if (ctx->timeline != NULL){
+
+		timeline_event_t *event = timeline_add(ctx->timeline, TIMELINE_COMMAND, metrics_command_name(opcode), span->start_us);
+
+		if (event != NULL){
+			event->address = span->address;
+			event->size = span->size;
+			event->result = result;
+		}
+	}
+
+	if (ctx->metrics == NULL)
+		return result;
+
+	metrics_outcome_t outcome = METRICS_FAILED;
+
+	if (result == STM32_ERR_OK)
+		outcome = METRICS_OK;
+	else if (result == STM32_ERR_TIMEOUT)
+		outcome = METRICS_TIMEOUT;
+
+	metrics_record(ctx->metrics, opcode, outcome, clock_now_us() - span->start_us,
+		ctx->stats.bytes_tx - span->bytes_tx, ctx->stats.bytes_rx - span->bytes_rx);
+
+	return result;
+}
+
+static stm32_errors_t send_cmd(stm32_ctx_t *ctx, uint8_t cmd, uint8_t *response){
 
 	uint8_t buffer[2];
+	stm32_errors_t result;
 
 	buffer[0] = cmd;
 	buffer[1] = buffer[0] ^ 0xFF;
 
+	ctx->stats.commands++;
+
 	if (
-		serial_write(fd, buffer, 2) != SERIAL_ERR_OK ||
-		serial_read(fd, response, 1) != SERIAL_ERR_OK
+		(result = ctx_write(ctx, "command", buffer, 2)) != STM32_ERR_OK ||
+		(result = ctx_read(ctx, "ack", response, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK
 	)
-		return STM32_ERR_SERIAL;
+		return result;
+
+	if (response[0] == STM32_NACK)
+		ctx->stats.nacks++;
+
+	if (ctx->metrics != NULL && (response[0] == STM32_ACK || response[0] == STM32_NACK))
+		metrics_ack(ctx->metrics, cmd, response[0] == STM32_ACK);
 
 	return STM32_ERR_OK;
 }
 
-stm32_errors_t stm32_init(int fd) {
+void stm32_ctx_init(stm32_ctx_t *ctx, int fd){
+
+	memset(ctx, 0, sizeof(stm32_ctx_t));
+
+	ctx->fd = fd;
+	serial_io_init(&ctx->io, fd);
+
+	ctx->timeouts.ack_ms = STM32_TIMEOUT_ACK;
+	ctx->timeouts.write_ms = STM32_TIMEOUT_WRITE;
+	ctx->timeouts.erase_ms = STM32_TIMEOUT_ERASE;
+	ctx->timeouts.erase_kb_ms = STM32_TIMEOUT_ERASE_KB;
+
+	stm32_ctx_rate(ctx, 0);
+}
+
+/* scales the data deadlines to the port rate, 0 for STM32_RATE_DEFAULT */
+void stm32_ctx_rate(stm32_ctx_t *ctx, uint32_t rate){
+
+	if (rate == 0)
+		rate = STM32_RATE_DEFAULT;
+
+	/* 11 bits per 8E1 character, twice that for slack */
+	ctx->timeouts.byte_us = (2 * 11 * 1000000 + rate - 1) / rate;
+	ctx->io.byte_us = ctx->timeouts.byte_us;
+}
+
+static stm32_errors_t cmd_init(stm32_ctx_t *ctx) {
 
 	uint8_t buffer = STM32_INIT;
+	stm32_errors_t result;
 
 	/* send 'init' command and wait ACK */
 	if (
-		serial_write(fd, &buffer, 1) != SERIAL_ERR_OK ||
-		serial_read(fd, &buffer, 1) != SERIAL_ERR_OK
+		(result = ctx_write(ctx, "init", &buffer, 1)) != STM32_ERR_OK ||
+		(result = ctx_read(ctx, "ack", &buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK
 	)
-		return STM32_ERR_SERIAL;
+		return result;
 
 	if (buffer != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
@@ -76,15 +254,13 @@ stm32_errors_t stm32_init(int fd) {
 	return STM32_ERR_OK;
 }
 
-stm32_errors_t stm32_get(int fd, uint8_t *version, uint8_t **supported_commands, uint8_t *supported_commands_size){
-
-	static uint8_t commands[0xFF];
+static stm32_errors_t cmd_get(stm32_ctx_t *ctx, uint8_t *version, uint8_t **supported_commands, uint8_t *supported_commands_size){
 
 	uint8_t buffer[0xFF];
 	uint16_t len;
 
 	/* send 'get' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_GET, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_GET, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -93,8 +269,8 @@ stm32_errors_t stm32_get(int fd, uint8_t *version, uint8_t **supported_commands,
 		return STM32_ERR_PROTOCOL;
 
 	/* read size of response */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "length", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] < 0)
 		return STM32_ERR_PROTOCOL;
@@ -102,21 +278,21 @@ stm32_errors_t stm32_get(int fd, uint8_t *version, uint8_t **supported_commands,
 	len = buffer[0] + 1;
 
 	/* read bootloader version */
-	if(serial_read(fd, version, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "data", version, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
 	len--;
 
 	/* read supported commands */
-	if(serial_read(fd, commands, len) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "data", ctx->commands, len, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
-	*supported_commands = commands;
+	*supported_commands = ctx->commands;
 	*supported_commands_size = len;
 
 	/* read ACK */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
@@ -124,12 +300,12 @@ stm32_errors_t stm32_get(int fd, uint8_t *version, uint8_t **supported_commands,
 	return STM32_ERR_OK;
 }
 
-stm32_errors_t stm32_get_prs(int fd, uint8_t *rpdc, uint8_t *rpec){
+static stm32_errors_t cmd_get_prs(stm32_ctx_t *ctx, uint8_t *rpdc, uint8_t *rpec){
 
 	uint8_t buffer[0xFF];
 
 	/* send 'get prs' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_GET_RPS, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_GET_RPS, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -141,20 +317,20 @@ stm32_errors_t stm32_get_prs(int fd, uint8_t *rpdc, uint8_t *rpec){
 		return STM32_ERR_PROTOCOL;
 
 	/* read bootloader version */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "data", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
 	/* read protection disable counter */
-	if(serial_read(fd, rpdc, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "data", rpdc, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
 	/* read protection enable counter */
-	if(serial_read(fd, rpec, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "data", rpec, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
 	/* read ACK */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
@@ -162,15 +338,13 @@ stm32_errors_t stm32_get_prs(int fd, uint8_t *rpdc, uint8_t *rpec){
 	return STM32_ERR_OK;
 }
 
-stm32_errors_t stm32_get_id(int fd, uint8_t **device_id, uint8_t *device_id_size){
-
-	static uint8_t id[0x100]; // 0xFF + 1
+static stm32_errors_t cmd_get_id(stm32_ctx_t *ctx, uint8_t **device_id, uint8_t *device_id_size){
 
 	uint8_t buffer[0xFF];
 	uint8_t len;
 
 	/* send 'get id' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_GET_ID, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_GET_ID, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -179,8 +353,8 @@ stm32_errors_t stm32_get_id(int fd, uint8_t **device_id, uint8_t *device_id_size
 		return STM32_ERR_PROTOCOL;
 
 	/* read size of response */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "length", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] < 0)
 		return STM32_ERR_PROTOCOL;
@@ -188,15 +362,15 @@ stm32_errors_t stm32_get_id(int fd, uint8_t **device_id, uint8_t *device_id_size
 	len = buffer[0] + 1;
 
 	/* read device id */
-	if(serial_read(fd, id, len) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "data", ctx->id, len, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
-	*device_id = id;
+	*device_id = ctx->id;
 	*device_id_size = len;
 
 	/* read ACK */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
@@ -204,9 +378,7 @@ stm32_errors_t stm32_get_id(int fd, uint8_t **device_id, uint8_t *device_id_size
 	return STM32_ERR_OK;
 }
 
-stm32_errors_t stm32_read(int fd, uint32_t start_address, uint8_t **data, uint16_t data_size){
-
-	static uint8_t response[0x100]; //0xFF + 1
+static stm32_errors_t cmd_read(stm32_ctx_t *ctx, uint32_t start_address, uint8_t **data, uint16_t data_size){
 
 	uint8_t buffer[0xFF];
 
@@ -214,7 +386,7 @@ stm32_errors_t stm32_read(int fd, uint32_t start_address, uint8_t **data, uint16
 		return STM32_ERR_INVALID_ARGUMENT;
 
 	/* send 'read memory' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_READ, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_READ, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -236,10 +408,10 @@ stm32_errors_t stm32_read(int fd, uint32_t start_address, uint8_t **data, uint16
 
 	/* send start address with checksum and wait ACK */
 	if(
-		serial_write(fd, buffer, 5) != SERIAL_ERR_OK ||
-		serial_read(fd, buffer, 1) != SERIAL_ERR_OK
+		(result = ctx_write(ctx, "address", buffer, 5)) != STM32_ERR_OK ||
+		(result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK
 	)
-		return STM32_ERR_SERIAL;
+		return result;
 
 	/* check for bad address */
 	if (buffer[0] == STM32_NACK)
@@ -254,10 +426,10 @@ stm32_errors_t stm32_read(int fd, uint32_t start_address, uint8_t **data, uint16
 
 	/* send block size with checksum */
 	if(
-		serial_write(fd, buffer, 2) != SERIAL_ERR_OK ||
-		serial_read(fd, buffer, 1) != SERIAL_ERR_OK
+		(result = ctx_write(ctx, "length", buffer, 2)) != STM32_ERR_OK ||
+		(result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK
 	)
-		return STM32_ERR_SERIAL;
+		return result;
 
 	/* check for Read Device Protection */
 	if (buffer[0] == STM32_NACK)
@@ -267,15 +439,15 @@ stm32_errors_t stm32_read(int fd, uint32_t start_address, uint8_t **data, uint16
 		return STM32_ERR_PROTOCOL;
 
 	/* read data */
-	if(serial_read(fd, response, data_size) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "data", ctx->response, data_size, ctx->timeouts.ack_ms)) != STM32_ERR_OK)
+		return result;
 
-	*data = response;
+	*data = ctx->response;
 
 	return STM32_ERR_OK;
 }
 
-stm32_errors_t stm32_write(int fd, uint32_t start_address, const uint8_t *data, uint16_t data_size){
+static stm32_errors_t cmd_write(stm32_ctx_t *ctx, uint32_t start_address, const uint8_t *data, uint16_t data_size){
 
 	uint8_t buffer[0x200];
 	uint8_t check_summ;
@@ -288,7 +460,7 @@ stm32_errors_t stm32_write(int fd, uint32_t start_address, const uint8_t *data,
 		return STM32_ERR_INVALID_ARGUMENT;
 
 	/* send 'write memory' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_WRITE, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_WRITE, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -310,10 +482,10 @@ stm32_errors_t stm32_write(int fd, uint32_t start_address, const uint8_t *data,
 
 	/* send start address with checksum and wait ACK */
 	if(
-		serial_write(fd, buffer, 5) != SERIAL_ERR_OK ||
-		serial_read(fd, buffer, 1) != SERIAL_ERR_OK
+		(result = ctx_write(ctx, "address", buffer, 5)) != STM32_ERR_OK ||
+		(result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK
 	)
-		return STM32_ERR_SERIAL;
+		return result;
 
 	/* check for bad address */
 	if (buffer[0] == STM32_NACK)
@@ -336,32 +508,98 @@ stm32_errors_t stm32_write(int fd, uint32_t start_address, const uint8_t *data,
 
 	/* send data */
 	if(
-		serial_write(fd, buffer, data_size + 2) != SERIAL_ERR_OK ||
-		serial_read(fd, buffer, 1) != SERIAL_ERR_OK
+		(result = ctx_write(ctx, "data", buffer, data_size + 2)) != STM32_ERR_OK ||
+		(result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.write_ms)) != STM32_ERR_OK
 	)
-		return STM32_ERR_SERIAL;
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
 
+	if (ctx->erased != NULL)
+		erase_map_written(ctx->erased, start_address, data_size);
+
 	return STM32_ERR_OK;
 
 }
 
-stm32_errors_t stm32_extended_erase(int fd, const uint16_t *pages, uint16_t pages_size){
+static stm32_errors_t cmd_go(stm32_ctx_t *ctx, uint32_t address){
 
-	uint8_t buffer[0xFF];
-	uint8_t check_summ;
+	uint8_t buffer[5];
 
-	if(pages_size == 0)
+	/* send 'go' command and read response */
+	stm32_errors_t result = send_cmd(ctx, STM32_GO, buffer);
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	/* check for Read Device Protection */
+	if (buffer[0] == STM32_NACK)
+		return STM32_ERR_RDP;
+
+	if (buffer[0] != STM32_ACK)
+		return STM32_ERR_PROTOCOL;
+
+	/* build jump address with checksum */
+	buffer[0] = (address >> 24) & 0xFF;
+	buffer[1] = (address >> 16) & 0xFF;
+	buffer[2] = (address >> 8) & 0xFF;
+	buffer[3] = (address >> 0) & 0xFF;
+
+	buffer[4] = buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3];
+
+	/* send jump address with checksum and wait ACK, the target is gone afterwards */
+	if(
+		(result = ctx_write(ctx, "address", buffer, 5)) != STM32_ERR_OK ||
+		(result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK
+	)
+		return result;
+
+	/* check for bad address */
+	if (buffer[0] == STM32_NACK)
 		return STM32_ERR_INVALID_ARGUMENT;
 
-	/* check for special commands */
-	if(pages_size - 1 == STM32_EE_ERASE_MASS || pages_size - 1 == STM32_EE_ERASE_BANK1 || pages_size - 1 == STM32_EE_ERASE_BANK2)
+	if (buffer[0] != STM32_ACK)
+		return STM32_ERR_PROTOCOL;
+
+	return STM32_ERR_OK;
+}
+
+/* 32-bit field, MSB first, with its xor checksum, the reply byte is left in ack */
+static stm32_errors_t send_word(stm32_ctx_t *ctx, const char *phase, uint32_t value, uint8_t *ack){
+
+	uint8_t buffer[5];
+	stm32_errors_t result;
+
+	buffer[0] = (value >> 24) & 0xFF;
+	buffer[1] = (value >> 16) & 0xFF;
+	buffer[2] = (value >> 8) & 0xFF;
+	buffer[3] = (value >> 0) & 0xFF;
+
+	buffer[4] = buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3];
+
+	if(
+		(result = ctx_write(ctx, phase, buffer, 5)) != STM32_ERR_OK ||
+		(result = ctx_read(ctx, "ack", ack, 1, ctx->timeouts.ack_ms)) != STM32_ERR_OK
+	)
+		return result;
+
+	if (*ack != STM32_ACK && *ack != STM32_NACK)
+		return STM32_ERR_PROTOCOL;
+
+	return STM32_ERR_OK;
+}
+
+static stm32_errors_t cmd_get_checksum(stm32_ctx_t *ctx, uint32_t start_address, uint32_t size, uint32_t polynomial, uint32_t initial, uint32_t *crc){
+
+	uint8_t buffer[5];
+
+	/* the CRC unit takes whole words */
+	if (size == 0 || (size % 4) != 0 || (start_address % 4) != 0)
 		return STM32_ERR_INVALID_ARGUMENT;
 
-	/* send 'extended erase memory' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_EXTENDED_ERASE, buffer);
+	/* send 'get checksum' command and read response */
+	stm32_errors_t result = send_cmd(ctx, STM32_GET_CHECKSUM, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -373,46 +611,111 @@ stm32_errors_t stm32_extended_erase(int fd, const uint16_t *pages, uint16_t page
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
 
-	/* send number of pages to be erased */
-	buffer[0] = ((pages_size - 1) >> 8) & 0xFF;
-	buffer[1] = ((pages_size - 1) >> 0) & 0xFF;
+	/* start address and size, a NACK means the area is outside the memory */
+	if(
+		(result = send_word(ctx, "address", start_address, buffer)) != STM32_ERR_OK ||
+		(buffer[0] == STM32_ACK && (result = send_word(ctx, "length", size, buffer)) != STM32_ERR_OK)
+	)
+		return result;
 
-	check_summ = buffer[0];
-	check_summ ^= buffer[1];
+	if (buffer[0] == STM32_NACK)
+		return STM32_ERR_INVALID_ARGUMENT;
 
-	if(serial_write(fd, buffer, 2) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	/* CRC unit polynomial and initial value */
+	if(
+		(result = send_word(ctx, "polynomial", polynomial, buffer)) != STM32_ERR_OK ||
+		(buffer[0] == STM32_ACK && (result = send_word(ctx, "initial", initial, buffer)) != STM32_ERR_OK)
+	)
+		return result;
 
-	uint16_t i = 0;
+	if (buffer[0] == STM32_NACK)
+		return STM32_ERR_INVALID_ARGUMENT;
 
-	/* send pages number */
-	for(i = 0; i < pages_size; i++){
+	/* the target runs its CRC unit over the area before answering, 1 ms per KiB is ample */
+	if ((result = ctx_read(ctx, "checksum", buffer, 5, ctx->timeouts.ack_ms + (size + 1023) / 1024)) != STM32_ERR_OK)
+		return result;
+
+	if ((buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3]) != buffer[4])
+		return STM32_ERR_PROTOCOL;
+
+	*crc = (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 | (uint32_t)buffer[2] << 8 | buffer[3];
+
+	return STM32_ERR_OK;
+}
+
+static stm32_errors_t extended_erase_batch(stm32_ctx_t *ctx, const uint16_t *pages, uint16_t pages_size){
+
+	uint8_t buffer[2 + STM32_EE_MAX_PAGES * 2 + 1];
+	uint8_t check_summ = 0;
+	uint16_t len = 0;
 
-		buffer[0] = (pages[i] >> 8) & ~((~0) << 8);
-		buffer[1] = (pages[i] >> 0) & ~((~0) << 8);
+	/* send 'extended erase memory' command and read response */
+	stm32_errors_t result = send_cmd(ctx, STM32_EXTENDED_ERASE, buffer);
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	/* check for Read Device Protection */
+	if (buffer[0] == STM32_NACK)
+		return STM32_ERR_RDP;
 
-		check_summ ^= buffer[0];
-		check_summ ^= buffer[1];
+	if (buffer[0] != STM32_ACK)
+		return STM32_ERR_PROTOCOL;
 
-		if(serial_write(fd, buffer, 2) != SERIAL_ERR_OK)
-			return STM32_ERR_SERIAL;
+	/* build number of pages, pages number and check sum as one frame */
+	buffer[len++] = ((pages_size - 1) >> 8) & 0xFF;
+	buffer[len++] = ((pages_size - 1) >> 0) & 0xFF;
 
+	uint16_t i = 0;
+
+	for(i = 0; i < pages_size; i++){
+		buffer[len++] = (pages[i] >> 8) & 0xFF;
+		buffer[len++] = (pages[i] >> 0) & 0xFF;
 	}
 
-	/* send check sum */
-	if(serial_write(fd, &check_summ, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	for(i = 0; i < len; i++)
+		check_summ ^= buffer[i];
+
+	buffer[len++] = check_summ;
+
+	if((result = ctx_write(ctx, "pages", buffer, len)) != STM32_ERR_OK)
+		return result;
 
 	/* wait ACK */
-	while(serial_read(fd, buffer, 1) != SERIAL_ERR_OK);
+	if((result = ctx_read(ctx, "ack", buffer, 1, stm32_erase_timeout(ctx, pages, pages_size))) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
 
+	if (ctx->erased != NULL)
+		erase_map_pages(ctx->erased, pages, pages_size);
+
 	return STM32_ERR_OK;
 }
 
-stm32_errors_t stm32_extended_erase_special(int fd, stm32_erase_type_t erase_type){
+static stm32_errors_t cmd_extended_erase(stm32_ctx_t *ctx, const uint16_t *pages, uint16_t pages_size){
+
+	if(pages_size == 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	/* long lists are split over several commands */
+	while(pages_size > 0){
+
+		uint16_t batch = pages_size < STM32_EE_MAX_PAGES ? pages_size : STM32_EE_MAX_PAGES;
+		stm32_errors_t result = extended_erase_batch(ctx, pages, batch);
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		pages += batch;
+		pages_size -= batch;
+	}
+
+	return STM32_ERR_OK;
+}
+
+static stm32_errors_t cmd_extended_erase_special(stm32_ctx_t *ctx, stm32_erase_type_t erase_type){
 
 	uint8_t buffer[0xFF];
 	uint8_t check_summ;
@@ -427,7 +730,7 @@ stm32_errors_t stm32_extended_erase_special(int fd, stm32_erase_type_t erase_typ
 	}
 
 	/* send 'extended erase memory' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_EXTENDED_ERASE, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_EXTENDED_ERASE, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -446,23 +749,28 @@ stm32_errors_t stm32_extended_erase_special(int fd, stm32_erase_type_t erase_typ
 	check_summ = buffer[0];
 	check_summ ^= buffer[1];
 
-	if(serial_write(fd, buffer, 2) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_write(ctx, "pages", buffer, 2)) != STM32_ERR_OK)
+		return result;
 
 	/* send check sum */
-	if(serial_write(fd, &check_summ, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_write(ctx, "pages", &check_summ, 1)) != STM32_ERR_OK)
+		return result;
 
 	/* wait ACK or NACK */
-	while(serial_read(fd, buffer, 1) != SERIAL_ERR_OK);
+	if((result = ctx_read(ctx, "ack", buffer, 1, erase_all_timeout(ctx))) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
 
+	/* bank layouts are not known here, only a mass erase clears everything */
+	if (ctx->erased != NULL && erase_type == STM32_ERASE_MASS)
+		erase_map_all(ctx->erased, 1);
+
 	return STM32_ERR_OK;
 }
 
-stm32_errors_t stm32_write_protect(int fd, const uint8_t *pages, uint16_t pages_size){
+static stm32_errors_t cmd_write_protect(stm32_ctx_t *ctx, const uint8_t *pages, uint16_t pages_size){
 
 	uint8_t buffer[0xFF];
 	uint8_t check_summ;
@@ -471,7 +779,7 @@ stm32_errors_t stm32_write_protect(int fd, const uint8_t *pages, uint16_t pages_
 		return STM32_ERR_INVALID_ARGUMENT;
 
 	/* send 'write protect' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_WRITE_PROTECT, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_WRITE_PROTECT, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -487,12 +795,12 @@ stm32_errors_t stm32_write_protect(int fd, const uint8_t *pages, uint16_t pages_
 	buffer[0] = (pages_size - 1) & 0xFF;
 	check_summ = buffer[0];
 
-	if(serial_write(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_write(ctx, "pages", buffer, 1)) != STM32_ERR_OK)
+		return result;
 
 	/* send pages */
-	if(serial_write(fd, pages, pages_size) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_write(ctx, "pages", pages, pages_size)) != STM32_ERR_OK)
+		return result;
 
 	/* send check sum */
 	uint16_t i = 0;
@@ -500,12 +808,12 @@ stm32_errors_t stm32_write_protect(int fd, const uint8_t *pages, uint16_t pages_
 		check_summ ^= pages[i];
 	}
 
-	if(serial_write(fd, &check_summ, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_write(ctx, "pages", &check_summ, 1)) != STM32_ERR_OK)
+		return result;
 
 	/* read ACK */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.erase_ms)) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
@@ -514,12 +822,12 @@ stm32_errors_t stm32_write_protect(int fd, const uint8_t *pages, uint16_t pages_
 
 }
 
-stm32_errors_t stm32_write_unprotect(int fd){
+static stm32_errors_t cmd_write_unprotect(stm32_ctx_t *ctx){
 
 	uint8_t buffer[0xFF];
 
 	/* send 'write unprotect' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_WRITE_UNPROTECT, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_WRITE_UNPROTECT, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -532,8 +840,8 @@ stm32_errors_t stm32_write_unprotect(int fd){
 		return STM32_ERR_PROTOCOL;
 
 	/* read ACK */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.erase_ms)) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
@@ -541,12 +849,12 @@ stm32_errors_t stm32_write_unprotect(int fd){
 	return STM32_ERR_OK;
 }
 
-stm32_errors_t stm32_readout_protect(int fd){
+static stm32_errors_t cmd_readout_protect(stm32_ctx_t *ctx){
 
 	uint8_t buffer[0xFF];
 
 	/* send 'readout protect' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_READOUT_PROTECT, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_READOUT_PROTECT, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -559,8 +867,8 @@ stm32_errors_t stm32_readout_protect(int fd){
 		return STM32_ERR_PROTOCOL;
 
 	/* read ACK */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "ack", buffer, 1, ctx->timeouts.erase_ms)) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
@@ -569,12 +877,12 @@ stm32_errors_t stm32_readout_protect(int fd){
 
 }
 
-stm32_errors_t stm32_readout_unprotect(int fd){
+static stm32_errors_t cmd_readout_unprotect(stm32_ctx_t *ctx){
 
 	uint8_t buffer[0xFF];
 
 	/* send 'readout unprotect' command and read response */
-	stm32_errors_t result = send_cmd(fd, STM32_READOUT_UNPROTECT, buffer);
+	stm32_errors_t result = send_cmd(ctx, STM32_READOUT_UNPROTECT, buffer);
 
 	if (result != STM32_ERR_OK)
 		return result;
@@ -583,11 +891,124 @@ stm32_errors_t stm32_readout_unprotect(int fd){
 		return STM32_ERR_PROTOCOL;
 
 	/* read ACK */
-	if(serial_read(fd, buffer, 1) != SERIAL_ERR_OK)
-		return STM32_ERR_SERIAL;
+	if((result = ctx_read(ctx, "ack", buffer, 1, erase_all_timeout(ctx))) != STM32_ERR_OK)
+		return result;
 
 	if (buffer[0] != STM32_ACK)
 		return STM32_ERR_PROTOCOL;
 
 	return STM32_ERR_OK;
 }
+
+/* public commands, each one timed and counted when the session has metrics */
+
+stm32_errors_t stm32_init(stm32_ctx_t *ctx){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	return ctx_end(ctx, &span, STM32_INIT, cmd_init(ctx));
+}
+
+stm32_errors_t stm32_get(stm32_ctx_t *ctx, uint8_t *version, uint8_t **supported_commands, uint8_t *supported_commands_size){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	return ctx_end(ctx, &span, STM32_GET, cmd_get(ctx, version, supported_commands, supported_commands_size));
+}
+
+stm32_errors_t stm32_get_prs(stm32_ctx_t *ctx, uint8_t *rpdc, uint8_t *rpec){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	return ctx_end(ctx, &span, STM32_GET_RPS, cmd_get_prs(ctx, rpdc, rpec));
+}
+
+stm32_errors_t stm32_get_id(stm32_ctx_t *ctx, uint8_t **device_id, uint8_t *device_id_size){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	return ctx_end(ctx, &span, STM32_GET_ID, cmd_get_id(ctx, device_id, device_id_size));
+}
+
+stm32_errors_t stm32_read(stm32_ctx_t *ctx, uint32_t start_address, uint8_t **data, uint16_t data_size){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	span.address = start_address;
+	span.size = data_size;
+
+	return ctx_end(ctx, &span, STM32_READ, cmd_read(ctx, start_address, data, data_size));
+}
+
+stm32_errors_t stm32_write(stm32_ctx_t *ctx, uint32_t start_address, const uint8_t *data, uint16_t data_size){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	span.address = start_address;
+	span.size = data_size;
+
+	return ctx_end(ctx, &span, STM32_WRITE, cmd_write(ctx, start_address, data, data_size));
+}
+
+stm32_errors_t stm32_go(stm32_ctx_t *ctx, uint32_t address){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	span.address = address;
+
+	return ctx_end(ctx, &span, STM32_GO, cmd_go(ctx, address));
+}
+
+stm32_errors_t stm32_get_checksum(stm32_ctx_t *ctx, uint32_t start_address, uint32_t size, uint32_t polynomial, uint32_t initial, uint32_t *crc){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	span.address = start_address;
+	span.size = size > 0xFFFF ? 0xFFFF : size;
+
+	return ctx_end(ctx, &span, STM32_GET_CHECKSUM, cmd_get_checksum(ctx, start_address, size, polynomial, initial, crc));
+}
+
+stm32_errors_t stm32_extended_erase(stm32_ctx_t *ctx, const uint16_t *pages, uint16_t pages_size){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	span.size = pages_size;
+
+	return ctx_end(ctx, &span, STM32_EXTENDED_ERASE, cmd_extended_erase(ctx, pages, pages_size));
+}
+
+stm32_errors_t stm32_extended_erase_special(stm32_ctx_t *ctx, stm32_erase_type_t erase_type){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	return ctx_end(ctx, &span, STM32_EXTENDED_ERASE, cmd_extended_erase_special(ctx, erase_type));
+}
+
+stm32_errors_t stm32_write_protect(stm32_ctx_t *ctx, const uint8_t *pages, uint16_t pages_size){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	return ctx_end(ctx, &span, STM32_WRITE_PROTECT, cmd_write_protect(ctx, pages, pages_size));
+}
+
+stm32_errors_t stm32_write_unprotect(stm32_ctx_t *ctx){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	return ctx_end(ctx, &span, STM32_WRITE_UNPROTECT, cmd_write_unprotect(ctx));
+}
+
+stm32_errors_t stm32_readout_protect(stm32_ctx_t *ctx){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	return ctx_end(ctx, &span, STM32_READOUT_PROTECT, cmd_readout_protect(ctx));
+}
+
+stm32_errors_t stm32_readout_unprotect(stm32_ctx_t *ctx){
+
+	ctx_span_t span = ctx_begin(ctx);
+
+	return ctx_end(ctx, &span, STM32_READOUT_UNPROTECT, cmd_readout_unprotect(ctx));
+}
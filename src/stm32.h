@@ -24,6 +24,27 @@
 #define STM32_H_
 
 #include <stdint.h>
+#include "serial.h"
+#include "erase_map.h"
+#include "metrics.h"
+#include "timeline.h"
+
+/* bootloader command opcodes and replies, AN3155 */
+#define STM32_INIT				(uint8_t)0x7F
+#define STM32_ACK				(uint8_t)0x79
+#define STM32_NACK				(uint8_t)0x1F
+#define STM32_GET				(uint8_t)0x00
+#define STM32_GET_RPS			(uint8_t)0x01
+#define STM32_GET_ID			(uint8_t)0x02
+#define STM32_READ				(uint8_t)0x11
+#define STM32_GO				(uint8_t)0x21
+#define STM32_WRITE				(uint8_t)0x31
+#define STM32_EXTENDED_ERASE	(uint8_t)0x44
+#define STM32_WRITE_PROTECT		(uint8_t)0x63
+#define STM32_WRITE_UNPROTECT	(uint8_t)0x73
+#define STM32_READOUT_PROTECT	(uint8_t)0x82
+#define STM32_READOUT_UNPROTECT	(uint8_t)0x92
+#define STM32_GET_CHECKSUM		(uint8_t)0xA1
 
 typedef enum stm32_errors {
 	STM32_ERR_OK,
@@ -31,6 +52,9 @@ typedef enum stm32_errors {
 	STM32_ERR_PROTOCOL,
 	STM32_ERR_INVALID_ARGUMENT,
 	STM32_ERR_RDP,
+	STM32_ERR_SYSTEM,
+	STM32_ERR_CANCELLED,
+	STM32_ERR_TIMEOUT,
 } stm32_errors_t ;
 
 typedef enum stm32_erase_type {
@@ -39,17 +63,65 @@ typedef enum stm32_erase_type {
 	STM32_ERASE_BANK2
 } stm32_erase_type_t ;
 
-stm32_errors_t stm32_init(int fd);
-stm32_errors_t stm32_get(int fd, uint8_t *version, uint8_t **supported_commands, uint8_t *supported_commands_size);
-stm32_errors_t stm32_get_prs(int fd, uint8_t *rpdc, uint8_t *rpec);
-stm32_errors_t stm32_get_id(int fd, uint8_t **device_id, uint8_t *device_id_size);
-stm32_errors_t stm32_read(int fd, uint32_t start_address, uint8_t **data, uint16_t data_size);
-stm32_errors_t stm32_write(int fd, uint32_t start_address, const uint8_t *data, uint16_t data_size);
-stm32_errors_t stm32_extended_erase(int fd, const uint16_t *pages, uint16_t pages_size);
-stm32_errors_t stm32_extended_erase_special(int fd, stm32_erase_type_t erase_type);
-stm32_errors_t stm32_write_protect(int fd, const uint8_t *pages, uint16_t pages_size);
-stm32_errors_t stm32_write_unprotect(int fd);
-stm32_errors_t stm32_readout_protect(int fd);
-stm32_errors_t stm32_readout_unprotect(int fd);
+typedef struct stm32_stats {
+	uint32_t commands;
+	uint32_t nacks;
+	uint64_t bytes_tx;
+	uint64_t bytes_rx;
+} stm32_stats_t ;
+
+/* default deadlines, ms */
+#define STM32_TIMEOUT_ACK		200		/* command, address and short replies */
+#define STM32_TIMEOUT_WRITE		250		/* ACK after a 'write memory' frame, includes programming */
+#define STM32_TIMEOUT_ERASE		500		/* fixed part of erase and option byte ACKs */
+#define STM32_TIMEOUT_ERASE_KB	32		/* added per KiB erased, F4 worst case at x8 parallelism */
+
+#define STM32_RATE_DEFAULT		9600	/* data deadlines assume this rate until stm32_ctx_rate() */
+
+typedef struct stm32_timeouts {
+	uint32_t ack_ms;
+	uint32_t write_ms;
+	uint32_t erase_ms;
+	uint32_t erase_kb_ms;
+	uint32_t byte_us;		/* time on the wire per byte, added to every read */
+} stm32_timeouts_t ;
+
+/* one bootloader session, the only state the commands keep */
+typedef struct stm32_ctx {
+	int fd;
+	serial_io_t io;			/* buffered fd, empty again once a command has completed */
+	const char *tx_phase;	/* timeline name of the gathered frame, set by the last write */
+	const geometry_t *geometry;	/* optional, sizes the erase deadlines, small pages are assumed without it */
+	erase_map_t *erased;	/* optional, kept up to date by erase and write commands */
+	metrics_t *metrics;		/* optional, per-command counters and latency */
+	timeline_t *timeline;	/* optional, command and phase spans */
+	stm32_stats_t stats;
+	stm32_timeouts_t timeouts;
+
+	/* scratch buffers returned by stm32_get(), stm32_get_id() and stm32_read() */
+	uint8_t commands[0xFF];
+	uint8_t id[0x100];		// 0xFF + 1
+	uint8_t response[0x100];	// 0xFF + 1
+} stm32_ctx_t ;
+
+typedef void (*stm32_progress_t)(uint32_t done, uint32_t total, void *arg);
+
+void stm32_ctx_init(stm32_ctx_t *ctx, int fd);
+void stm32_ctx_rate(stm32_ctx_t *ctx, uint32_t rate);
+uint32_t stm32_erase_timeout(const stm32_ctx_t *ctx, const uint16_t *pages, uint16_t pages_size);
+stm32_errors_t stm32_init(stm32_ctx_t *ctx);
+stm32_errors_t stm32_get(stm32_ctx_t *ctx, uint8_t *version, uint8_t **supported_commands, uint8_t *supported_commands_size);
+stm32_errors_t stm32_get_prs(stm32_ctx_t *ctx, uint8_t *rpdc, uint8_t *rpec);
+stm32_errors_t stm32_get_id(stm32_ctx_t *ctx, uint8_t **device_id, uint8_t *device_id_size);
+stm32_errors_t stm32_read(stm32_ctx_t *ctx, uint32_t start_address, uint8_t **data, uint16_t data_size);
+stm32_errors_t stm32_write(stm32_ctx_t *ctx, uint32_t start_address, const uint8_t *data, uint16_t data_size);
+stm32_errors_t stm32_go(stm32_ctx_t *ctx, uint32_t address);
+stm32_errors_t stm32_get_checksum(stm32_ctx_t *ctx, uint32_t start_address, uint32_t size, uint32_t polynomial, uint32_t initial, uint32_t *crc);
+stm32_errors_t stm32_extended_erase(stm32_ctx_t *ctx, const uint16_t *pages, uint16_t pages_size);
+stm32_errors_t stm32_extended_erase_special(stm32_ctx_t *ctx, stm32_erase_type_t erase_type);
+stm32_errors_t stm32_write_protect(stm32_ctx_t *ctx, const uint8_t *pages, uint16_t pages_size);
+stm32_errors_t stm32_write_unprotect(stm32_ctx_t *ctx);
+stm32_errors_t stm32_readout_protect(stm32_ctx_t *ctx);
+stm32_errors_t stm32_readout_unprotect(stm32_ctx_t *ctx);
 
 #endif /* STM32_H_ */
@@ -0,0 +1,557 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "stm32_async.h"
+#include "serial.h"
+#include "clock.h"
+
+#define ASYNC_EVENTS			64
+
+typedef enum async_step_type {
+	STEP_SEND,
+	STEP_ACK,
+	STEP_RECV,
+	STEP_RECV_LEN		/* length byte N, then N + 1 bytes */
+} async_step_type_t ;
+
+static int async_running(const stm32_async_t *op){
+	return op->state == STM32_ASYNC_WANT_READ || op->state == STM32_ASYNC_WANT_WRITE;
+}
+
+static void async_step(stm32_async_t *op, async_step_type_t type, stm32_errors_t nack, uint8_t *buffer, uint16_t size, uint32_t timeout_ms){
+
+	stm32_step_t *step = &op->steps[op->steps_count++];
+
+	step->type = type;
+	step->nack = nack;
+	step->buffer = buffer;
+	step->size = size;
+	step->timeout_ms = timeout_ms;
+}
+
+static void async_ack(stm32_async_t *op, stm32_errors_t nack, uint32_t timeout_ms){
+	async_step(op, STEP_ACK, nack, &op->ack, 1, timeout_ms);
+}
+
+/* bytes read ahead or gathered by ctx->io would be lost or reordered, the ops use the fd directly */
+static int async_buffered(const stm32_ctx_t *ctx){
+	return serial_io_pending(&ctx->io) != 0 || serial_io_gathered(&ctx->io) != 0;
+}
+
+static void async_start(stm32_async_t *op, stm32_ctx_t *ctx, uint8_t command){
+
+	op->ctx = ctx;
+	op->state = STM32_ASYNC_WANT_WRITE;
+	op->result = STM32_ERR_OK;
+	op->command = command;
+	op->address = 0;
+	op->size = 0;
+	op->steps_count = 0;
+	op->step = 0;
+	op->offset = 0;
+	op->deadline_us = 0;
+	op->rx_size = 0;
+
+	op->started_us = ctx->metrics != NULL ? clock_now_us() : 0;
+	op->bytes_tx = ctx->stats.bytes_tx;
+	op->bytes_rx = ctx->stats.bytes_rx;
+}
+
+static void async_metrics(stm32_async_t *op){
+
+	stm32_ctx_t *ctx = op->ctx;
+	metrics_outcome_t outcome = METRICS_FAILED;
+
+	if (ctx->metrics == NULL)
+		return;
+
+	if (op->result == STM32_ERR_OK)
+		outcome = METRICS_OK;
+	else if (op->result == STM32_ERR_TIMEOUT)
+		outcome = METRICS_TIMEOUT;
+
+	metrics_record(ctx->metrics, op->command, outcome, clock_now_us() - op->started_us,
+		ctx->stats.bytes_tx - op->bytes_tx, ctx->stats.bytes_rx - op->bytes_rx);
+}
+
+/* command byte with its complement, answered by ACK or by a NACK reported as nack */
+static void async_command(stm32_async_t *op, stm32_errors_t nack){
+
+	op->tx[0] = op->command;
+	op->tx[1] = op->command ^ 0xFF;
+
+	op->ctx->stats.commands++;
+
+	async_step(op, STEP_SEND, STM32_ERR_OK, op->tx, 2, op->ctx->timeouts.ack_ms);
+	async_ack(op, nack, op->ctx->timeouts.ack_ms);
+}
+
+static void async_address(stm32_async_t *op, uint32_t address){
+
+	uint8_t *buffer = op->tx + 2;
+
+	buffer[0] = (address >> 24) & 0xFF;
+	buffer[1] = (address >> 16) & 0xFF;
+	buffer[2] = (address >> 8) & 0xFF;
+	buffer[3] = (address >> 0) & 0xFF;
+	buffer[4] = buffer[0] ^ buffer[1] ^ buffer[2] ^ buffer[3];
+
+	op->address = address;
+
+	async_step(op, STEP_SEND, STM32_ERR_OK, buffer, 5, op->ctx->timeouts.ack_ms);
+	async_ack(op, STM32_ERR_INVALID_ARGUMENT, op->ctx->timeouts.ack_ms);
+}
+
+static stm32_async_state_t async_fail(stm32_async_t *op, stm32_errors_t result){
+
+	op->state = STM32_ASYNC_FAILED;
+	op->result = result;
+
+	async_metrics(op);
+
+	return op->state;
+}
+
+static void async_complete(stm32_async_t *op){
+
+	stm32_ctx_t *ctx = op->ctx;
+
+	op->state = STM32_ASYNC_DONE;
+	op->result = STM32_ERR_OK;
+
+	async_metrics(op);
+
+	if (ctx->erased == NULL)
+		return;
+
+	if (op->command == STM32_WRITE)
+		erase_map_written(ctx->erased, op->address, op->size);
+
+	/* pages are read back from the frame, the caller's list may be gone */
+	if (op->command == STM32_EXTENDED_ERASE){
+
+		uint16_t i = 0;
+
+		for(i = 0; i < op->size; i++){
+			uint16_t page = (op->tx[4 + i * 2] << 8) | op->tx[5 + i * 2];
+			erase_map_pages(ctx->erased, &page, 1);
+		}
+	}
+}
+
+stm32_errors_t stm32_async_init(stm32_async_t *op, stm32_ctx_t *ctx){
+
+	if (op == NULL || ctx == NULL || async_buffered(ctx))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	async_start(op, ctx, STM32_INIT);
+
+	op->tx[0] = STM32_INIT;
+
+	async_step(op, STEP_SEND, STM32_ERR_OK, op->tx, 1, op->ctx->timeouts.ack_ms);
+	async_ack(op, STM32_ERR_PROTOCOL, op->ctx->timeouts.ack_ms);
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_async_get(stm32_async_t *op, stm32_ctx_t *ctx){
+
+	if (op == NULL || ctx == NULL || async_buffered(ctx))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	async_start(op, ctx, STM32_GET);
+	async_command(op, STM32_ERR_PROTOCOL);
+	async_step(op, STEP_RECV_LEN, STM32_ERR_OK, &op->length, 1, op->ctx->timeouts.ack_ms);
+	async_ack(op, STM32_ERR_PROTOCOL, op->ctx->timeouts.ack_ms);
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_async_get_id(stm32_async_t *op, stm32_ctx_t *ctx){
+
+	if (op == NULL || ctx == NULL || async_buffered(ctx))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	async_start(op, ctx, STM32_GET_ID);
+	async_command(op, STM32_ERR_PROTOCOL);
+	async_step(op, STEP_RECV_LEN, STM32_ERR_OK, &op->length, 1, op->ctx->timeouts.ack_ms);
+	async_ack(op, STM32_ERR_PROTOCOL, op->ctx->timeouts.ack_ms);
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_async_read(stm32_async_t *op, stm32_ctx_t *ctx, uint32_t start_address, uint16_t data_size){
+
+	if (op == NULL || ctx == NULL || async_buffered(ctx))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if(data_size == 0 || data_size > 0x100)	//0xFF + 1
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	async_start(op, ctx, STM32_READ);
+	async_command(op, STM32_ERR_RDP);
+	async_address(op, start_address);
+
+	op->size = data_size;
+	op->tx[7] = data_size - 1;
+	op->tx[8] = op->tx[7] ^ 0xFF;
+
+	async_step(op, STEP_SEND, STM32_ERR_OK, op->tx + 7, 2, op->ctx->timeouts.ack_ms);
+	async_ack(op, STM32_ERR_RDP, op->ctx->timeouts.ack_ms);
+	async_step(op, STEP_RECV, STM32_ERR_OK, op->rx, data_size, op->ctx->timeouts.ack_ms);
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_async_write(stm32_async_t *op, stm32_ctx_t *ctx, uint32_t start_address, const uint8_t *data, uint16_t data_size){
+
+	if (op == NULL || ctx == NULL || data == NULL || async_buffered(ctx))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if(data_size == 0 || data_size > 0x100)	//0xFF + 1
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	/* check for align */
+	if((start_address % 4) != 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	async_start(op, ctx, STM32_WRITE);
+	async_command(op, STM32_ERR_RDP);
+	async_address(op, start_address);
+
+	/* data is copied into the frame, the caller's buffer is free once this returns */
+	uint8_t *frame = op->tx + 7;
+	uint8_t check_summ = data_size - 1;
+	uint16_t i = 0;
+
+	frame[0] = data_size - 1;
+
+	for(i = 0; i < data_size; i++){
+		frame[i + 1] = data[i];
+		check_summ ^= data[i];
+	}
+	frame[i + 1] = check_summ;
+
+	op->size = data_size;
+
+	async_step(op, STEP_SEND, STM32_ERR_OK, frame, data_size + 2, op->ctx->timeouts.ack_ms);
+	async_ack(op, STM32_ERR_PROTOCOL, op->ctx->timeouts.write_ms);
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_async_extended_erase(stm32_async_t *op, stm32_ctx_t *ctx, const uint16_t *pages, uint16_t pages_size){
+
+	if (op == NULL || ctx == NULL || pages == NULL || async_buffered(ctx))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	/* one frame only, longer lists are split by the caller */
+	if(pages_size == 0 || pages_size > 0x100)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	async_start(op, ctx, STM32_EXTENDED_ERASE);
+	async_command(op, STM32_ERR_RDP);
+
+	uint8_t *frame = op->tx + 2;
+	uint8_t check_summ = 0;
+	uint16_t len = 0;
+	uint16_t i = 0;
+
+	frame[len++] = ((pages_size - 1) >> 8) & 0xFF;
+	frame[len++] = ((pages_size - 1) >> 0) & 0xFF;
+
+	for(i = 0; i < pages_size; i++){
+		frame[len++] = (pages[i] >> 8) & 0xFF;
+		frame[len++] = (pages[i] >> 0) & 0xFF;
+	}
+
+	for(i = 0; i < len; i++)
+		check_summ ^= frame[i];
+
+	frame[len++] = check_summ;
+
+	op->size = pages_size;
+
+	async_step(op, STEP_SEND, STM32_ERR_OK, frame, len, op->ctx->timeouts.ack_ms);
+	async_ack(op, STM32_ERR_PROTOCOL, stm32_erase_timeout(ctx, pages, pages_size));
+
+	return STM32_ERR_OK;
+}
+
+/* moves the op as far as the port allows without blocking */
+stm32_async_state_t stm32_async_resume(stm32_async_t *op){
+
+	int fd = op->ctx->fd;
+
+	while(async_running(op)){
+
+		if (op->step == op->steps_count){
+			async_complete(op);
+			break;
+		}
+
+		stm32_step_t *step = &op->steps[op->step];
+		int r = 0;
+
+		/* the step's deadline runs from its first attempt, see stm32_async_run() */
+		if (op->deadline_us == 0)
+			op->deadline_us = clock_now_us() + step->timeout_ms * 1000ULL + (uint64_t)step->size * op->ctx->timeouts.byte_us;
+
+		/* never ask for more than the step needs, the next response must stay in the port */
+		if (step->type == STEP_SEND){
+
+			r = serial_write_some(fd, step->buffer + op->offset, step->size - op->offset);
+
+			if (r == 0)
+				op->state = STM32_ASYNC_WANT_WRITE;
+			else if (r > 0)
+				op->ctx->stats.bytes_tx += r;
+
+		} else {
+
+			r = serial_read_some(fd, step->buffer + op->offset, step->size - op->offset);
+
+			if (r == 0)
+				op->state = STM32_ASYNC_WANT_READ;
+			else if (r > 0)
+				op->ctx->stats.bytes_rx += r;
+		}
+
+		if (r < 0)
+			return async_fail(op, STM32_ERR_SERIAL);
+
+		if (r == 0)
+			break;
+
+		op->offset += r;
+
+		if (op->offset < step->size)
+			continue;
+
+		op->offset = 0;
+		op->deadline_us = 0;
+
+		switch(step->type){
+
+			case STEP_ACK:
+
+				/* the second step is the reply to the command byte */
+				if (op->step == 1 && op->command != STM32_INIT && op->ctx->metrics != NULL && (op->ack == STM32_ACK || op->ack == STM32_NACK))
+					metrics_ack(op->ctx->metrics, op->command, op->ack == STM32_ACK);
+
+				if (op->ack == STM32_NACK){
+					op->ctx->stats.nacks++;
+					return async_fail(op, step->nack);
+				}
+
+				if (op->ack != STM32_ACK)
+					return async_fail(op, STM32_ERR_PROTOCOL);
+
+				break;
+
+			case STEP_RECV_LEN:
+
+				/* same step again, now for the payload */
+				step->type = STEP_RECV;
+				step->buffer = op->rx;
+				step->size = op->length + 1;
+				op->rx_size = step->size;
+				continue;
+
+			case STEP_RECV:
+				op->rx_size = step->size;
+				break;
+		}
+
+		op->step++;
+	}
+
+	return op->state;
+}
+
+/* abandons the op, the target may be mid-command and needs a flush and 'init' before reuse */
+void stm32_async_cancel(stm32_async_t *op){
+
+	if (async_running(op))
+		async_fail(op, STM32_ERR_CANCELLED);
+}
+
+/* SERIAL_POLL_* bits the op is waiting for, 0 once it has ended */
+int stm32_async_events(const stm32_async_t *op){
+
+	switch(op->state){
+		case STM32_ASYNC_WANT_READ : return SERIAL_POLL_READ;
+		case STM32_ASYNC_WANT_WRITE: return SERIAL_POLL_WRITE;
+		default:
+			return 0;
+	}
+}
+
+/* resumes until the op waits on the port or ends without a follow-up */
+static void async_settle(stm32_async_t *op){
+
+	while(1){
+
+		stm32_async_resume(op);
+
+		if (async_running(op))
+			return;
+
+		if (op->done == NULL || op->done(op, op->done_arg) == 0 || !async_running(op))
+			return;
+	}
+}
+
+static uint32_t async_abort(int poll_fd, stm32_async_t *const *ops, uint32_t ops_count, stm32_errors_t result){
+
+	uint32_t failed = 0;
+	uint32_t i = 0;
+
+	for(i = 0; i < ops_count; i++){
+
+		if (!async_running(ops[i]))
+			continue;
+
+		serial_poll_remove(poll_fd, ops[i]->ctx->fd);
+		async_fail(ops[i], result);
+
+		if (ops[i]->done != NULL)
+			ops[i]->done(ops[i], ops[i]->done_arg);
+
+		failed++;
+	}
+
+	return failed;
+}
+
+/* ms until the nearest step deadline of the running ops, -1 when none is armed */
+static int async_wait_ms(stm32_async_t *const *ops, uint32_t ops_count){
+
+	uint64_t now = clock_now_us();
+	uint64_t nearest = 0;
+	uint32_t i = 0;
+
+	for(i = 0; i < ops_count; i++)
+		if (async_running(ops[i]) && ops[i]->deadline_us != 0 && (nearest == 0 || ops[i]->deadline_us < nearest))
+			nearest = ops[i]->deadline_us;
+
+	if (nearest == 0)
+		return -1;
+
+	return nearest > now ? (int)((nearest - now + 999) / 1000) : 0;
+}
+
+/*
+ * Drives started ops, one per port, from a single thread until all of them have ended.
+ * Ports must be non-blocking (serial_nonblock()). An op whose current step outlives
+ * its deadline (an ACK, write or erase deadline from ctx->timeouts) fails alone with
+ * STM32_ERR_TIMEOUT, the others keep running. Returns the number of failed ops, -1
+ * when polling itself fails.
+ */
+int stm32_async_run(int poll_fd, stm32_async_t *const *ops, uint32_t ops_count){
+
+	serial_event_t events[ASYNC_EVENTS];
+	uint32_t active = 0;
+	uint32_t failed = 0;
+	uint32_t i = 0;
+
+	if (poll_fd < 0 || (ops == NULL && ops_count > 0))
+		return -1;
+
+	for(i = 0; i < ops_count; i++){
+
+		stm32_async_t *op = ops[i];
+
+		async_settle(op);
+
+		if (!async_running(op)){
+			failed += op->state == STM32_ASYNC_FAILED;
+			continue;
+		}
+
+		if (serial_poll_add(poll_fd, op->ctx->fd, stm32_async_events(op), op) != SERIAL_ERR_OK){
+			async_fail(op, STM32_ERR_SYSTEM);
+			failed++;
+			continue;
+		}
+
+		active++;
+	}
+
+	while(active > 0){
+
+		int count = serial_poll_wait(poll_fd, events, ASYNC_EVENTS, async_wait_ms(ops, ops_count));
+
+		if (count < 0){
+			async_abort(poll_fd, ops, ops_count, STM32_ERR_CANCELLED);
+			return -1;
+		}
+
+		int e = 0;
+
+		for(e = 0; e < count; e++){
+
+			stm32_async_t *op = events[e].data;
+
+			async_settle(op);
+
+			if (async_running(op)){
+				serial_poll_modify(poll_fd, op->ctx->fd, stm32_async_events(op), op);
+				continue;
+			}
+
+			serial_poll_remove(poll_fd, op->ctx->fd);
+			failed += op->state == STM32_ASYNC_FAILED;
+			active--;
+		}
+
+		uint64_t now = clock_now_us();
+
+		/* expired ops end here, their done callback may start a follow-up */
+		for(i = 0; i < ops_count; i++){
+
+			stm32_async_t *op = ops[i];
+
+			if (!async_running(op) || op->deadline_us == 0 || now < op->deadline_us)
+				continue;
+
+			async_fail(op, STM32_ERR_TIMEOUT);
+
+			if (op->done != NULL && op->done(op, op->done_arg) != 0 && async_running(op))
+				async_settle(op);
+
+			if (async_running(op)){
+				serial_poll_modify(poll_fd, op->ctx->fd, stm32_async_events(op), op);
+				continue;
+			}
+
+			serial_poll_remove(poll_fd, op->ctx->fd);
+			failed += op->state == STM32_ASYNC_FAILED;
+			active--;
+		}
+	}
+
+	return failed;
+}
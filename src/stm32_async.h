@@ -0,0 +1,103 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef STM32_ASYNC_H_
+#define STM32_ASYNC_H_
+
+#include <stdint.h>
+#include "stm32.h"
+
+#define STM32_ASYNC_STEPS	8
+#define STM32_ASYNC_TX_SIZE	(2 + 5 + 2 + 0x100 * 2 + 1)	/* command, address and largest erase frame */
+
+typedef enum stm32_async_state {
+	STM32_ASYNC_WANT_READ,
+	STM32_ASYNC_WANT_WRITE,
+	STM32_ASYNC_DONE,
+	STM32_ASYNC_FAILED
+} stm32_async_state_t ;
+
+/* one exchange of a bootloader command */
+typedef struct stm32_step {
+	uint8_t type;
+	uint8_t nack;		/* stm32_errors_t reported when an ACK step gets a NACK */
+	uint16_t size;
+	uint8_t *buffer;
+	uint32_t timeout_ms;	/* target reaction, the transfer time of size bytes is added on top */
+} stm32_step_t ;
+
+struct stm32_async;
+
+/* called when an operation ends, may start another one on the same op and return non-zero to keep it running */
+typedef int (*stm32_async_done_t)(struct stm32_async *op, void *arg);
+
+/* bootloader command as a resumable state machine, never blocks on the port */
+typedef struct stm32_async {
+	stm32_ctx_t *ctx;
+	stm32_async_state_t state;
+	stm32_errors_t result;
+
+	uint8_t command;
+	uint32_t address;
+	uint16_t size;
+
+	stm32_step_t steps[STM32_ASYNC_STEPS];
+	uint8_t steps_count;
+	uint8_t step;
+	uint16_t offset;		/* progress inside the current step */
+	uint64_t deadline_us;	/* of the current step, 0 until it has started */
+
+	uint8_t ack;
+	uint8_t length;
+	uint8_t tx[STM32_ASYNC_TX_SIZE];
+
+	/* response of 'read memory', 'get' (version, then commands) and 'get id' */
+	uint8_t rx[0x101];
+	uint16_t rx_size;
+
+	/* metrics span */
+	uint64_t started_us;
+	uint64_t bytes_tx;
+	uint64_t bytes_rx;
+
+	stm32_async_done_t done;
+	void *done_arg;
+} stm32_async_t ;
+
+/*
+ * The ops read and write ctx->fd directly and bypass ctx->io. Switching a context
+ * from the blocking commands over takes serial_io_discard(&ctx->io) first, the
+ * stm32_async_*() starters refuse a context with bytes still read ahead or gathered.
+ */
+stm32_errors_t stm32_async_init(stm32_async_t *op, stm32_ctx_t *ctx);
+stm32_errors_t stm32_async_get(stm32_async_t *op, stm32_ctx_t *ctx);
+stm32_errors_t stm32_async_get_id(stm32_async_t *op, stm32_ctx_t *ctx);
+stm32_errors_t stm32_async_read(stm32_async_t *op, stm32_ctx_t *ctx, uint32_t start_address, uint16_t data_size);
+stm32_errors_t stm32_async_write(stm32_async_t *op, stm32_ctx_t *ctx, uint32_t start_address, const uint8_t *data, uint16_t data_size);
+stm32_errors_t stm32_async_extended_erase(stm32_async_t *op, stm32_ctx_t *ctx, const uint16_t *pages, uint16_t pages_size);
+
+stm32_async_state_t stm32_async_resume(stm32_async_t *op);
+void stm32_async_cancel(stm32_async_t *op);
+int stm32_async_events(const stm32_async_t *op);
+int stm32_async_run(int poll_fd, stm32_async_t *const *ops, uint32_t ops_count);
+
+#endif /* STM32_ASYNC_H_ */
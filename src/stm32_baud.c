@@ -0,0 +1,218 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "stm32.h"
+#include "stm32_baud.h"
+#include "serial.h"
+#include "crc32.h"
+
+#define STM32_BAUD_LINE	512
+
+static const uint32_t default_rates[] = {
+	1000000, 921600, 576000, 460800, 230400, 115200, 57600
+};
+
+static uint32_t baud_cache_load(const char *path, const char *device){
+
+	char line[STM32_BAUD_LINE];
+	char name[STM32_BAUD_LINE];
+	unsigned long rate = 0;
+
+	FILE *file = fopen(path, "r");
+
+	if (file == NULL)
+		return 0;
+
+	while(fgets(line, sizeof(line), file) != NULL){
+		if (sscanf(line, "%511s %lu", name, &rate) == 2 && strcmp(name, device) == 0){
+			fclose(file);
+			return rate;
+		}
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+static void baud_cache_save(const char *path, const char *device, uint32_t rate){
+
+	char line[STM32_BAUD_LINE];
+	char name[STM32_BAUD_LINE];
+	char tmp[STM32_BAUD_LINE];
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return;
+
+	FILE *out = fopen(tmp, "w");
+
+	if (out == NULL)
+		return;
+
+	/* keep the other ports, replace ours */
+	FILE *in = fopen(path, "r");
+
+	if (in != NULL){
+		while(fgets(line, sizeof(line), in) != NULL)
+			if (sscanf(line, "%511s", name) == 1 && strcmp(name, device) != 0)
+				fputs(line, out);
+
+		fclose(in);
+	}
+
+	fprintf(out, "%s %lu\n", device, (unsigned long)rate);
+
+	if (fclose(out) == 0)
+		rename(tmp, path);
+	else
+		remove(tmp);
+}
+
+static stm32_errors_t baud_verify(stm32_ctx_t *ctx, const stm32_autobaud_t *autobaud){
+
+	uint8_t version[2];
+	uint8_t *commands;
+	uint8_t commands_size[2];
+	uint8_t first[0xFF];
+	uint32_t crc[2];
+	int i = 0;
+
+	/* two identical answers make a marginal rate very unlikely to pass */
+	for(i = 0; i < 2; i++){
+
+		stm32_errors_t result = stm32_get(ctx, &version[i], &commands, &commands_size[i]);
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		if (i == 0)
+			memcpy(first, commands, commands_size[0]);
+		else if (version[0] != version[1] || commands_size[0] != commands_size[1] || memcmp(first, commands, commands_size[0]) != 0)
+			return STM32_ERR_PROTOCOL;
+	}
+
+	if (autobaud->verify_skip)
+		return STM32_ERR_OK;
+
+	uint32_t address = autobaud->verify_address ? autobaud->verify_address : STM32_BAUD_VERIFY_ADDRESS;
+	uint16_t size = autobaud->verify_size ? autobaud->verify_size : STM32_BAUD_VERIFY_SIZE;
+
+	/* the same block read and checksummed twice, a marginal rate garbles one of them */
+	for(i = 0; i < 2; i++){
+
+		uint8_t *data;
+		stm32_errors_t result = stm32_read(ctx, address, &data, size);
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		crc[i] = crc32_update(0, data, size);
+	}
+
+	return crc[0] == crc[1] ? STM32_ERR_OK : STM32_ERR_PROTOCOL;
+}
+
+static stm32_errors_t baud_try(stm32_ctx_t *ctx, const stm32_autobaud_t *autobaud, uint32_t rate){
+
+	/* the bootloader frames are 8 data bits, even parity, one stop bit */
+	if (
+		serial_setup(ctx->fd, SERIAL_BAUD_115200, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOP_BITS_1) != SERIAL_ERR_OK ||
+		serial_set_rate(ctx->fd, rate) != SERIAL_ERR_OK
+	)
+		return STM32_ERR_SERIAL;
+
+	stm32_ctx_rate(ctx, rate);
+
+	if (autobaud->reset != NULL)
+		autobaud->reset(ctx->fd, autobaud->reset_arg);
+
+	serial_io_discard(&ctx->io);
+
+	stm32_errors_t result = stm32_init(ctx);
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	return baud_verify(ctx, autobaud);
+}
+
+/* rates baud_try() would be called with */
+static uint32_t baud_candidates(const uint32_t *rates, uint32_t rates_count, uint32_t remembered){
+
+	uint32_t count = remembered != 0;
+	uint32_t i = 0;
+
+	for(i = 0; i < rates_count; i++)
+		count += rates[i] != remembered;
+
+	return count;
+}
+
+stm32_errors_t stm32_autobaud(stm32_ctx_t *ctx, stm32_autobaud_t *autobaud){
+
+	stm32_errors_t result = STM32_ERR_PROTOCOL;
+	uint32_t remembered = 0;
+	uint32_t i = 0;
+
+	if (ctx == NULL || autobaud == NULL)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	const uint32_t *rates = autobaud->rates ? autobaud->rates : default_rates;
+	uint32_t rates_count = autobaud->rates ? autobaud->rates_count : sizeof(default_rates) / sizeof(default_rates[0]);
+
+	autobaud->rate = 0;
+
+	/* the last winner on this port usually still works */
+	if (autobaud->cache_path != NULL && autobaud->device != NULL)
+		remembered = baud_cache_load(autobaud->cache_path, autobaud->device);
+
+	/* without a reset every later rate talks to a bootloader locked onto the first */
+	if (autobaud->reset == NULL && baud_candidates(rates, rates_count, remembered) > 1)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if (remembered != 0 && (result = baud_try(ctx, autobaud, remembered)) == STM32_ERR_OK){
+		autobaud->rate = remembered;
+		return STM32_ERR_OK;
+	}
+
+	for(i = 0; i < rates_count; i++){
+
+		if (rates[i] == remembered)
+			continue;
+
+		result = baud_try(ctx, autobaud, rates[i]);
+
+		if (result == STM32_ERR_OK){
+			autobaud->rate = rates[i];
+			break;
+		}
+	}
+
+	if (autobaud->rate != 0 && autobaud->rate != remembered && autobaud->cache_path != NULL && autobaud->device != NULL)
+		baud_cache_save(autobaud->cache_path, autobaud->device, autobaud->rate);
+
+	return result;
+}
@@ -0,0 +1,52 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef STM32_BAUD_H_
+#define STM32_BAUD_H_
+
+#include <stdint.h>
+#include "stm32.h"
+
+#define STM32_BAUD_VERIFY_ADDRESS	0x08000000	/* start of flash on every part */
+#define STM32_BAUD_VERIFY_SIZE		0x100
+
+/* bring the target back into a fresh bootloader, e.g. by toggling DTR/RTS */
+typedef void (*stm32_reset_t)(int fd, void *arg);
+
+typedef struct stm32_autobaud {
+	const uint32_t *rates;		/* candidates, fastest first; NULL for the default list */
+	uint32_t rates_count;
+	stm32_reset_t reset;		/* the bootloader locks onto the first rate it sees, required with more than one candidate */
+	void *reset_arg;
+	uint32_t verify_address;	/* block read twice to validate a rate, STM32_BAUD_VERIFY_ADDRESS when 0 */
+	uint16_t verify_size;		/* up to 0x100, STM32_BAUD_VERIFY_SIZE when 0 */
+	uint8_t verify_skip;		/* only compare two 'get' replies, e.g. under readout protection */
+	const char *cache_path;		/* file remembering the winner per port, may be NULL */
+	const char *device;			/* port name used as the cache key */
+
+	/* filled in by stm32_autobaud() */
+	uint32_t rate;
+} stm32_autobaud_t ;
+
+stm32_errors_t stm32_autobaud(stm32_ctx_t *ctx, stm32_autobaud_t *autobaud);
+
+#endif /* STM32_BAUD_H_ */
@@ -0,0 +1,301 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "stm32.h"
+#include "stm32_cache.h"
+#include "geometry.h"
+#include "sha256.h"
+
+#define STM32_CACHE_MAGIC	"STM32PHC"
+#define STM32_CACHE_VERSION	1
+
+typedef struct uid_location {
+	uint16_t pid;
+	uint32_t address;
+} uid_location_t ;
+
+static const uid_location_t uid_locations[] = {
+	/* F1 */
+	{ 0x410, 0x1FFFF7E8 }, { 0x412, 0x1FFFF7E8 }, { 0x414, 0x1FFFF7E8 }, { 0x418, 0x1FFFF7E8 },
+	{ 0x420, 0x1FFFF7E8 }, { 0x428, 0x1FFFF7E8 }, { 0x430, 0x1FFFF7E8 },
+	/* F0, F3 */
+	{ 0x440, 0x1FFFF7AC }, { 0x442, 0x1FFFF7AC }, { 0x444, 0x1FFFF7AC }, { 0x445, 0x1FFFF7AC },
+	{ 0x448, 0x1FFFF7AC }, { 0x422, 0x1FFFF7AC }, { 0x432, 0x1FFFF7AC }, { 0x438, 0x1FFFF7AC },
+	{ 0x439, 0x1FFFF7AC }, { 0x446, 0x1FFFF7AC },
+	/* F2, F4 */
+	{ 0x411, 0x1FFF7A10 }, { 0x413, 0x1FFF7A10 }, { 0x419, 0x1FFF7A10 }, { 0x421, 0x1FFF7A10 },
+	{ 0x423, 0x1FFF7A10 }, { 0x431, 0x1FFF7A10 }, { 0x433, 0x1FFF7A10 }, { 0x434, 0x1FFF7A10 },
+	{ 0x441, 0x1FFF7A10 }, { 0x458, 0x1FFF7A10 }, { 0x463, 0x1FFF7A10 },
+	/* F7 */
+	{ 0x449, 0x1FF0F420 }, { 0x451, 0x1FF0F420 }, { 0x452, 0x1FF0F420 },
+	/* L4, G0, G4 */
+	{ 0x415, 0x1FFF7590 }, { 0x435, 0x1FFF7590 }, { 0x461, 0x1FFF7590 }, { 0x462, 0x1FFF7590 },
+	{ 0x464, 0x1FFF7590 }, { 0x470, 0x1FFF7590 }, { 0x460, 0x1FFF7590 }, { 0x466, 0x1FFF7590 },
+	{ 0x467, 0x1FFF7590 }, { 0x468, 0x1FFF7590 }, { 0x469, 0x1FFF7590 },
+	/* H7 */
+	{ 0x450, 0x1FF1E800 },
+};
+
+static void put_le(uint8_t *buffer, uint32_t value, int size){
+
+	int i = 0;
+
+	for(i = 0; i < size; i++)
+		buffer[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static uint32_t get_le(const uint8_t *buffer, int size){
+
+	uint32_t value = 0;
+	int i = 0;
+
+	for(i = size - 1; i >= 0; i--)
+		value = (value << 8) | buffer[i];
+
+	return value;
+}
+
+/* header: magic, version, pid, uid, flash size, pages count, entries count */
+#define STM32_CACHE_HEADER	(8 + 4 + 2 + STM32_UID_SIZE + 4 + 4 + 4)
+#define STM32_CACHE_ENTRY	(2 + SHA256_DIGEST_SIZE)
+
+static void stm32_cache_load(stm32_cache_t *cache){
+
+	uint8_t header[STM32_CACHE_HEADER];
+	uint8_t entry[STM32_CACHE_ENTRY];
+
+	FILE *file = fopen(cache->path, "rb");
+
+	if (file == NULL)
+		return;
+
+	/* a cache that does not match the device is simply ignored */
+	if (
+		fread(header, sizeof(header), 1, file) != 1 ||
+		memcmp(header, STM32_CACHE_MAGIC, 8) != 0 ||
+		get_le(header + 8, 4) != STM32_CACHE_VERSION ||
+		get_le(header + 12, 2) != cache->pid ||
+		memcmp(header + 14, cache->uid, STM32_UID_SIZE) != 0 ||
+		get_le(header + 14 + STM32_UID_SIZE, 4) != cache->flash_size ||
+		get_le(header + 18 + STM32_UID_SIZE, 4) != cache->pages_count
+	){
+		fclose(file);
+		return;
+	}
+
+	uint32_t entries = get_le(header + 22 + STM32_UID_SIZE, 4);
+
+	while(entries-- > 0 && fread(entry, sizeof(entry), 1, file) == 1){
+
+		uint16_t page = get_le(entry, 2);
+
+		if (page < cache->pages_count)
+			stm32_cache_store(cache, page, entry + 2);
+	}
+
+	fclose(file);
+}
+
+uint32_t stm32_uid_address(uint16_t pid){
+
+	uint32_t i = 0;
+
+	for(i = 0; i < sizeof(uid_locations) / sizeof(uid_locations[0]); i++)
+		if (uid_locations[i].pid == pid)
+			return uid_locations[i].address;
+
+	return 0;
+}
+
+/* product ID and 96-bit unique ID, the key of every per-device file */
+stm32_errors_t stm32_identify(stm32_ctx_t *ctx, uint32_t uid_address, uint16_t *pid, uint8_t *uid){
+
+	uint8_t *device_id;
+	uint8_t device_id_size;
+	uint8_t *data;
+
+	stm32_errors_t result = stm32_get_id(ctx, &device_id, &device_id_size);
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	if (device_id_size < 2)
+		return STM32_ERR_PROTOCOL;
+
+	*pid = (device_id[0] << 8) | device_id[1];
+
+	if (uid_address == 0)
+		uid_address = stm32_uid_address(*pid);
+
+	if (uid_address == 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	result = stm32_read(ctx, uid_address, &data, STM32_UID_SIZE);
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	memcpy(uid, data, STM32_UID_SIZE);
+
+	return STM32_ERR_OK;
+}
+
+/* <dir>/<pid>-<uid>.<suffix> */
+int stm32_device_path(char *path, size_t size, const char *dir, uint16_t pid, const uint8_t *uid, const char *suffix){
+
+	char uid_hex[STM32_UID_SIZE * 2 + 1];
+	int i = 0;
+
+	for(i = 0; i < STM32_UID_SIZE; i++)
+		sprintf(uid_hex + i * 2, "%02x", uid[i]);
+
+	int len = snprintf(path, size, "%s/%03x-%s.%s", dir, pid, uid_hex, suffix);
+
+	return len < 0 || len >= (int)size ? -1 : 0;
+}
+
+stm32_errors_t stm32_cache_open(stm32_ctx_t *ctx, stm32_cache_t *cache, const char *dir, const geometry_t *geometry, uint32_t uid_address){
+
+	if (cache == NULL || dir == NULL || geometry == NULL)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	memset(cache, 0, sizeof(stm32_cache_t));
+
+	/* the cache is keyed by product ID and unique device ID */
+	stm32_errors_t result = stm32_identify(ctx, uid_address, &cache->pid, cache->uid);
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	if (stm32_device_path(cache->path, sizeof(cache->path), dir, cache->pid, cache->uid, "cache") != 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	cache->flash_size = geometry_size(geometry);
+	cache->pages_count = geometry_pages(geometry);
+	cache->valid = calloc(cache->pages_count, 1);
+	cache->hashes = calloc(cache->pages_count, SHA256_DIGEST_SIZE);
+
+	if (cache->valid == NULL || cache->hashes == NULL){
+		stm32_cache_close(cache);
+		return STM32_ERR_SYSTEM;
+	}
+
+	stm32_cache_load(cache);
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_cache_save(stm32_cache_t *cache){
+
+	uint8_t header[STM32_CACHE_HEADER];
+	uint8_t entry[STM32_CACHE_ENTRY];
+	char path[PATH_MAX + 4];
+	uint32_t entries = 0;
+	uint32_t i = 0;
+
+	for(i = 0; i < cache->pages_count; i++)
+		entries += cache->valid[i];
+
+	memcpy(header, STM32_CACHE_MAGIC, 8);
+	put_le(header + 8, STM32_CACHE_VERSION, 4);
+	put_le(header + 12, cache->pid, 2);
+	memcpy(header + 14, cache->uid, STM32_UID_SIZE);
+	put_le(header + 14 + STM32_UID_SIZE, cache->flash_size, 4);
+	put_le(header + 18 + STM32_UID_SIZE, cache->pages_count, 4);
+	put_le(header + 22 + STM32_UID_SIZE, entries, 4);
+
+	/* write aside and rename, so a crash never leaves a torn cache */
+	snprintf(path, sizeof(path), "%s.tmp", cache->path);
+
+	FILE *file = fopen(path, "wb");
+
+	if (file == NULL)
+		return STM32_ERR_SYSTEM;
+
+	int failed = fwrite(header, sizeof(header), 1, file) != 1;
+
+	for(i = 0; i < cache->pages_count && !failed; i++){
+
+		if (!cache->valid[i])
+			continue;
+
+		put_le(entry, i, 2);
+		memcpy(entry + 2, cache->hashes[i], SHA256_DIGEST_SIZE);
+
+		failed = fwrite(entry, sizeof(entry), 1, file) != 1;
+	}
+
+	failed |= fflush(file) != 0 || fsync(fileno(file)) != 0;
+	failed |= fclose(file) != 0;
+
+	if (failed || rename(path, cache->path) != 0){
+		unlink(path);
+		return STM32_ERR_SYSTEM;
+	}
+
+	return STM32_ERR_OK;
+}
+
+void stm32_cache_close(stm32_cache_t *cache){
+
+	if (cache == NULL)
+		return;
+
+	free(cache->valid);
+	free(cache->hashes);
+
+	cache->valid = NULL;
+	cache->hashes = NULL;
+	cache->pages_count = 0;
+}
+
+void stm32_cache_clear(stm32_cache_t *cache){
+	memset(cache->valid, 0, cache->pages_count);
+}
+
+int stm32_cache_lookup(const stm32_cache_t *cache, uint16_t page, const uint8_t *hash){
+
+	if (page >= cache->pages_count || !cache->valid[page])
+		return -1;
+
+	return memcmp(cache->hashes[page], hash, SHA256_DIGEST_SIZE) == 0;
+}
+
+void stm32_cache_store(stm32_cache_t *cache, uint16_t page, const uint8_t *hash){
+
+	if (page >= cache->pages_count)
+		return;
+
+	memcpy(cache->hashes[page], hash, SHA256_DIGEST_SIZE);
+	cache->valid[page] = 1;
+}
+
+void stm32_cache_forget(stm32_cache_t *cache, uint16_t page){
+
+	if (page < cache->pages_count)
+		cache->valid[page] = 0;
+}
@@ -0,0 +1,58 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef STM32_CACHE_H_
+#define STM32_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include "stm32.h"
+#include "geometry.h"
+#include "sha256.h"
+
+#define STM32_UID_SIZE	12	/* 96-bit unique device ID */
+
+/* per-device record of the page hashes last programmed by us */
+typedef struct stm32_cache {
+	char path[PATH_MAX];
+	uint16_t pid;
+	uint8_t uid[STM32_UID_SIZE];
+	uint32_t flash_size;
+	uint32_t pages_count;
+	uint8_t *valid;
+	uint8_t (*hashes)[SHA256_DIGEST_SIZE];
+} stm32_cache_t ;
+
+uint32_t stm32_uid_address(uint16_t pid);
+stm32_errors_t stm32_identify(stm32_ctx_t *ctx, uint32_t uid_address, uint16_t *pid, uint8_t *uid);
+int stm32_device_path(char *path, size_t size, const char *dir, uint16_t pid, const uint8_t *uid, const char *suffix);
+
+stm32_errors_t stm32_cache_open(stm32_ctx_t *ctx, stm32_cache_t *cache, const char *dir, const geometry_t *geometry, uint32_t uid_address);
+stm32_errors_t stm32_cache_save(stm32_cache_t *cache);
+void stm32_cache_close(stm32_cache_t *cache);
+void stm32_cache_clear(stm32_cache_t *cache);
+int stm32_cache_lookup(const stm32_cache_t *cache, uint16_t page, const uint8_t *hash);
+void stm32_cache_store(stm32_cache_t *cache, uint16_t page, const uint8_t *hash);
+void stm32_cache_forget(stm32_cache_t *cache, uint16_t page);
+
+#endif /* STM32_CACHE_H_ */
@@ -0,0 +1,162 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stm32.h"
+#include "stm32_dump.h"
+#include "crc32.h"
+#include "sha256.h"
+
+#define STM32_DUMP_BLOCK	0x100
+
+static int is_blank(const uint8_t *data, uint16_t size){
+
+	uint16_t i = 0;
+
+	for(i = 0; i < size; i++)
+		if (data[i] != 0xFF)
+			return 0;
+
+	return 1;
+}
+
+static int write_all(int fd, const uint8_t *data, uint16_t size){
+
+	while(size > 0){
+		ssize_t r = write(fd, data, size);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r < 1)
+			return -1;
+
+		data += r;
+		size -= r;
+	}
+
+	return 0;
+}
+
+stm32_errors_t stm32_dump(stm32_ctx_t *ctx, stm32_dump_t *dump){
+
+	sha256_t sha;
+	uint8_t *map = NULL;
+	int seekable = 0;
+	off_t origin = 0;
+
+	if (dump == NULL || dump->size == 0 || dump->out_fd < 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if ((uint64_t)dump->address + dump->size > 0x100000000ULL)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if (dump->flags & STM32_DUMP_MMAP){
+
+		/* start from an empty file so untouched blocks stay holes */
+		if (ftruncate(dump->out_fd, 0) != 0 || ftruncate(dump->out_fd, dump->size) != 0)
+			return STM32_ERR_SYSTEM;
+
+		map = mmap(NULL, dump->size, PROT_READ | PROT_WRITE, MAP_SHARED, dump->out_fd, 0);
+
+		if (map == MAP_FAILED)
+			return STM32_ERR_SYSTEM;
+
+		madvise(map, dump->size, MADV_SEQUENTIAL);
+
+	} else if (dump->flags & STM32_DUMP_SPARSE){
+
+		struct stat st;
+
+		/* pipes, sockets and devices get erased blocks written out */
+		origin = lseek(dump->out_fd, 0, SEEK_CUR);
+		seekable = origin >= 0 && fstat(dump->out_fd, &st) == 0 && S_ISREG(st.st_mode);
+
+		/* skipped blocks must not keep what an earlier file had there */
+		if (seekable && ftruncate(dump->out_fd, origin) != 0)
+			return STM32_ERR_SYSTEM;
+	}
+
+	sha256_init(&sha);
+	dump->crc32 = 0;
+	dump->blank_blocks = 0;
+
+	stm32_errors_t result = STM32_ERR_OK;
+	uint32_t done = 0;
+
+	while(done < dump->size){
+
+		uint8_t *data;
+		uint16_t size = dump->size - done < STM32_DUMP_BLOCK ? dump->size - done : STM32_DUMP_BLOCK;
+
+		result = stm32_read(ctx, dump->address + done, &data, size);
+
+		if (result != STM32_ERR_OK)
+			break;
+
+		/* hash while the block is still hot in cache */
+		sha256_update(&sha, data, size);
+		dump->crc32 = crc32_update(dump->crc32, data, size);
+
+		int blank = (dump->flags & STM32_DUMP_SPARSE) && is_blank(data, size);
+
+		if (blank)
+			dump->blank_blocks++;
+
+		if (map != NULL){
+			if (!blank)
+				memcpy(map + done, data, size);
+		} else if (blank && seekable){
+			if (lseek(dump->out_fd, size, SEEK_CUR) < 0){
+				result = STM32_ERR_SYSTEM;
+				break;
+			}
+		} else if (write_all(dump->out_fd, data, size) != 0){
+			result = STM32_ERR_SYSTEM;
+			break;
+		}
+
+		done += size;
+
+		if (dump->progress != NULL)
+			dump->progress(done, dump->size, dump->progress_arg);
+	}
+
+	if (map != NULL){
+		if (munmap(map, dump->size) != 0 && result == STM32_ERR_OK)
+			result = STM32_ERR_SYSTEM;
+	} else if (seekable && result == STM32_ERR_OK){
+		/* trailing holes do not extend the file by themselves */
+		if (ftruncate(dump->out_fd, origin + dump->size) != 0)
+			result = STM32_ERR_SYSTEM;
+	}
+
+	sha256_final(&sha, dump->sha256);
+
+	return result;
+}
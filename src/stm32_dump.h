@@ -0,0 +1,49 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef STM32_DUMP_H_
+#define STM32_DUMP_H_
+
+#include <stdint.h>
+#include "stm32.h"
+#include "sha256.h"
+
+#define STM32_DUMP_SPARSE	0x01	/* leave erased (all 0xFF) blocks as file holes */
+#define STM32_DUMP_MMAP		0x02	/* map the output file from offset 0 instead of write() */
+
+typedef struct stm32_dump {
+	uint32_t address;
+	uint32_t size;
+	int out_fd;
+	uint32_t flags;
+	stm32_progress_t progress;
+	void *progress_arg;
+
+	/* filled in by stm32_dump(), hashes cover the whole range including holes */
+	uint32_t crc32;
+	uint8_t sha256[SHA256_DIGEST_SIZE];
+	uint32_t blank_blocks;
+} stm32_dump_t ;
+
+stm32_errors_t stm32_dump(stm32_ctx_t *ctx, stm32_dump_t *dump);
+
+#endif /* STM32_DUMP_H_ */
@@ -0,0 +1,926 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stm32.h"
+#include "stm32_flash.h"
+#include "image.h"
+#include "geometry.h"
+#include "stm32_cache.h"
+#include "stm32_journal.h"
+#include "stm32_helper.h"
+#include "stm32_pack.h"
+#include "sha256.h"
+#include "erase_map.h"
+
+#define STM32_FLASH_BLOCK	0x100	/* largest 'read memory' block */
+
+/* page status while planning a delta update */
+#define PAGE_UNKNOWN	0
+#define PAGE_SAME		1	/* read back and equal */
+#define PAGE_CACHED		2	/* equal according to the cache */
+#define PAGE_CHANGED	3
+
+typedef struct flash_state {
+	stm32_ctx_t *ctx;
+	stm32_flash_t *flash;
+	stm32_journal_t *journal;	/* NULL unless the mode can be resumed */
+	uint8_t resumed;
+	uint32_t resume;			/* frames ending at or below were programmed earlier */
+	int32_t rollback;			/* page holding the first unfinished frame */
+	uint32_t journaled;			/* last end address recorded */
+	stm32_helper_t helper;
+	uint8_t helper_running;
+	const uint16_t *footprint;	/* pages the image touches */
+	uint32_t footprint_size;
+	uint8_t forgotten;			/* the cache on disk no longer vouches for the footprint */
+	uint32_t done;
+	uint32_t total;
+} flash_state_t ;
+
+static void flash_progress(flash_state_t *state, uint32_t bytes){
+
+	state->done += bytes;
+
+	if (state->flash->progress != NULL)
+		state->flash->progress(state->done, state->total, state->flash->progress_arg);
+}
+
+static int is_blank_word(const uint8_t *data){
+	return (data[0] & data[1] & data[2] & data[3]) == 0xFF;
+}
+
+static stm32_errors_t flash_journal(flash_state_t *state, uint32_t end){
+
+	if (state->journal == NULL || end == state->journaled)
+		return STM32_ERR_OK;
+
+	state->journaled = end;
+
+	return stm32_journal_written(state->journal, end);
+}
+
+/* the journal records of a page must be on disk before the helper programs the next one */
+static stm32_errors_t flash_helper_enter(flash_state_t *state, uint32_t address){
+
+	stm32_helper_t *helper = &state->helper;
+	stm32_errors_t result = STM32_ERR_OK;
+	uint16_t page;
+
+	if (
+		state->journal != NULL &&
+		geometry_find(state->flash->geometry, address, &page) == 0 &&
+		page != state->journal->page
+	){
+		if ((result = stm32_helper_flush(helper)) == STM32_ERR_OK && (result = flash_journal(state, helper->acked)) == STM32_ERR_OK)
+			result = stm32_journal_enter(state->journal, address);
+	}
+
+	return result;
+}
+
+/* program through the RAM helper, its acknowledgements trail by up to a window of blocks */
+static stm32_errors_t flash_helper_frame(flash_state_t *state, const image_frame_t *frame, uint16_t head, uint16_t tail){
+
+	stm32_helper_t *helper = &state->helper;
+	stm32_errors_t result = flash_helper_enter(state, frame->address);
+
+	if (result == STM32_ERR_OK)
+		result = stm32_helper_write(helper, frame->address + head, frame->data + head, tail - head);
+
+	if (result == STM32_ERR_OK)
+		result = flash_journal(state, helper->acked);
+
+	return result;
+}
+
+static stm32_errors_t flash_frames(flash_state_t *state, image_frames_t *frames){
+
+	image_frame_t frame;
+	stm32_errors_t result;
+
+	/* one 'write memory' command per maximal aligned frame */
+	while(image_frames_next(frames, &frame)){
+
+		uint16_t head = 0;
+		uint16_t tail = frame.size;
+
+		if (state->resumed && frame.address + frame.size <= state->resume){
+			state->flash->frames_resumed++;
+			flash_progress(state, frame.payload);
+			continue;
+		}
+
+		/* erased flash already reads 0xFF, only send the words that differ */
+		if (state->ctx->erased != NULL && erase_map_is_erased(state->ctx->erased, frame.address, frame.size)){
+
+			while(head < tail && is_blank_word(frame.data + head))
+				head += IMAGE_FRAME_ALIGN;
+
+			while(tail > head && is_blank_word(frame.data + tail - IMAGE_FRAME_ALIGN))
+				tail -= IMAGE_FRAME_ALIGN;
+
+			if (head == tail){
+				state->flash->frames_skipped++;
+				flash_progress(state, frame.payload);
+				continue;
+			}
+		}
+
+		if (state->helper_running)
+			result = flash_helper_frame(state, &frame, head, tail);
+		else {
+			if (state->journal != NULL && (result = stm32_journal_enter(state->journal, frame.address)) != STM32_ERR_OK)
+				return result;
+
+			result = stm32_write(state->ctx, frame.address + head, frame.data + head, tail - head);
+
+			if (result == STM32_ERR_OK)
+				result = flash_journal(state, frame.address + frame.size);
+		}
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		state->flash->frames_written++;
+		flash_progress(state, frame.payload);
+	}
+
+	if (!state->helper_running)
+		return STM32_ERR_OK;
+
+	if ((result = stm32_helper_flush(&state->helper)) != STM32_ERR_OK)
+		return result;
+
+	return flash_journal(state, state->helper.acked);
+}
+
+/* sorted list of pages touched by the image */
+stm32_errors_t stm32_erase_plan(const image_t *image, const geometry_t *geometry, uint16_t **pages, uint32_t *pages_size){
+
+	uint32_t total = geometry_pages(geometry);
+	uint32_t size = 0;
+	uint32_t i = 0;
+
+	/* the list below relies on the segments coming in address order */
+	if (!image_ordered(image))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	*pages = malloc(total * sizeof(uint16_t));
+
+	if (*pages == NULL)
+		return STM32_ERR_SYSTEM;
+
+	for(i = 0; i < image->segments_count; i++){
+
+		const image_segment_t *segment = &image->segments[i];
+		uint16_t first, last;
+		uint32_t page;
+
+		if (
+			geometry_find(geometry, segment->address, &first) != 0 ||
+			geometry_find(geometry, segment->address + segment->size - 1, &last) != 0
+		){
+			free(*pages);
+			return STM32_ERR_INVALID_ARGUMENT;
+		}
+
+		/* segments are sorted, so only the previous page can repeat */
+		for(page = first; page <= last && size < total; page++)
+			if (size == 0 || (*pages)[size - 1] != page)
+				(*pages)[size++] = page;
+	}
+
+	*pages_size = size;
+
+	return STM32_ERR_OK;
+}
+
+/* compare a page with the image, padding uncovered bytes as erased */
+static stm32_errors_t flash_compare(flash_state_t *state, uint32_t address, uint32_t size, int *changed){
+
+	uint8_t expected[STM32_FLASH_BLOCK];
+	uint32_t offset = 0;
+
+	*changed = 0;
+	state->flash->pages_read++;
+
+	/* the rest of the page is rewritten anyway */
+	for(offset = 0; offset < size && !*changed; offset += STM32_FLASH_BLOCK){
+
+		uint8_t *data;
+		uint16_t block = size - offset < STM32_FLASH_BLOCK ? size - offset : STM32_FLASH_BLOCK;
+
+		image_fill(state->flash->image, address + offset, expected, block);
+
+		stm32_errors_t result = stm32_read(state->ctx, address + offset, &data, block);
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		*changed = memcmp(data, expected, block) != 0;
+	}
+
+	return STM32_ERR_OK;
+}
+
+/* hash of the page contents once the image is programmed */
+static void flash_hash(const image_t *image, uint32_t address, uint32_t size, uint8_t *hash){
+
+	uint8_t expected[STM32_FLASH_BLOCK];
+	uint32_t offset = 0;
+	sha256_t sha;
+
+	sha256_init(&sha);
+
+	for(offset = 0; offset < size; offset += STM32_FLASH_BLOCK){
+
+		uint16_t block = size - offset < STM32_FLASH_BLOCK ? size - offset : STM32_FLASH_BLOCK;
+
+		image_fill(image, address + offset, expected, block);
+		sha256_update(&sha, expected, block);
+	}
+
+	sha256_final(&sha, hash);
+}
+
+/* spot-check pages the cache claims are up to date */
+static stm32_errors_t flash_sample(flash_state_t *state, const uint16_t *pages, const uint8_t *status, uint32_t pages_size, int *stale){
+
+	stm32_flash_t *flash = state->flash;
+	uint8_t expected[STM32_FLASH_BLOCK];
+	uint32_t cached = 0;
+	uint32_t seed = time(NULL) ^ flash->cache->pid;
+	uint32_t i = 0;
+
+	*stale = 0;
+
+	/* xorshift never leaves zero */
+	seed |= 1;
+
+	for(i = 0; i < pages_size; i++)
+		cached += status[i] == PAGE_CACHED;
+
+	for(i = 0; i < flash->cache_samples && cached > 0; i++){
+
+		uint32_t address, size, pick, j;
+		uint8_t *data;
+
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		/* pick the n-th cached page, then one block inside it */
+		for(pick = seed % cached, j = 0; ; j++)
+			if (status[j] == PAGE_CACHED && pick-- == 0)
+				break;
+
+		geometry_page(flash->geometry, pages[j], &address, &size);
+
+		uint16_t block = size < STM32_FLASH_BLOCK ? size : STM32_FLASH_BLOCK;
+
+		address += (seed >> 8) % (size / block) * block;
+		image_fill(flash->image, address, expected, block);
+
+		stm32_errors_t result = stm32_read(state->ctx, address, &data, block);
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		if (memcmp(data, expected, block) != 0){
+			*stale = 1;
+			break;
+		}
+	}
+
+	return STM32_ERR_OK;
+}
+
+/* record what the footprint pages hold once programming succeeded */
+static stm32_errors_t flash_cache_commit(flash_state_t *state, const uint16_t *pages, uint32_t pages_size){
+
+	stm32_flash_t *flash = state->flash;
+	uint8_t hash[SHA256_DIGEST_SIZE];
+	uint32_t i = 0;
+
+	for(i = 0; i < pages_size; i++){
+
+		uint32_t address, size;
+
+		geometry_page(flash->geometry, pages[i], &address, &size);
+		flash_hash(flash->image, address, size, hash);
+		stm32_cache_store(flash->cache, pages[i], hash);
+	}
+
+	return stm32_cache_save(flash->cache);
+}
+
+static stm32_errors_t flash_classify(flash_state_t *state, const uint16_t *pages, uint8_t *status, uint32_t pages_size){
+
+	stm32_flash_t *flash = state->flash;
+	uint8_t hash[SHA256_DIGEST_SIZE];
+	stm32_errors_t result;
+	uint32_t i = 0;
+
+	/* let the cache answer first, unknown pages need a read back */
+	if (flash->cache != NULL){
+
+		int stale;
+
+		for(i = 0; i < pages_size; i++){
+
+			uint32_t address, size;
+
+			geometry_page(flash->geometry, pages[i], &address, &size);
+			flash_hash(flash->image, address, size, hash);
+
+			switch(stm32_cache_lookup(flash->cache, pages[i], hash)){
+				case 1 : status[i] = PAGE_CACHED;  break;
+				case 0 : status[i] = PAGE_CHANGED; break;
+				default: status[i] = PAGE_UNKNOWN; break;
+			}
+		}
+
+		result = flash_sample(state, pages, status, pages_size, &stale);
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		/* the target was programmed behind our back */
+		if (stale){
+			flash->cache_stale = 1;
+			stm32_cache_clear(flash->cache);
+			memset(status, PAGE_UNKNOWN, pages_size);
+		}
+	}
+
+	for(i = 0; i < pages_size; i++){
+
+		uint32_t address, size;
+		int changed;
+
+		if (status[i] != PAGE_UNKNOWN)
+			continue;
+
+		geometry_page(flash->geometry, pages[i], &address, &size);
+		result = flash_compare(state, address, size, &changed);
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		status[i] = changed ? PAGE_CHANGED : PAGE_SAME;
+	}
+
+	return STM32_ERR_OK;
+}
+
+/*
+ * pages about to be erased or written must not be trusted if we die half way, the
+ * first batch drops the whole footprint and saves once, later batches are already
+ * covered and flash_cache_commit() records the result at the end
+ */
+static stm32_errors_t flash_forget(flash_state_t *state, const uint16_t *pages, uint32_t pages_size){
+
+	stm32_flash_t *flash = state->flash;
+	uint32_t i = 0;
+
+	if (flash->cache == NULL || pages_size == 0 || state->forgotten)
+		return STM32_ERR_OK;
+
+	for(i = 0; i < state->footprint_size; i++)
+		stm32_cache_forget(flash->cache, state->footprint[i]);
+
+	state->forgotten = 1;
+
+	return stm32_cache_save(flash->cache);
+}
+
+static stm32_errors_t flash_erase_mass(flash_state_t *state){
+
+	stm32_errors_t result = STM32_ERR_OK;
+
+	/* everything outside the image is erased too */
+	if (state->flash->cache != NULL){
+		stm32_cache_clear(state->flash->cache);
+		result = stm32_cache_save(state->flash->cache);
+	}
+
+	if (result == STM32_ERR_OK)
+		result = stm32_extended_erase_special(state->ctx, STM32_ERASE_MASS);
+
+	if (result == STM32_ERR_OK && state->journal != NULL)
+		result = stm32_journal_erased_all(state->journal);
+
+	return result;
+}
+
+static stm32_errors_t flash_erase_pages(flash_state_t *state, const uint16_t *pages, uint32_t pages_size){
+
+	stm32_errors_t result = flash_forget(state, pages, pages_size);
+
+	if (result == STM32_ERR_OK && pages_size > 0)
+		result = stm32_extended_erase(state->ctx, pages, pages_size);
+
+	if (result == STM32_ERR_OK && state->journal != NULL)
+		result = stm32_journal_erased(state->journal, pages, pages_size);
+
+	return result;
+}
+
+/* a resumed run erases only what the interrupted one did not, plus the rollback page */
+static stm32_errors_t flash_erase_resumed(flash_state_t *state, const uint16_t *pages, uint32_t pages_size){
+
+	uint16_t *pending = malloc(pages_size * sizeof(uint16_t));
+	uint32_t pending_size = 0;
+	uint32_t i = 0;
+
+	if (pending == NULL)
+		return STM32_ERR_SYSTEM;
+
+	for(i = 0; i < pages_size; i++){
+
+		uint32_t address, size;
+
+		geometry_page(state->flash->geometry, pages[i], &address, &size);
+
+		if (address + size <= state->resume)
+			continue;
+
+		if (pages[i] != state->rollback && state->journal->erased[pages[i]])
+			continue;
+
+		pending[pending_size++] = pages[i];
+	}
+
+	stm32_errors_t result = flash_erase_pages(state, pending, pending_size);
+
+	free(pending);
+
+	return result;
+}
+
+static stm32_errors_t flash_erase(flash_state_t *state, const uint16_t *pages, uint32_t pages_size){
+
+	if (state->resumed)
+		return flash_erase_resumed(state, pages, pages_size);
+
+	/* a single command is cheaper when the image touches every page */
+	if (pages_size == geometry_pages(state->flash->geometry))
+		return flash_erase_mass(state);
+
+	return flash_erase_pages(state, pages, pages_size);
+}
+
+/* program the part of the image inside the given pages */
+static stm32_errors_t flash_pages(flash_state_t *state, const uint16_t *pages, uint32_t pages_size){
+
+	uint32_t i = 0;
+
+	for(i = 0; i < pages_size; i++){
+
+		image_frames_t frames;
+		uint32_t address, size;
+
+		geometry_page(state->flash->geometry, pages[i], &address, &size);
+		image_frames_range(&frames, state->flash->image, address, size);
+
+		stm32_errors_t result = flash_frames(state, &frames);
+
+		if (result != STM32_ERR_OK)
+			return result;
+	}
+
+	return STM32_ERR_OK;
+}
+
+/* erase each batch right before it is programmed */
+static stm32_errors_t flash_jit(flash_state_t *state, const uint16_t *pages, uint32_t pages_size){
+
+	uint32_t batch = state->flash->jit_batch ? state->flash->jit_batch : 1;
+	stm32_errors_t result = STM32_ERR_OK;
+
+	while(pages_size > 0 && result == STM32_ERR_OK){
+
+		if (batch > pages_size)
+			batch = pages_size;
+
+		result = flash_erase(state, pages, batch);
+
+		if (result == STM32_ERR_OK)
+			result = flash_pages(state, pages, batch);
+
+		pages += batch;
+		pages_size -= batch;
+	}
+
+	return result;
+}
+
+/* from here on the helper programs, the bootloader is back once it is stopped */
+static stm32_errors_t flash_helper_start(flash_state_t *state){
+
+	stm32_flash_t *flash = state->flash;
+
+	if (flash->helper == NULL)
+		return STM32_ERR_OK;
+
+	stm32_errors_t result = stm32_helper_start(state->ctx, &state->helper, flash->helper, flash->helper_size, flash->helper_address);
+
+	state->helper_running = result == STM32_ERR_OK;
+
+	return result;
+}
+
+/* the whole image as precompressed blocks, expanded and programmed by the helper */
+static stm32_errors_t flash_packed(flash_state_t *state){
+
+	stm32_flash_t *flash = state->flash;
+	const stm32_pack_t *pack = flash->pack;
+	stm32_helper_t *helper = &state->helper;
+	stm32_errors_t result = STM32_ERR_OK;
+	uint32_t i = 0;
+
+	for(i = 0; i < pack->blocks_count && result == STM32_ERR_OK; i++){
+
+		const stm32_pack_block_t *block = &pack->blocks[i];
+		uint32_t covered = image_covered(flash->image, block->address, block->size);
+
+		if (state->resumed && block->address + block->size <= state->resume){
+			flash_progress(state, covered);
+			continue;
+		}
+
+		if ((result = flash_helper_enter(state, block->address)) != STM32_ERR_OK)
+			break;
+
+		if (block->packed_size == 0)
+			result = stm32_helper_write(helper, block->address, pack->data + block->offset, block->size);
+		else {
+			result = stm32_helper_write_packed(helper, block->address, block->size, pack->data + block->offset, block->packed_size);
+			flash->blocks_packed++;
+			flash->bytes_packed += block->packed_size;
+		}
+
+		if (result == STM32_ERR_OK)
+			result = flash_journal(state, helper->acked);
+
+		flash_progress(state, covered);
+	}
+
+	if (result == STM32_ERR_OK)
+		result = stm32_helper_flush(helper);
+
+	if (result == STM32_ERR_OK)
+		result = flash_journal(state, helper->acked);
+
+	return result;
+}
+
+static int flash_packable(const flash_state_t *state){
+
+	const stm32_pack_t *pack = state->flash->pack;
+
+	return
+		state->helper_running && pack != NULL &&
+		(state->helper.flags & STM32_HELPER_FLAG_LZ4) &&
+		pack->block_size <= state->helper.block_max;
+}
+
+static stm32_errors_t flash_delta(flash_state_t *state, const uint16_t *pages, uint32_t pages_size){
+
+	stm32_flash_t *flash = state->flash;
+	uint16_t *changed = NULL;
+	uint8_t *status = NULL;
+	uint32_t i = 0;
+
+	/* nothing to compare, and calloc(0) may return NULL */
+	if (pages_size == 0)
+		return STM32_ERR_OK;
+
+	status = calloc(pages_size, 1);
+	changed = malloc(pages_size * sizeof(uint16_t));
+
+	if (status == NULL || changed == NULL){
+		free(status);
+		free(changed);
+		return STM32_ERR_SYSTEM;
+	}
+
+	stm32_errors_t result = flash_classify(state, pages, status, pages_size);
+
+	for(i = 0; i < pages_size && result == STM32_ERR_OK; i++){
+
+		uint32_t address, size;
+
+		geometry_page(flash->geometry, pages[i], &address, &size);
+
+		if (status[i] == PAGE_CHANGED)
+			changed[flash->pages_changed++] = pages[i];
+		else
+			flash_progress(state, image_covered(flash->image, address, size));
+	}
+
+	if (result == STM32_ERR_OK)
+		result = flash_erase(state, changed, flash->pages_changed);
+
+	if (result == STM32_ERR_OK && flash->pages_changed > 0)
+		result = flash_helper_start(state);
+
+	if (result == STM32_ERR_OK)
+		result = flash_pages(state, changed, flash->pages_changed);
+
+	free(status);
+	free(changed);
+
+	return result;
+}
+
+/* the interrupted run must have left the frames below the resume point intact */
+static stm32_errors_t flash_resume_check(flash_state_t *state, int *intact){
+
+	image_frames_t frames;
+	image_frame_t frame;
+	uint32_t from = state->resume > IMAGE_FRAME_SIZE ? state->resume - IMAGE_FRAME_SIZE : 0;
+
+	*intact = 1;
+	image_frames_range(&frames, state->flash->image, from, state->resume - from);
+
+	while(*intact && image_frames_next(&frames, &frame)){
+
+		uint8_t *data;
+
+		stm32_errors_t result = stm32_read(state->ctx, frame.address, &data, frame.size);
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		*intact = memcmp(data, frame.data, frame.size) == 0;
+	}
+
+	return STM32_ERR_OK;
+}
+
+/* pick up after the last frame the journal knows was programmed */
+static stm32_errors_t flash_resume(flash_state_t *state){
+
+	stm32_flash_t *flash = state->flash;
+	stm32_journal_t *journal = state->journal;
+	image_frames_t frames;
+	image_frame_t frame;
+	uint16_t page;
+	uint32_t address, size, i;
+	int intact;
+
+	if (journal->records == 0)
+		return STM32_ERR_OK;
+
+	/* a mass erase would wipe whatever the interrupted run programmed */
+	if (flash->mode == STM32_FLASH_MASS && !journal->erased_all)
+		return stm32_journal_reset(journal);
+
+	if (journal->written == 0)
+		image_frames_init(&frames, flash->image);
+	else
+		image_frames_range(&frames, flash->image, journal->written, (uint32_t)(0x100000000ULL - journal->written));
+
+	state->resume = journal->written;
+
+	if (image_frames_next(&frames, &frame)){
+
+		state->resume = frame.address;
+
+		/* it may hold a half programmed frame, so erase it again and redo it from its base */
+		if (flash->mode != STM32_FLASH_WRITE){
+
+			if (geometry_find(flash->geometry, frame.address, &page) != 0)
+				return STM32_ERR_INVALID_ARGUMENT;
+
+			geometry_page(flash->geometry, page, &address, &size);
+			state->resume = address;
+			state->rollback = page;
+		}
+	}
+
+	stm32_errors_t result = flash_resume_check(state, &intact);
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	/* programmed behind our back since, start over */
+	if (!intact){
+		state->resume = 0;
+		state->rollback = -1;
+		return stm32_journal_reset(journal);
+	}
+
+	state->resumed = 1;
+	flash->resume_address = state->resume;
+
+	/* journaled erases still hold beyond the resume point */
+	for(i = 0; i < journal->pages_count && state->ctx->erased != NULL; i++){
+
+		geometry_page(flash->geometry, i, &address, &size);
+
+		if (address >= state->resume && (int32_t)i != state->rollback && journal->erased[i]){
+			page = i;
+			erase_map_pages(state->ctx->erased, &page, 1);
+		}
+	}
+
+	return STM32_ERR_OK;
+}
+
+static stm32_errors_t flash_run(flash_state_t *state, const uint16_t *pages, uint32_t pages_size){
+
+	stm32_flash_t *flash = state->flash;
+	image_frames_t frames;
+	stm32_errors_t result;
+
+	state->footprint = pages;
+	state->footprint_size = pages_size;
+
+	switch(flash->mode){
+		case STM32_FLASH_DELTA:
+			result = flash_delta(state, pages, pages_size);
+			break;
+
+		case STM32_FLASH_MASS:
+			result = state->resumed ? flash_erase(state, pages, pages_size) : flash_erase_mass(state);
+			break;
+
+		case STM32_FLASH_PAGES:
+			result = flash_erase(state, pages, pages_size);
+			break;
+
+		case STM32_FLASH_JIT:
+			result = flash_jit(state, pages, pages_size);
+			break;
+
+		default:
+			result = flash_forget(state, pages, pages_size);
+			break;
+	}
+
+	/* page by page modes program by themselves, the rest write the whole image */
+	if (result == STM32_ERR_OK && flash->mode != STM32_FLASH_DELTA && flash->mode != STM32_FLASH_JIT){
+
+		image_frames_init(&frames, flash->image);
+
+		if ((result = flash_helper_start(state)) == STM32_ERR_OK)
+			result = flash_packable(state) ? flash_packed(state) : flash_frames(state, &frames);
+	}
+
+	if (state->helper_running){
+
+		stm32_errors_t stopped = stm32_helper_stop(&state->helper);
+
+		state->helper_running = 0;
+
+		if (result == STM32_ERR_OK)
+			result = stopped;
+	}
+
+	return result;
+}
+
+stm32_errors_t stm32_write_image(stm32_ctx_t *ctx, const image_t *image, stm32_progress_t progress, void *progress_arg){
+
+	stm32_flash_t flash;
+
+	memset(&flash, 0, sizeof(flash));
+
+	flash.image = image;
+	flash.mode = STM32_FLASH_WRITE;
+	flash.progress = progress;
+	flash.progress_arg = progress_arg;
+
+	return stm32_flash(ctx, &flash);
+}
+
+stm32_errors_t stm32_flash(stm32_ctx_t *ctx, stm32_flash_t *flash){
+
+	flash_state_t state;
+	erase_map_t map;
+	uint16_t *pages = NULL;
+	uint32_t pages_size = 0;
+	stm32_errors_t result = STM32_ERR_OK;
+
+	if (ctx == NULL || flash == NULL || flash->image == NULL)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	/* frames and page lookups walk the segments in address order */
+	if (!image_ordered(flash->image))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if (flash->mode > STM32_FLASH_JIT || (flash->helper != NULL && flash->helper_size == 0))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if (flash->pack != NULL && flash->pack->image != flash->image)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	/* page based modes, the cache and the journal need to know the layout */
+	if ((flash->mode >= STM32_FLASH_DELTA || flash->cache != NULL || flash->journal != NULL) && flash->geometry == NULL)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	state.ctx = ctx;
+	state.flash = flash;
+	state.resumed = 0;
+	state.resume = 0;
+	state.rollback = -1;
+	state.journaled = 0;
+	state.helper_running = 0;
+	state.footprint = NULL;
+	state.footprint_size = 0;
+	state.forgotten = 0;
+	state.done = 0;
+	state.total = image_size(flash->image);
+
+	/* a delta update reads the target back, it resumes by itself */
+	state.journal = flash->mode != STM32_FLASH_DELTA ? flash->journal : NULL;
+
+	flash->pages_total = 0;
+	flash->pages_read = 0;
+	flash->pages_changed = 0;
+	flash->frames_written = 0;
+	flash->frames_skipped = 0;
+	flash->cache_stale = 0;
+	flash->frames_resumed = 0;
+	flash->resume_address = 0;
+	flash->blocks_packed = 0;
+	flash->bytes_packed = 0;
+
+	/* erase deadlines follow the real page sizes for the run */
+	const geometry_t *ctx_geometry = ctx->geometry;
+
+	if (ctx->geometry == NULL)
+		ctx->geometry = flash->geometry;
+
+	if (flash->geometry != NULL){
+
+		result = stm32_erase_plan(flash->image, flash->geometry, &pages, &pages_size);
+
+		if (result != STM32_ERR_OK){
+			ctx->geometry = ctx_geometry;
+			return result;
+		}
+
+		flash->pages_total = pages_size;
+
+		/* erasing modes know what they erased even without a session map */
+		if (ctx->erased == NULL && flash->mode != STM32_FLASH_WRITE){
+
+			if (erase_map_init(&map, flash->geometry) != 0){
+				ctx->geometry = ctx_geometry;
+				free(pages);
+				return STM32_ERR_SYSTEM;
+			}
+
+			ctx->erased = &map;
+		}
+	}
+
+	if (state.journal != NULL)
+		result = flash_resume(&state);
+
+	if (result == STM32_ERR_OK)
+		result = flash_run(&state, pages, pages_size);
+
+	if (result == STM32_ERR_OK && flash->cache != NULL)
+		result = flash_cache_commit(&state, pages, pages_size);
+
+	if (result == STM32_ERR_OK && state.journal != NULL)
+		result = stm32_journal_finish(state.journal);
+
+	if (ctx->erased == &map){
+		ctx->erased = NULL;
+		erase_map_free(&map);
+	}
+
+	ctx->geometry = ctx_geometry;
+	free(pages);
+
+	return result;
+}
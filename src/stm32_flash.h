@@ -0,0 +1,75 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef STM32_FLASH_H_
+#define STM32_FLASH_H_
+
+#include <stdint.h>
+#include "stm32.h"
+#include "image.h"
+#include "geometry.h"
+#include "stm32_cache.h"
+#include "stm32_journal.h"
+#include "stm32_helper.h"
+#include "stm32_pack.h"
+
+typedef enum stm32_flash_mode {
+	STM32_FLASH_WRITE,	/* program only, target is already erased */
+	STM32_FLASH_MASS,	/* mass erase, then program the whole image */
+	STM32_FLASH_DELTA,	/* read back, erase and program changed pages only */
+	STM32_FLASH_PAGES,	/* erase the pages the image touches, then program */
+	STM32_FLASH_JIT		/* erase each batch of pages right before programming it */
+} stm32_flash_mode_t ;
+
+typedef struct stm32_flash {
+	const image_t *image;
+	const geometry_t *geometry;	/* required by page based modes */
+	stm32_flash_mode_t mode;
+	stm32_cache_t *cache;		/* optional page hash cache, see stm32_cache_open() */
+	uint32_t cache_samples;		/* cached pages spot-checked before the cache is trusted */
+	stm32_journal_t *journal;	/* optional, resumes an interrupted run, see stm32_journal_open() */
+	uint16_t jit_batch;			/* pages erased ahead in STM32_FLASH_JIT, 0 means 1 */
+	const uint8_t *helper;		/* optional RAM helper programming the image, unused by STM32_FLASH_JIT */
+	uint32_t helper_size;
+	uint32_t helper_address;	/* SRAM address it is loaded to and started at */
+	const stm32_pack_t *pack;	/* optional, the image compressed once for helpers that take LZ4 */
+	stm32_progress_t progress;
+	void *progress_arg;
+
+	/* filled in by stm32_flash() */
+	uint32_t pages_total;
+	uint32_t pages_read;
+	uint32_t pages_changed;
+	uint32_t frames_written;
+	uint32_t frames_skipped;
+	uint8_t cache_stale;
+	uint32_t frames_resumed;	/* done by the interrupted run and not written again */
+	uint32_t resume_address;	/* where a journaled run picked up, 0 when started afresh */
+	uint32_t blocks_packed;		/* compressed blocks sent through the helper */
+	uint32_t bytes_packed;		/* and their size on the wire */
+} stm32_flash_t ;
+
+stm32_errors_t stm32_erase_plan(const image_t *image, const geometry_t *geometry, uint16_t **pages, uint32_t *pages_size);
+stm32_errors_t stm32_write_image(stm32_ctx_t *ctx, const image_t *image, stm32_progress_t progress, void *progress_arg);
+stm32_errors_t stm32_flash(stm32_ctx_t *ctx, stm32_flash_t *flash);
+
+#endif /* STM32_FLASH_H_ */
@@ -0,0 +1,367 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "stm32.h"
+#include "stm32_helper.h"
+#include "serial.h"
+#include "crc32.h"
+#include "erase_map.h"
+
+#define STM32_HELPER_CRC	4
+#define STM32_HELPER_CHUNK	0x100	/* 'write memory' block used to load the helper */
+
+static void put_le(uint8_t *buffer, uint32_t value, int size){
+
+	int i = 0;
+
+	for(i = 0; i < size; i++)
+		buffer[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static uint32_t get_le(const uint8_t *buffer, int size){
+
+	uint32_t value = 0;
+	int i = 0;
+
+	for(i = size - 1; i >= 0; i--)
+		value = (value << 8) | buffer[i];
+
+	return value;
+}
+
+static uint32_t helper_frame_size(const stm32_helper_t *helper){
+	return STM32_HELPER_HEADER + helper->block_max + STM32_HELPER_CRC;
+}
+
+/* the oldest ack may queue behind a full window of blocks still being received */
+static uint32_t helper_timeout(const stm32_helper_t *helper){
+
+	const stm32_timeouts_t *timeouts = &helper->ctx->timeouts;
+	uint64_t transfer_ms = ((uint64_t)helper->window * helper_frame_size(helper) * timeouts->byte_us + 999) / 1000;
+
+	return timeouts->ack_ms + timeouts->write_ms * ((helper->block_max + STM32_HELPER_CHUNK - 1) / STM32_HELPER_CHUNK) + transfer_ms;
+}
+
+static stm32_errors_t helper_send(stm32_helper_t *helper, const stm32_helper_block_t *block){
+
+	uint32_t len = STM32_HELPER_HEADER + block->size + STM32_HELPER_CRC;
+
+	helper->ctx->stats.bytes_tx += len;
+	helper->blocks_sent++;
+
+	/* blocks stream out while earlier ones are being programmed */
+	serial_errors_t status = serial_io_write(&helper->ctx->io, block->frame, len);
+
+	if (status == SERIAL_ERR_OK)
+		status = serial_io_flush(&helper->ctx->io);
+
+	if (status == SERIAL_ERR_TIMEOUT)
+		return STM32_ERR_TIMEOUT;
+
+	if (status != SERIAL_ERR_OK)
+		return STM32_ERR_SERIAL;
+
+	return STM32_ERR_OK;
+}
+
+/* frame the block being assembled and put it on the wire */
+static stm32_errors_t helper_push(stm32_helper_t *helper, uint8_t op, uint16_t raw_size){
+
+	stm32_helper_block_t *block = &helper->blocks[(helper->head + helper->pending) % helper->window];
+	uint8_t *frame = block->frame;
+
+	block->size = helper->fill;
+	block->raw_size = raw_size;
+	block->seq = helper->seq++;
+	block->retries = 0;
+
+	frame[0] = STM32_HELPER_SYNC_HOST;
+	frame[1] = op;
+	frame[2] = block->seq;
+	frame[3] = 0;
+	put_le(frame + 4, block->address, 4);
+	put_le(frame + 8, block->size, 2);
+	put_le(frame + 10, raw_size, 2);
+	put_le(frame + STM32_HELPER_HEADER + block->size, crc32_update(0, frame, STM32_HELPER_HEADER + block->size), 4);
+
+	helper->pending++;
+	helper->fill = 0;
+
+	return helper_send(helper, block);
+}
+
+/* wait for the oldest block, a CRC error sends the whole window again */
+static stm32_errors_t helper_ack(stm32_helper_t *helper){
+
+	stm32_helper_block_t *block = &helper->blocks[helper->head];
+	uint8_t ack[STM32_HELPER_ACK] = { 0 };
+	uint32_t i = 0;
+
+	serial_errors_t status = serial_io_read_timeout(&helper->ctx->io, ack, sizeof(ack), helper_timeout(helper));
+
+	if (status == SERIAL_ERR_TIMEOUT)
+		return STM32_ERR_TIMEOUT;
+
+	if (status != SERIAL_ERR_OK)
+		return STM32_ERR_SERIAL;
+
+	helper->ctx->stats.bytes_rx += sizeof(ack);
+
+	if (ack[0] != STM32_HELPER_SYNC_TARGET || ack[1] != block->seq)
+		return STM32_ERR_PROTOCOL;
+
+	switch(ack[2]){
+		case STM32_HELPER_STATUS_OK:
+			break;
+
+		case STM32_HELPER_STATUS_CRC:
+			if (++block->retries > STM32_HELPER_RETRIES)
+				return STM32_ERR_PROTOCOL;
+
+			helper->retries++;
+
+			for(i = 0; i < helper->pending; i++){
+
+				stm32_errors_t result = helper_send(helper, &helper->blocks[(helper->head + i) % helper->window]);
+
+				if (result != STM32_ERR_OK)
+					return result;
+			}
+
+			return STM32_ERR_OK;
+
+		case STM32_HELPER_STATUS_ADDRESS:
+			return STM32_ERR_INVALID_ARGUMENT;
+
+		case STM32_HELPER_STATUS_DECODE:
+			return STM32_ERR_PROTOCOL;
+
+		default:
+			return STM32_ERR_PROTOCOL;
+	}
+
+	/* the helper must have seen exactly what was sent */
+	if (get_le(ack + 4, 4) != get_le(block->frame + STM32_HELPER_HEADER + block->size, 4))
+		return STM32_ERR_PROTOCOL;
+
+	if (helper->ctx->erased != NULL && block->raw_size > 0)
+		erase_map_written(helper->ctx->erased, block->address, block->raw_size);
+
+	helper->acked = block->address + block->raw_size;
+	helper->head = (helper->head + 1) % helper->window;
+	helper->pending--;
+
+	return STM32_ERR_OK;
+}
+
+/* make room for a new block in the window */
+static stm32_errors_t helper_slot(stm32_helper_t *helper){
+
+	stm32_errors_t result = STM32_ERR_OK;
+
+	while(helper->pending == helper->window && result == STM32_ERR_OK)
+		result = helper_ack(helper);
+
+	return result;
+}
+
+stm32_errors_t stm32_helper_start(stm32_ctx_t *ctx, stm32_helper_t *helper, const uint8_t *code, uint32_t code_size, uint32_t address){
+
+	uint8_t hello[STM32_HELPER_HELLO];
+	uint32_t offset = 0;
+	uint32_t i = 0;
+	stm32_errors_t result;
+
+	if (ctx == NULL || helper == NULL || code == NULL || code_size == 0 || address % 4 != 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	memset(helper, 0, sizeof(stm32_helper_t));
+	helper->ctx = ctx;
+
+	/* load and start it through the bootloader */
+	for(offset = 0; offset < code_size; offset += STM32_HELPER_CHUNK){
+
+		uint16_t chunk = code_size - offset < STM32_HELPER_CHUNK ? code_size - offset : STM32_HELPER_CHUNK;
+
+		if ((result = stm32_write(ctx, address + offset, code + offset, chunk)) != STM32_ERR_OK)
+			return result;
+	}
+
+	if ((result = stm32_go(ctx, address)) != STM32_ERR_OK)
+		return result;
+
+	serial_errors_t status = serial_io_read_timeout(&ctx->io, hello, sizeof(hello), ctx->timeouts.erase_ms);
+
+	if (status == SERIAL_ERR_TIMEOUT)
+		return STM32_ERR_TIMEOUT;
+
+	if (status != SERIAL_ERR_OK)
+		return STM32_ERR_SERIAL;
+
+	ctx->stats.bytes_rx += sizeof(hello);
+
+	helper->version = hello[2];
+	helper->window = hello[3];
+	helper->block_max = get_le(hello + 4, 2);
+	helper->flags = hello[6];
+
+	if (
+		hello[0] != 'S' || hello[1] != 'H' || helper->version != STM32_HELPER_VERSION ||
+		helper->window == 0 || helper->window > STM32_HELPER_WINDOW_MAX ||
+		helper->block_max < STM32_HELPER_BLOCK_MIN || helper->block_max > STM32_HELPER_BLOCK_MAX ||
+		helper->block_max % 4 != 0
+	)
+		return STM32_ERR_PROTOCOL;
+
+	helper->buffer = malloc(helper->window * helper_frame_size(helper));
+
+	if (helper->buffer == NULL)
+		return STM32_ERR_SYSTEM;
+
+	for(i = 0; i < helper->window; i++)
+		helper->blocks[i].frame = helper->buffer + i * helper_frame_size(helper);
+
+	return STM32_ERR_OK;
+}
+
+/* queue data for programming, continuous writes are gathered into blocks */
+stm32_errors_t stm32_helper_write(stm32_helper_t *helper, uint32_t address, const uint8_t *data, uint32_t size){
+
+	stm32_errors_t result = STM32_ERR_OK;
+
+	if (helper == NULL || helper->buffer == NULL || data == NULL || (address | size) % 4 != 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	while(size > 0){
+
+		stm32_helper_block_t *block = &helper->blocks[(helper->head + helper->pending) % helper->window];
+
+		if (helper->fill > 0 && (address != block->address + helper->fill || helper->fill == helper->block_max)){
+
+			if ((result = helper_push(helper, STM32_HELPER_WRITE, helper->fill)) != STM32_ERR_OK)
+				return result;
+
+			continue;
+		}
+
+		if (helper->fill == 0){
+
+			if ((result = helper_slot(helper)) != STM32_ERR_OK)
+				return result;
+
+			block = &helper->blocks[(helper->head + helper->pending) % helper->window];
+			block->address = address;
+		}
+
+		uint32_t chunk = helper->block_max - helper->fill < size ? helper->block_max - helper->fill : size;
+
+		memcpy(block->frame + STM32_HELPER_HEADER + helper->fill, data, chunk);
+		helper->fill += chunk;
+		address += chunk;
+		data += chunk;
+		size -= chunk;
+	}
+
+	return STM32_ERR_OK;
+}
+
+/* one block compressed by the host, the helper expands it to size bytes */
+stm32_errors_t stm32_helper_write_packed(stm32_helper_t *helper, uint32_t address, uint16_t size, const uint8_t *packed, uint16_t packed_size){
+
+	stm32_errors_t result = STM32_ERR_OK;
+
+	if (helper == NULL || helper->buffer == NULL || packed == NULL || (address | size) % 4 != 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if (!(helper->flags & STM32_HELPER_FLAG_LZ4) || size > helper->block_max || packed_size > helper->block_max)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	/* whatever is being gathered goes first, blocks are programmed in order */
+	if (helper->fill > 0 && (result = helper_push(helper, STM32_HELPER_WRITE, helper->fill)) != STM32_ERR_OK)
+		return result;
+
+	if ((result = helper_slot(helper)) != STM32_ERR_OK)
+		return result;
+
+	stm32_helper_block_t *block = &helper->blocks[(helper->head + helper->pending) % helper->window];
+
+	block->address = address;
+	memcpy(block->frame + STM32_HELPER_HEADER, packed, packed_size);
+	helper->fill = packed_size;
+	helper->bytes_packed += packed_size;
+
+	return helper_push(helper, STM32_HELPER_WRITE_LZ4, size);
+}
+
+/* send the partial block and wait until everything is programmed */
+stm32_errors_t stm32_helper_flush(stm32_helper_t *helper){
+
+	stm32_errors_t result = STM32_ERR_OK;
+
+	if (helper == NULL || helper->buffer == NULL)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if (helper->fill > 0)
+		result = helper_push(helper, STM32_HELPER_WRITE, helper->fill);
+
+	while(helper->pending > 0 && result == STM32_ERR_OK)
+		result = helper_ack(helper);
+
+	return result;
+}
+
+/* end the session, the target resets into the bootloader and is synchronised again */
+stm32_errors_t stm32_helper_stop(stm32_helper_t *helper){
+
+	stm32_errors_t result;
+	int i = 0;
+
+	if (helper == NULL || helper->buffer == NULL)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	result = stm32_helper_flush(helper);
+
+	if (result == STM32_ERR_OK && (result = helper_slot(helper)) == STM32_ERR_OK){
+
+		helper->blocks[(helper->head + helper->pending) % helper->window].address = 0;
+
+		if ((result = helper_push(helper, STM32_HELPER_RESET, 0)) == STM32_ERR_OK)
+			result = stm32_helper_flush(helper);
+	}
+
+	free(helper->buffer);
+	helper->buffer = NULL;
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	/* the first autobaud byte may arrive while the bootloader is still starting */
+	for(i = 0; i < 3; i++)
+		if ((result = stm32_init(helper->ctx)) != STM32_ERR_TIMEOUT)
+			break;
+
+	return result;
+}
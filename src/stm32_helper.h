@@ -0,0 +1,112 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+
+#ifndef STM32_HELPER_H_
+#define STM32_HELPER_H_
+
+#include <stdint.h>
+#include "stm32.h"
+
+/*
+	windowed block protocol of a flash programming helper, a small program
+	the host loads into SRAM with 'write memory' and starts with 'go'; the
+	helper itself is target firmware and is not part of this tree
+
+	helper -> host, once running:
+		hello   'S' 'H' version window block_max(le16) flags 0
+
+	host -> helper, seq counts up from 0 and wraps:
+		header  0xA5 op seq 0 address(le32) size(le16) raw_size(le16)
+		payload size bytes, LZ4 block format for STM32_HELPER_WRITE_LZ4
+		crc     CRC-32 of header and payload (le32)
+
+	helper -> host, one per block in block order:
+		ack     0x5A seq status 0 crc(le32), the CRC-32 as received
+
+	at most 'window' blocks are unacknowledged; after a bad CRC the helper
+	answers STM32_HELPER_STATUS_CRC and drops blocks until that seq is sent
+	again. STM32_HELPER_RESET is acknowledged, then the target resets back
+	into the bootloader.
+*/
+
+#define STM32_HELPER_VERSION		1
+#define STM32_HELPER_HELLO			8
+#define STM32_HELPER_HEADER			12
+#define STM32_HELPER_ACK			8
+#define STM32_HELPER_SYNC_HOST		(uint8_t)0xA5
+#define STM32_HELPER_SYNC_TARGET	(uint8_t)0x5A
+
+#define STM32_HELPER_WRITE			(uint8_t)'W'	/* program size bytes at address */
+#define STM32_HELPER_WRITE_LZ4		(uint8_t)'Z'	/* decompress, then program raw_size bytes */
+#define STM32_HELPER_RESET			(uint8_t)'R'	/* end of session */
+
+#define STM32_HELPER_STATUS_OK		0
+#define STM32_HELPER_STATUS_CRC		1	/* resend from this block on */
+#define STM32_HELPER_STATUS_ADDRESS	2	/* outside flash or misaligned */
+#define STM32_HELPER_STATUS_PROGRAM	3	/* programming or its verify failed */
+#define STM32_HELPER_STATUS_DECODE	4	/* payload did not decompress to raw_size */
+
+#define STM32_HELPER_FLAG_LZ4		0x01	/* hello flag, STM32_HELPER_WRITE_LZ4 is understood */
+
+#define STM32_HELPER_WINDOW_MAX		16
+#define STM32_HELPER_BLOCK_MIN		0x100
+#define STM32_HELPER_BLOCK_MAX		0x4000
+#define STM32_HELPER_RETRIES		3	/* CRC errors tolerated per block */
+
+typedef struct stm32_helper_block {
+	uint32_t address;
+	uint16_t size;
+	uint16_t raw_size;	/* bytes programmed */
+	uint8_t seq;
+	uint8_t retries;
+	uint8_t *frame;		/* header, payload and CRC as sent */
+} stm32_helper_block_t ;
+
+typedef struct stm32_helper {
+	stm32_ctx_t *ctx;
+	uint8_t version;
+	uint8_t window;
+	uint16_t block_max;
+	uint8_t flags;
+
+	/* sent and not yet acknowledged, oldest at head, the next free slot is assembled in */
+	stm32_helper_block_t blocks[STM32_HELPER_WINDOW_MAX];
+	uint8_t *buffer;
+	uint8_t head;
+	uint8_t pending;
+	uint8_t seq;
+	uint32_t fill;
+
+	uint32_t acked;		/* end address of the last acknowledged block */
+	uint32_t blocks_sent;
+	uint32_t retries;
+	uint64_t bytes_packed;	/* compressed payload sent, retries excluded */
+} stm32_helper_t ;
+
+stm32_errors_t stm32_helper_start(stm32_ctx_t *ctx, stm32_helper_t *helper, const uint8_t *code, uint32_t code_size, uint32_t address);
+stm32_errors_t stm32_helper_write(stm32_helper_t *helper, uint32_t address, const uint8_t *data, uint32_t size);
+stm32_errors_t stm32_helper_write_packed(stm32_helper_t *helper, uint32_t address, uint16_t size, const uint8_t *packed, uint16_t packed_size);
+stm32_errors_t stm32_helper_flush(stm32_helper_t *helper);
+stm32_errors_t stm32_helper_stop(stm32_helper_t *helper);
+
+#endif /* STM32_HELPER_H_ */
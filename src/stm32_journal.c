@@ -0,0 +1,358 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "stm32.h"
+#include "stm32_cache.h"
+#include "stm32_journal.h"
+#include "image.h"
+#include "geometry.h"
+#include "sha256.h"
+
+#define STM32_JOURNAL_MAGIC		"STM32JNL"
+#define STM32_JOURNAL_VERSION	1
+
+/* header: magic, version, pid, uid, image hash, flash size, pages count */
+#define STM32_JOURNAL_HEADER	(8 + 4 + 2 + STM32_UID_SIZE + SHA256_DIGEST_SIZE + 4 + 4)
+
+/* record: type, pad, page, address */
+#define STM32_JOURNAL_RECORD	8
+
+#define RECORD_ERASED		'E'	/* page erased */
+#define RECORD_ERASED_ALL	'M'	/* mass erase */
+#define RECORD_WRITTEN		'W'	/* frames programmed up to the address */
+
+static void put_le(uint8_t *buffer, uint32_t value, int size){
+
+	int i = 0;
+
+	for(i = 0; i < size; i++)
+		buffer[i] = (value >> (i * 8)) & 0xFF;
+}
+
+static uint32_t get_le(const uint8_t *buffer, int size){
+
+	uint32_t value = 0;
+	int i = 0;
+
+	for(i = size - 1; i >= 0; i--)
+		value = (value << 8) | buffer[i];
+
+	return value;
+}
+
+static int write_all(int fd, const uint8_t *buffer, size_t size){
+
+	while(size > 0){
+
+		ssize_t written = write(fd, buffer, size);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written < 0)
+			return -1;
+
+		buffer += written;
+		size -= written;
+	}
+
+	return 0;
+}
+
+/* segment addresses are part of the hash, a relinked image never resumes */
+static void journal_image_hash(const image_t *image, uint8_t *hash){
+
+	uint8_t header[8];
+	uint32_t i = 0;
+	sha256_t sha;
+
+	sha256_init(&sha);
+
+	for(i = 0; i < image->segments_count; i++){
+
+		const image_segment_t *segment = &image->segments[i];
+
+		put_le(header, segment->address, 4);
+		put_le(header + 4, segment->size, 4);
+		sha256_update(&sha, header, sizeof(header));
+		sha256_update(&sha, segment->data, segment->size);
+	}
+
+	sha256_final(&sha, hash);
+}
+
+static void journal_header(const stm32_journal_t *journal, uint8_t *header){
+
+	memcpy(header, STM32_JOURNAL_MAGIC, 8);
+	put_le(header + 8, STM32_JOURNAL_VERSION, 4);
+	put_le(header + 12, journal->pid, 2);
+	memcpy(header + 14, journal->uid, STM32_UID_SIZE);
+	memcpy(header + 14 + STM32_UID_SIZE, journal->image_hash, SHA256_DIGEST_SIZE);
+	put_le(header + 14 + STM32_UID_SIZE + SHA256_DIGEST_SIZE, geometry_size(journal->geometry), 4);
+	put_le(header + 18 + STM32_UID_SIZE + SHA256_DIGEST_SIZE, journal->pages_count, 4);
+}
+
+static void journal_apply(stm32_journal_t *journal, const uint8_t *record){
+
+	uint16_t page = get_le(record + 2, 2);
+	uint32_t address, size;
+
+	switch(record[0]){
+		case RECORD_ERASED:
+			if (page >= journal->pages_count)
+				break;
+
+			journal->erased[page] = 1;
+			geometry_page(journal->geometry, page, &address, &size);
+
+			/* erasing wipes whatever was programmed in the page */
+			if (journal->written > address)
+				journal->written = address;
+
+			break;
+
+		case RECORD_ERASED_ALL:
+			memset(journal->erased, 1, journal->pages_count);
+			journal->erased_all = 1;
+			journal->written = 0;
+			break;
+
+		case RECORD_WRITTEN:
+			journal->written = get_le(record + 4, 4);
+			break;
+	}
+
+	journal->records++;
+}
+
+/* replay a journal left by an earlier run, returns its length when it can be continued */
+static off_t journal_load(stm32_journal_t *journal){
+
+	uint8_t header[STM32_JOURNAL_HEADER];
+	uint8_t expected[STM32_JOURNAL_HEADER];
+	uint8_t record[STM32_JOURNAL_RECORD];
+
+	FILE *file = fopen(journal->path, "rb");
+
+	if (file == NULL)
+		return 0;
+
+	journal_header(journal, expected);
+
+	/* a journal of another device or image is simply started over */
+	if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, expected, sizeof(header)) != 0){
+		fclose(file);
+		return 0;
+	}
+
+	/* a torn last record is dropped */
+	while(fread(record, sizeof(record), 1, file) == 1)
+		journal_apply(journal, record);
+
+	fclose(file);
+
+	return STM32_JOURNAL_HEADER + (off_t)journal->records * STM32_JOURNAL_RECORD;
+}
+
+static stm32_errors_t journal_record(stm32_journal_t *journal, uint8_t type, uint16_t page, uint32_t address){
+
+	uint8_t record[STM32_JOURNAL_RECORD];
+
+	/* finished, the file is gone */
+	if (journal->fd < 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	record[0] = type;
+	record[1] = 0;
+	put_le(record + 2, page, 2);
+	put_le(record + 4, address, 4);
+
+	if (write_all(journal->fd, record, sizeof(record)) != 0)
+		return STM32_ERR_SYSTEM;
+
+	journal_apply(journal, record);
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_journal_open(stm32_ctx_t *ctx, stm32_journal_t *journal, const char *dir, const image_t *image, const geometry_t *geometry, uint32_t uid_address){
+
+	if (journal == NULL || dir == NULL || image == NULL || geometry == NULL)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	memset(journal, 0, sizeof(stm32_journal_t));
+	journal->fd = -1;
+	journal->page = -1;
+
+	/* a journal only applies to the same device and the same image */
+	stm32_errors_t result = stm32_identify(ctx, uid_address, &journal->pid, journal->uid);
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	if (stm32_device_path(journal->path, sizeof(journal->path), dir, journal->pid, journal->uid, "journal") != 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	journal->geometry = geometry;
+	journal->pages_count = geometry_pages(geometry);
+	journal->erased = calloc(journal->pages_count, 1);
+
+	if (journal->erased == NULL)
+		return STM32_ERR_SYSTEM;
+
+	journal_image_hash(image, journal->image_hash);
+
+	off_t length = journal_load(journal);
+
+	journal->fd = open(journal->path, O_WRONLY | O_CREAT, 0644);
+
+	if (journal->fd < 0){
+		stm32_journal_close(journal);
+		return STM32_ERR_SYSTEM;
+	}
+
+	if (length == 0)
+		result = stm32_journal_reset(journal);
+	else if (ftruncate(journal->fd, length) != 0 || lseek(journal->fd, length, SEEK_SET) != length)
+		result = STM32_ERR_SYSTEM;
+
+	if (result != STM32_ERR_OK)
+		stm32_journal_close(journal);
+
+	return result;
+}
+
+void stm32_journal_close(stm32_journal_t *journal){
+
+	if (journal == NULL)
+		return;
+
+	if (journal->fd >= 0)
+		close(journal->fd);
+
+	free(journal->erased);
+
+	journal->fd = -1;
+	journal->erased = NULL;
+	journal->pages_count = 0;
+}
+
+/* forget the earlier run, the journal holds just the header afterwards */
+stm32_errors_t stm32_journal_reset(stm32_journal_t *journal){
+
+	uint8_t header[STM32_JOURNAL_HEADER];
+
+	if (journal->fd < 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	memset(journal->erased, 0, journal->pages_count);
+	journal->erased_all = 0;
+	journal->records = 0;
+	journal->written = 0;
+	journal->page = -1;
+
+	journal_header(journal, header);
+
+	if (
+		ftruncate(journal->fd, 0) != 0 ||
+		lseek(journal->fd, 0, SEEK_SET) != 0 ||
+		write_all(journal->fd, header, sizeof(header)) != 0 ||
+		fdatasync(journal->fd) != 0
+	)
+		return STM32_ERR_SYSTEM;
+
+	return STM32_ERR_OK;
+}
+
+/* the run completed, nothing is left to resume, another run opens the journal again */
+stm32_errors_t stm32_journal_finish(stm32_journal_t *journal){
+
+	if (journal->fd < 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	/* appends after this would land in an unlinked file */
+	close(journal->fd);
+	journal->fd = -1;
+
+	if (unlink(journal->path) != 0)
+		return STM32_ERR_SYSTEM;
+
+	memset(journal->erased, 0, journal->pages_count);
+	journal->erased_all = 0;
+	journal->records = 0;
+	journal->written = 0;
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_journal_erased(stm32_journal_t *journal, const uint16_t *pages, uint32_t pages_size){
+
+	stm32_errors_t result = STM32_ERR_OK;
+	uint32_t i = 0;
+
+	for(i = 0; i < pages_size && result == STM32_ERR_OK; i++)
+		result = journal_record(journal, RECORD_ERASED, pages[i], 0);
+
+	return result;
+}
+
+stm32_errors_t stm32_journal_erased_all(stm32_journal_t *journal){
+	return journal_record(journal, RECORD_ERASED_ALL, 0, 0);
+}
+
+/*
+	called before programming at address; once a new page is entered the
+	records of the previous ones must survive a crash, otherwise a resumed
+	run could skip erasing a page that was already partly programmed
+*/
+stm32_errors_t stm32_journal_enter(stm32_journal_t *journal, uint32_t address){
+
+	uint16_t page;
+
+	if (geometry_find(journal->geometry, address, &page) != 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if (page == journal->page)
+		return STM32_ERR_OK;
+
+	if (journal->fd < 0)
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	if (fdatasync(journal->fd) != 0)
+		return STM32_ERR_SYSTEM;
+
+	journal->page = page;
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_journal_written(stm32_journal_t *journal, uint32_t end){
+	return journal_record(journal, RECORD_WRITTEN, 0, end);
+}
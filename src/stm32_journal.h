@@ -0,0 +1,65 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+
+#ifndef STM32_JOURNAL_H_
+#define STM32_JOURNAL_H_
+
+#include <stdint.h>
+#include <limits.h>
+#include "stm32.h"
+#include "image.h"
+#include "geometry.h"
+#include "sha256.h"
+#include "stm32_cache.h"
+
+/*
+	append-only record of a flashing run, keyed by device and image, so an
+	interrupted run can pick up where it stopped instead of starting over
+*/
+typedef struct stm32_journal {
+	char path[PATH_MAX];
+	int fd;
+	uint16_t pid;
+	uint8_t uid[STM32_UID_SIZE];
+	uint8_t image_hash[SHA256_DIGEST_SIZE];
+	const geometry_t *geometry;
+	uint32_t pages_count;
+
+	/* what the interrupted run left behind */
+	uint32_t records;
+	uint8_t *erased;	/* pages erased and not programmed past 'written' */
+	uint8_t erased_all;	/* a mass erase completed */
+	uint32_t written;	/* every frame ending at or below was programmed */
+	int32_t page;		/* page being programmed, earlier records are on disk */
+} stm32_journal_t ;
+
+stm32_errors_t stm32_journal_open(stm32_ctx_t *ctx, stm32_journal_t *journal, const char *dir, const image_t *image, const geometry_t *geometry, uint32_t uid_address);
+void stm32_journal_close(stm32_journal_t *journal);
+stm32_errors_t stm32_journal_reset(stm32_journal_t *journal);
+stm32_errors_t stm32_journal_finish(stm32_journal_t *journal);
+stm32_errors_t stm32_journal_erased(stm32_journal_t *journal, const uint16_t *pages, uint32_t pages_size);
+stm32_errors_t stm32_journal_erased_all(stm32_journal_t *journal);
+stm32_errors_t stm32_journal_enter(stm32_journal_t *journal, uint32_t address);
+stm32_errors_t stm32_journal_written(stm32_journal_t *journal, uint32_t end);
+
+#endif /* STM32_JOURNAL_H_ */
@@ -0,0 +1,178 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "stm32_pack.h"
+#include "image.h"
+#include "geometry.h"
+#include "lz4.h"
+
+static int pack_grow(stm32_pack_t *pack, uint32_t *capacity, uint32_t *data_capacity){
+
+	if (pack->blocks_count == *capacity){
+
+		uint32_t grown = *capacity ? *capacity * 2 : 64;
+		stm32_pack_block_t *blocks = realloc(pack->blocks, grown * sizeof(stm32_pack_block_t));
+
+		if (blocks == NULL)
+			return -1;
+
+		pack->blocks = blocks;
+		*capacity = grown;
+	}
+
+	if (pack->data_size + LZ4_BOUND(pack->block_size) > *data_capacity){
+
+		uint32_t grown = *data_capacity ? *data_capacity * 2 : 16 * LZ4_BOUND(pack->block_size);
+		uint8_t *data = realloc(pack->data, grown);
+
+		if (data == NULL)
+			return -1;
+
+		pack->data = data;
+		*data_capacity = grown;
+	}
+
+	return 0;
+}
+
+static void pack_block(stm32_pack_t *pack, uint32_t address, const uint8_t *raw, uint32_t size){
+
+	stm32_pack_block_t *block = &pack->blocks[pack->blocks_count++];
+	uint8_t *out = pack->data + pack->data_size;
+	uint32_t packed = lz4_compress(raw, size, out, LZ4_BOUND(pack->block_size));
+
+	block->address = address;
+	block->size = size;
+	block->offset = pack->data_size;
+
+	/* incompressible data goes out as is */
+	if (packed == 0 || packed >= size){
+		memcpy(out, raw, size);
+		block->packed_size = 0;
+		pack->data_size += size;
+	} else {
+		block->packed_size = packed;
+		pack->data_size += packed;
+	}
+
+	pack->size += size;
+}
+
+/* cut the image into blocks that never cross a block_size or page boundary */
+int stm32_pack_init(stm32_pack_t *pack, const image_t *image, const geometry_t *geometry, uint32_t block_size){
+
+	image_frames_t frames;
+	image_frame_t frame;
+	uint32_t capacity = 0;
+	uint32_t data_capacity = 0;
+	uint32_t address = 0;
+	uint32_t size = 0;
+	uint16_t page = 0;
+	uint16_t frame_page = 0;
+	uint8_t *raw;
+
+	if (pack == NULL || image == NULL)
+		return -1;
+
+	if (block_size == 0)
+		block_size = STM32_PACK_BLOCK;
+
+	/* frames are windows of IMAGE_FRAME_SIZE, blocks are made of whole windows */
+	if (block_size % IMAGE_FRAME_SIZE != 0 || block_size > 0xFFFF || !image_ordered(image))
+		return -1;
+
+	memset(pack, 0, sizeof(stm32_pack_t));
+	pack->image = image;
+	pack->block_size = block_size;
+
+	raw = malloc(block_size);
+
+	if (raw == NULL)
+		return -1;
+
+	image_frames_init(&frames, image);
+
+	while(image_frames_next(&frames, &frame)){
+
+		if (geometry != NULL && geometry_find(geometry, frame.address, &frame_page) != 0)
+			goto failed;
+
+		int split =
+			frame.address != address + size ||
+			frame.address / block_size != address / block_size ||
+			(geometry != NULL && frame_page != page);
+
+		if (size > 0 && split){
+
+			if (pack_grow(pack, &capacity, &data_capacity) != 0)
+				goto failed;
+
+			pack_block(pack, address, raw, size);
+			size = 0;
+		}
+
+		if (size == 0){
+			address = frame.address;
+			page = frame_page;
+		}
+
+		memcpy(raw + size, frame.data, frame.size);
+		size += frame.size;
+	}
+
+	if (size > 0){
+
+		if (pack_grow(pack, &capacity, &data_capacity) != 0)
+			goto failed;
+
+		pack_block(pack, address, raw, size);
+	}
+
+	free(raw);
+
+	return 0;
+
+failed:
+	free(raw);
+	stm32_pack_free(pack);
+
+	return -1;
+}
+
+void stm32_pack_free(stm32_pack_t *pack){
+
+	if (pack == NULL)
+		return;
+
+	free(pack->blocks);
+	free(pack->data);
+
+	pack->blocks = NULL;
+	pack->blocks_count = 0;
+	pack->data = NULL;
+	pack->data_size = 0;
+	pack->size = 0;
+}
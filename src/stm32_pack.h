@@ -0,0 +1,55 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+
+#ifndef STM32_PACK_H_
+#define STM32_PACK_H_
+
+#include <stdint.h>
+#include "image.h"
+#include "geometry.h"
+
+#define STM32_PACK_BLOCK	0x1000	/* default block, must fit the helper's block size */
+
+/* continuous run of the image, LZ4 compressed unless that did not pay off */
+typedef struct stm32_pack_block {
+	uint32_t address;
+	uint16_t size;
+	uint16_t packed_size;	/* 0 when the block is stored as is */
+	uint32_t offset;		/* into stm32_pack_t.data */
+} stm32_pack_block_t ;
+
+/* an image compressed once, shared read-only by every upload of it */
+typedef struct stm32_pack {
+	const image_t *image;
+	uint32_t block_size;
+	stm32_pack_block_t *blocks;
+	uint32_t blocks_count;
+	uint8_t *data;
+	uint32_t data_size;
+	uint32_t size;			/* bytes the blocks cover, padding included */
+} stm32_pack_t ;
+
+int stm32_pack_init(stm32_pack_t *pack, const image_t *image, const geometry_t *geometry, uint32_t block_size);
+void stm32_pack_free(stm32_pack_t *pack);
+
+#endif /* STM32_PACK_H_ */
@@ -0,0 +1,314 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "stm32.h"
+#include "stm32_verify.h"
+#include "crc32.h"
+
+#define LANE_LOW	0x7F7F7F7F7F7F7F7FULL
+#define LANE_HIGH	0x8080808080808080ULL
+
+typedef struct verify_state {
+	stm32_ctx_t *ctx;
+	stm32_verify_t *verify;
+	uint32_t done;
+	uint32_t total;
+} verify_state_t ;
+
+static uint32_t verify_unit(const stm32_verify_t *verify, uint32_t address){
+
+	uint16_t page = 0;
+
+	if (verify->geometry != NULL){
+		geometry_find(verify->geometry, address, &page);
+		return page;
+	}
+
+	return (address - verify->map_base) / STM32_VERIFY_UNIT;
+}
+
+static void verify_mark(stm32_verify_t *verify, uint32_t address){
+
+	uint32_t unit = verify_unit(verify, address);
+
+	if (unit >= verify->units || (verify->mismatch_map[unit / 8] & (1 << (unit % 8))))
+		return;
+
+	verify->mismatch_map[unit / 8] |= 1 << (unit % 8);
+	verify->units_mismatched++;
+}
+
+/* differing bytes, eight lanes at a time, *first is left at the lowest one */
+static uint32_t verify_compare(const uint8_t *a, const uint8_t *b, uint32_t size, uint32_t *first){
+
+	uint32_t count = 0;
+	uint32_t i = 0;
+
+	*first = size;
+
+	for(; i + 8 <= size; i += 8){
+
+		uint64_t x;
+		uint64_t y;
+
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+
+		x ^= y;
+
+		if (x == 0)
+			continue;
+
+		/* high bit of every non-zero lane */
+		x = (((x & LANE_LOW) + LANE_LOW) | x) & LANE_HIGH;
+		count += __builtin_popcountll(x);
+
+		if (*first == size)
+			for(*first = i; a[*first] == b[*first]; (*first)++);
+	}
+
+	for(; i < size; i++)
+		if (a[i] != b[i] && count++ == 0)
+			*first = i;
+
+	return count;
+}
+
+/* reads a run back frame by frame and maps the differences */
+static stm32_errors_t verify_read(verify_state_t *state, uint32_t address, uint32_t size){
+
+	stm32_verify_t *verify = state->verify;
+	image_frames_t frames;
+	image_frame_t frame;
+
+	verify->runs_read++;
+
+	image_frames_range(&frames, verify->image, address, size);
+
+	while(image_frames_next(&frames, &frame)){
+
+		uint8_t *data;
+		uint32_t first;
+
+		stm32_errors_t result = stm32_read(state->ctx, frame.address, &data, frame.size);
+
+		if (result != STM32_ERR_OK)
+			return result;
+
+		/* libc compares with the widest vectors it has, the lanes only run on a difference */
+		if (memcmp(data, frame.data, frame.size) == 0)
+			continue;
+
+		uint32_t count = verify_compare(data, frame.data, frame.size, &first);
+
+		if (verify->bytes_mismatched == 0 || frame.address + first < verify->first_mismatch)
+			verify->first_mismatch = frame.address + first;
+
+		verify->bytes_mismatched += count;
+		verify_mark(verify, frame.address + first);
+	}
+
+	return STM32_ERR_OK;
+}
+
+/* a continuous run inside one unit, crc is the host side CRC of its frames */
+static stm32_errors_t verify_run(verify_state_t *state, uint32_t address, uint32_t size, uint32_t crc, uint32_t payload){
+
+	stm32_verify_t *verify = state->verify;
+	stm32_errors_t result = STM32_ERR_OK;
+
+	if (verify->checksummed){
+
+		uint32_t device;
+
+		result = stm32_get_checksum(state->ctx, address, size, CRC32_STM32_POLY, CRC32_STM32_INIT, &device);
+
+		/* a mismatch or an area the target refuses to checksum is read back */
+		if (result == STM32_ERR_OK && device == crc)
+			verify->runs_checksummed++;
+		else if (result == STM32_ERR_OK || result == STM32_ERR_INVALID_ARGUMENT)
+			result = verify_read(state, address, size);
+
+	} else {
+		result = verify_read(state, address, size);
+	}
+
+	if (result != STM32_ERR_OK)
+		return result;
+
+	state->done += payload;
+
+	if (verify->progress != NULL)
+		verify->progress(state->done, state->total, verify->progress_arg);
+
+	return STM32_ERR_OK;
+}
+
+static int verify_offers_checksum(stm32_ctx_t *ctx, stm32_errors_t *result){
+
+	uint8_t version;
+	uint8_t *commands;
+	uint8_t commands_size;
+
+	*result = stm32_get(ctx, &version, &commands, &commands_size);
+
+	return *result == STM32_ERR_OK && memchr(commands, STM32_GET_CHECKSUM, commands_size) != NULL;
+}
+
+/* sizes the mismatch map, the geometry has to hold the whole image */
+static stm32_errors_t verify_map(stm32_verify_t *verify){
+
+	const image_t *image = verify->image;
+	uint32_t i = 0;
+
+	verify->map_base = 0;
+	verify->units = 0;
+
+	if (image->segments_count == 0)
+		return STM32_ERR_OK;
+
+	if (verify->geometry != NULL){
+
+		uint16_t page;
+
+		for(i = 0; i < image->segments_count; i++){
+
+			const image_segment_t *segment = &image->segments[i];
+
+			if (
+				geometry_find(verify->geometry, segment->address, &page) != 0 ||
+				geometry_find(verify->geometry, segment->address + segment->size - 1, &page) != 0
+			)
+				return STM32_ERR_INVALID_ARGUMENT;
+		}
+
+		verify->map_base = verify->geometry->base;
+		verify->units = geometry_pages(verify->geometry);
+
+	} else {
+
+		const image_segment_t *last = &image->segments[image->segments_count - 1];
+		uint64_t end = (uint64_t)last->address + last->size;
+
+		verify->map_base = image->segments[0].address & ~(uint32_t)(STM32_VERIFY_UNIT - 1);
+		verify->units = (end - verify->map_base + STM32_VERIFY_UNIT - 1) / STM32_VERIFY_UNIT;
+	}
+
+	verify->mismatch_map = calloc((verify->units + 7) / 8 + 1, 1);
+
+	if (verify->mismatch_map == NULL)
+		return STM32_ERR_SYSTEM;
+
+	return STM32_ERR_OK;
+}
+
+stm32_errors_t stm32_verify(stm32_ctx_t *ctx, stm32_verify_t *verify){
+
+	verify_state_t state;
+	image_frames_t frames;
+	image_frame_t frame;
+	stm32_errors_t result;
+
+	if (ctx == NULL || verify == NULL || verify->image == NULL || !image_ordered(verify->image))
+		return STM32_ERR_INVALID_ARGUMENT;
+
+	verify->checksummed = 0;
+	verify->runs_checksummed = 0;
+	verify->runs_read = 0;
+	verify->bytes_mismatched = 0;
+	verify->first_mismatch = 0;
+	verify->units_mismatched = 0;
+	verify->mismatch_map = NULL;
+
+	if ((result = verify_map(verify)) != STM32_ERR_OK)
+		return result;
+
+	if (!verify->read_back){
+
+		verify->checksummed = verify_offers_checksum(ctx, &result);
+
+		if (result != STM32_ERR_OK){
+			stm32_verify_free(verify);
+			return result;
+		}
+	}
+
+	state.ctx = ctx;
+	state.verify = verify;
+	state.done = 0;
+	state.total = image_size(verify->image);
+
+	/* runs of adjacent frames are cut at unit boundaries so a mismatch names its unit */
+	uint32_t run_address = 0;
+	uint32_t run_size = 0;
+	uint32_t run_unit = 0;
+	uint32_t run_payload = 0;
+	uint32_t crc = CRC32_STM32_INIT;
+
+	image_frames_init(&frames, verify->image);
+
+	while(image_frames_next(&frames, &frame)){
+
+		uint32_t unit = verify_unit(verify, frame.address);
+
+		if (run_size > 0 && (frame.address != run_address + run_size || unit != run_unit)){
+
+			if ((result = verify_run(&state, run_address, run_size, crc, run_payload)) != STM32_ERR_OK)
+				break;
+
+			run_size = 0;
+		}
+
+		if (run_size == 0){
+			run_address = frame.address;
+			run_unit = unit;
+			run_payload = 0;
+			crc = CRC32_STM32_INIT;
+		}
+
+		if (verify->checksummed)
+			crc = crc32_stm32(crc, frame.data, frame.size / 4);
+
+		run_size += frame.size;
+		run_payload += frame.payload;
+	}
+
+	if (result == STM32_ERR_OK && run_size > 0)
+		result = verify_run(&state, run_address, run_size, crc, run_payload);
+
+	if (result != STM32_ERR_OK)
+		stm32_verify_free(verify);
+
+	return result;
+}
+
+void stm32_verify_free(stm32_verify_t *verify){
+
+	if (verify == NULL)
+		return;
+
+	free(verify->mismatch_map);
+	verify->mismatch_map = NULL;
+}
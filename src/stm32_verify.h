@@ -0,0 +1,58 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef STM32_VERIFY_H_
+#define STM32_VERIFY_H_
+
+#include <stdint.h>
+#include "stm32.h"
+#include "image.h"
+#include "geometry.h"
+
+#define STM32_VERIFY_UNIT	0x1000	/* mismatch map granularity without a geometry */
+
+typedef struct stm32_verify {
+	const image_t *image;
+	const geometry_t *geometry;	/* optional, maps mismatches to erase pages */
+	uint8_t read_back;			/* compare read back data even if 'get checksum' is offered */
+	stm32_progress_t progress;
+	void *progress_arg;
+
+	/*
+	 * filled in by stm32_verify(), bit i of the map is page i of the geometry,
+	 * or the unit at map_base + i * STM32_VERIFY_UNIT without one
+	 */
+	uint8_t checksummed;		/* the target computed CRCs over the image */
+	uint32_t runs_checksummed;	/* areas matched by their CRC alone */
+	uint32_t runs_read;			/* areas read back, including checksum mismatches */
+	uint32_t bytes_mismatched;
+	uint32_t first_mismatch;	/* address of the first differing byte, valid with bytes_mismatched */
+	uint32_t map_base;
+	uint32_t units;
+	uint32_t units_mismatched;
+	uint8_t *mismatch_map;		/* released by stm32_verify_free() */
+} stm32_verify_t ;
+
+stm32_errors_t stm32_verify(stm32_ctx_t *ctx, stm32_verify_t *verify);
+void stm32_verify_free(stm32_verify_t *verify);
+
+#endif /* STM32_VERIFY_H_ */
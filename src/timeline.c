@@ -0,0 +1,139 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "timeline.h"
+#include "clock.h"
+
+void timeline_init(timeline_t *timeline, const char *name, uint32_t id, uint32_t events_max){
+
+	memset(timeline, 0, sizeof(timeline_t));
+
+	if (name != NULL)
+		strncpy(timeline->name, name, TIMELINE_NAME_SIZE - 1);
+
+	timeline->id = id;
+	timeline->events_max = events_max;
+}
+
+void timeline_free(timeline_t *timeline){
+
+	free(timeline->events);
+
+	timeline->events = NULL;
+	timeline->events_count = 0;
+	timeline->events_capacity = 0;
+}
+
+/* span from start_us to now, NULL when it could not be stored */
+timeline_event_t *timeline_add(timeline_t *timeline, timeline_kind_t kind, const char *name, uint64_t start_us){
+
+	uint64_t now = clock_now_us();
+
+	if (timeline->events_max != 0 && timeline->events_count >= timeline->events_max){
+		timeline->dropped++;
+		return NULL;
+	}
+
+	if (timeline->events_count == timeline->events_capacity){
+
+		uint32_t capacity = timeline->events_capacity ? timeline->events_capacity * 2 : 1024;
+		timeline_event_t *events = realloc(timeline->events, capacity * sizeof(timeline_event_t));
+
+		if (events == NULL){
+			timeline->dropped++;
+			return NULL;
+		}
+
+		timeline->events = events;
+		timeline->events_capacity = capacity;
+	}
+
+	timeline_event_t *event = &timeline->events[timeline->events_count++];
+
+	memset(event, 0, sizeof(timeline_event_t));
+	event->name = name;
+	event->kind = kind;
+	event->start_us = start_us;
+	event->duration_us = now - start_us;
+
+	return event;
+}
+
+static void timeline_quote(FILE *out, const char *text){
+
+	fputc('"', out);
+
+	for(; *text; text++){
+		if (*text == '"' || *text == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*text >= 0x20)
+			fputc(*text, out);
+	}
+
+	fputc('"', out);
+}
+
+/* Chrome trace event format, loads in chrome://tracing and Perfetto, one thread per port */
+int timeline_write(FILE *out, timeline_t *const *timelines, uint32_t timelines_count){
+
+	uint32_t t = 0;
+	uint32_t i = 0;
+	uint32_t written = 0;
+
+	fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", out);
+
+	for(t = 0; t < timelines_count; t++){
+
+		const timeline_t *timeline = timelines[t];
+
+		fprintf(out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": ",
+			written++ ? "," : "", timeline->id);
+		timeline_quote(out, timeline->name);
+		fputs("}}", out);
+
+		for(i = 0; i < timeline->events_count; i++){
+
+			const timeline_event_t *event = &timeline->events[i];
+
+			fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %llu, \"dur\": %llu, \"args\": {",
+				event->name, event->kind == TIMELINE_COMMAND ? "command" : "phase", timeline->id,
+				(unsigned long long)event->start_us, (unsigned long long)event->duration_us);
+
+			if (event->kind == TIMELINE_COMMAND)
+				fprintf(out, "\"address\": \"0x%08X\", \"size\": %u, \"result\": %d}}", event->address, event->size, event->result);
+			else
+				fprintf(out, "\"bytes\": %u}}", event->size);
+		}
+
+		if (timeline->dropped)
+			fprintf(out, ",\n{\"name\": \"dropped %u events\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %u, \"ts\": %llu}",
+				timeline->dropped, timeline->id,
+				(unsigned long long)(timeline->events_count ? timeline->events[timeline->events_count - 1].start_us : 0));
+	}
+
+	fputs("\n]}\n", out);
+
+	return ferror(out) ? -1 : 0;
+}
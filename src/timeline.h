@@ -0,0 +1,62 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TIMELINE_NAME_SIZE	64
+
+typedef enum timeline_kind {
+	TIMELINE_COMMAND,	/* one stm32_* call */
+	TIMELINE_PHASE		/* one transfer inside it: command byte, address, data, ACK wait */
+} timeline_kind_t ;
+
+typedef struct timeline_event {
+	const char *name;	/* static string */
+	uint8_t kind;
+	int8_t result;		/* stm32_errors_t of a command */
+	uint16_t size;		/* bytes of a phase, data size of a command */
+	uint32_t address;
+	uint64_t start_us;
+	uint64_t duration_us;
+} timeline_event_t ;
+
+/* spans of one port, written by the thread driving it */
+typedef struct timeline {
+	char name[TIMELINE_NAME_SIZE];
+	uint32_t id;				/* Chrome trace thread id */
+	timeline_event_t *events;
+	uint32_t events_count;
+	uint32_t events_capacity;
+	uint32_t events_max;		/* 0 for unbounded */
+	uint32_t dropped;
+} timeline_t ;
+
+void timeline_init(timeline_t *timeline, const char *name, uint32_t id, uint32_t events_max);
+void timeline_free(timeline_t *timeline);
+timeline_event_t *timeline_add(timeline_t *timeline, timeline_kind_t kind, const char *name, uint64_t start_us);
+int timeline_write(FILE *out, timeline_t *const *timelines, uint32_t timelines_count);
+
+#endif /* TIMELINE_H_ */
@@ -0,0 +1,95 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include "trace.h"
+
+#define TRACE_LINE_BYTES	64	/* transfer bytes per emitted line */
+#define TRACE_LINE_SIZE		(64 + TRACE_LINE_BYTES * 3)
+
+trace_level_t trace_level = TRACE_NONE;
+
+static void stderr_sink(trace_level_t level, const char *line, void *arg){
+
+	(void)level;
+	(void)arg;
+
+	fprintf(stderr, "%s\n", line);
+}
+
+static trace_sink_t trace_sink = stderr_sink;
+static void *trace_sink_arg = NULL;
+
+void trace_set_level(trace_level_t level){
+	trace_level = level;
+}
+
+void trace_set_sink(trace_sink_t sink, void *arg){
+
+	trace_sink = sink != NULL ? sink : stderr_sink;
+	trace_sink_arg = arg;
+}
+
+void trace_hex(trace_level_t level, const char *prefix, const void *buffer, int len){
+
+	static const char digits[] = "0123456789abcdef";
+
+	const uint8_t *bytes = buffer;
+	char line[TRACE_LINE_SIZE];
+	int offset = 0;
+
+	/* format whole lines in memory, the sink is called once per line */
+	do {
+		int count = len - offset < TRACE_LINE_BYTES ? len - offset : TRACE_LINE_BYTES;
+		int pos = snprintf(line, 64, "[%d] %s", len, prefix);
+		int i = 0;
+
+		if (pos < 0 || pos > 63)
+			pos = 63;
+
+		for(i = 0; i < count; i++){
+			line[pos++] = ' ';
+			line[pos++] = digits[bytes[offset + i] >> 4];
+			line[pos++] = digits[bytes[offset + i] & 0x0F];
+		}
+
+		line[pos] = '\0';
+		trace_sink(level, line, trace_sink_arg);
+
+		offset += count;
+	} while(offset < len);
+}
+
+void trace_printf(trace_level_t level, const char *format, ...){
+
+	char line[TRACE_LINE_SIZE];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	trace_sink(level, line, trace_sink_arg);
+}
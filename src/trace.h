@@ -0,0 +1,58 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+typedef enum trace_level {
+	TRACE_NONE,
+	TRACE_ERROR,
+	TRACE_INFO,
+	TRACE_DATA	/* every serial transfer as hex */
+} trace_level_t ;
+
+/* receives one formatted line without the trailing newline */
+typedef void (*trace_sink_t)(trace_level_t level, const char *line, void *arg);
+
+extern trace_level_t trace_level;
+
+/* build with -DTRACE_DISABLED to compile every trace point out */
+#ifdef TRACE_DISABLED
+#define TRACE_ENABLED(level)	0
+#else
+#define TRACE_ENABLED(level)	((level) <= trace_level)
+#endif
+
+#define TRACE_HEX(level, prefix, buffer, len) \
+	do { if (TRACE_ENABLED(level)) trace_hex(level, prefix, buffer, len); } while (0)
+
+#define TRACE(level, ...) \
+	do { if (TRACE_ENABLED(level)) trace_printf(level, __VA_ARGS__); } while (0)
+
+void trace_set_level(trace_level_t level);
+void trace_set_sink(trace_sink_t sink, void *arg);
+void trace_hex(trace_level_t level, const char *prefix, const void *buffer, int len);
+void trace_printf(trace_level_t level, const char *format, ...);
+
+#endif /* TRACE_H_ */
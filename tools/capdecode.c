@@ -0,0 +1,57 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+/*
+   Turns a binary wire capture written by capture_dump() into annotated
+   bootloader traffic.
+
+   usage: capdecode <capture file>
+*/
+
+#include <stdio.h>
+#include "capture.h"
+
+int main(int argc, char *argv[]){
+
+	if (argc != 2){
+		fprintf(stderr, "usage: %s <capture file>\n", argv[0]);
+		return 2;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+
+	if (in == NULL){
+		perror(argv[1]);
+		return 1;
+	}
+
+	int result = capture_decode(in, stdout);
+
+	fclose(in);
+
+	if (result != 0){
+		fprintf(stderr, "%s: not a capture file\n", argv[1]);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*
+
+   stm32loader Open Source flash loader program for ST STM32 microcontrollers.
+   <konovalchukov.yakov@gmail.com>
+
+   Copyright 2013 Yakov Konovalchukov
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+
+*/
+
+
+/*
+   Runs a simulated STM32 bootloader on a pseudo-terminal until interrupted.
+   The printed device can be used wherever a serial port is expected.
+
+   usage: stm32sim [-g f4-512k|f4-1m|f4-2m|f7-1m] [-p pid] [-r rate] [-b rate_max]
+                   [-l latency_us] [-w write_us] [-e erase_kb_us] [-n nack_every]
+                   [-c helper_corrupt_every] [-d drop_after] [-k]
+
+   'go' into SRAM starts an emulated RAM helper, see stm32_helper.h.
+   -k offers 'get checksum' (0xA1) like newer bootloaders.
+   -b locks onto the rate of the first byte and drops anything faster, with
+   no reset line only the first rate a host tries can work.
+   -d goes silent for good after that many commands.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "sim.h"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int signal){
+	stop = signal;
+}
+
+static const geometry_t *geometry_named(const char *name){
+
+	if (strcmp(name, "f4-512k") == 0) return &geometry_stm32f4_512k;
+	if (strcmp(name, "f4-1m") == 0) return &geometry_stm32f4_1m;
+	if (strcmp(name, "f4-2m") == 0) return &geometry_stm32f4_2m;
+	if (strcmp(name, "f7-1m") == 0) return &geometry_stm32f7_1m;
+
+	return NULL;
+}
+
+int main(int argc, char *argv[]){
+
+	sim_config_t config;
+	sim_t sim;
+	int option;
+
+	memset(&config, 0, sizeof(config));
+
+	while((option = getopt(argc, argv, "g:p:r:b:l:w:e:n:c:d:k")) != -1){
+		switch(option){
+			case 'g': config.geometry = geometry_named(optarg); if (config.geometry == NULL) goto usage; break;
+			case 'p': config.pid = strtoul(optarg, NULL, 0); break;
+			case 'r': config.rate = strtoul(optarg, NULL, 0); break;
+			case 'b': config.rate_max = strtoul(optarg, NULL, 0); break;
+			case 'l': config.latency_us = strtoul(optarg, NULL, 0); break;
+			case 'w': config.write_us = strtoul(optarg, NULL, 0); break;
+			case 'e': config.erase_kb_us = strtoul(optarg, NULL, 0); break;
+			case 'n': config.nack_every = strtoul(optarg, NULL, 0); break;
+			case 'c': config.helper_corrupt_every = strtoul(optarg, NULL, 0); break;
+			case 'd': config.drop_after = strtoul(optarg, NULL, 0); break;
+			case 'k': config.checksum = 1; break;
+			default:
+				goto usage;
+		}
+	}
+
+	if (sim_open(&sim, &config) != 0){
+		perror("sim_open");
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	printf("%s\n", sim.device);
+	fflush(stdout);
+
+	while(!stop)
+		pause();
+
+	sim_close(&sim);
+
+	fprintf(stderr, "commands %u, nacks %u (%u injected), helper blocks %u (%u failed), rx %llu, tx %llu bytes\n",
+		sim.stats.commands, sim.stats.nacks, sim.stats.nacks_injected, sim.stats.helper_blocks, sim.stats.helper_errors,
+		(unsigned long long)sim.stats.bytes_rx, (unsigned long long)sim.stats.bytes_tx);
+
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-g f4-512k|f4-1m|f4-2m|f7-1m] [-p pid] [-r rate] [-b rate_max] [-l latency_us] [-w write_us] [-e erase_kb_us] [-n nack_every] [-c helper_corrupt_every] [-d drop_after] [-k]\n", argv[0]);
+	return 2;
+}